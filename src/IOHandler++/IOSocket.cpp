@@ -101,12 +101,11 @@ void CIOSocket::socket_callback(IOSocketEvent *event) {
 		else {
 			IOSocketBuffer *recvbuf = event->data.recv_buf;
 			int usedlen;
-			usedlen = this->recvEvent(recvbuf->buffer, recvbuf->bufpos);
-			if(usedlen == recvbuf->bufpos) {
+			usedlen = this->recvEvent(recvbuf->buffer + recvbuf->readpos, recvbuf->bufpos - recvbuf->readpos);
+			recvbuf->readpos += usedlen; // the rest is kept in the buffer and compacted lazily
+			if(recvbuf->readpos == recvbuf->bufpos) {
 				recvbuf->bufpos = 0;
-			} else {
-				memmove(recvbuf->buffer, recvbuf->buffer + usedlen, recvbuf->bufpos - usedlen);
-				recvbuf->bufpos -= usedlen;
+				recvbuf->readpos = 0;
 			}
 		}
 		break;
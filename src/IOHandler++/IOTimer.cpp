@@ -43,17 +43,7 @@ void CIOTimer::setTimeout(timeval timeout) {
 }
 
 void CIOTimer::setRelativeTimeout(timeval timeout) {
-	timeval now;
-	gettimeofday(&now, NULL);
-	
-	timeout.tv_sec += now.tv_sec;
-	timeout.tv_usec += now.tv_usec;
-	while(timeout.tv_usec > 1000000) {
-		timeout.tv_usec -= 1000000;
-		timeout.tv_sec++;
-	}
-	
-	this->setTimeout(timeout);
+	iotimer_set_relative_timeout(this->iotimer, &timeout);
 }
 
 void CIOTimer::setRelativeTimeout(timeval timeout, int auto_reload) {
@@ -18,10 +18,17 @@
 #define _IODNSAddress_struct_h
 #include <sys/time.h>
 #include <stddef.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
 
 struct IODNSAddress {
 	size_t addresslen;
-	struct sockaddr *address;
+	struct sockaddr *address; /* points to storage (NULL if unset) */
+	struct sockaddr_storage storage;
 };
 
 #endif
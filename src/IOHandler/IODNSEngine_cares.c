@@ -25,6 +25,7 @@
 #ifdef HAVE_ARES_H
 #include <ares.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/time.h>
 #ifdef WIN32
 #define _WIN32_WINNT 0x501
@@ -47,14 +48,15 @@ struct dnsengine_cares_socket {
 struct dnsengine_cares_query {
 	int query_count;
 	int query_successful;
+	int query_notfound;
 	struct _IODNSQuery *iodns;
 };
 
 static IOTIMER_CALLBACK(dnsengine_cares_timer_callback);
 
-static ares_channel dnsengine_cares_channel;
-static struct dnsengine_cares_socket dnsengine_cares_sockets[ARES_GETSOCK_MAXNUM];
-static struct IOTimerDescriptor *dnsengine_cares_timer = NULL;
+static IOTHREAD_LOCAL ares_channel dnsengine_cares_channel;
+static IOTHREAD_LOCAL struct dnsengine_cares_socket dnsengine_cares_sockets[ARES_GETSOCK_MAXNUM];
+static IOTHREAD_LOCAL struct IOTimerDescriptor *dnsengine_cares_timer = NULL;
 
 static int dnsengine_cares_init() {
 	int res;
@@ -169,26 +171,18 @@ static void dnsengine_cares_update_sockets() {
 }
 
 static void dnsengine_cares_update_timeout() {
-	struct timeval timeout, now;
+	struct timeval timeout;
 	timeout.tv_sec = 60;
 	timeout.tv_usec = 0;
 	ares_timeout(dnsengine_cares_channel, &timeout, &timeout);
 	
-	gettimeofday(&now, NULL);
-	timeout.tv_sec += now.tv_sec;
-	timeout.tv_usec += now.tv_usec;
-	if(timeout.tv_usec > 1000000) {
-		timeout.tv_sec += 1;
-		timeout.tv_usec -= 1000000;
-	}
-	
-	if(dnsengine_cares_timer)
-		iotimer_set_timeout(dnsengine_cares_timer, &timeout);
-	else {
-		dnsengine_cares_timer = iotimer_create(&timeout);
+	if(!dnsengine_cares_timer) {
+		dnsengine_cares_timer = iotimer_create(NULL);
 		iotimer_set_callback(dnsengine_cares_timer, dnsengine_cares_timer_callback);
+		iotimer_set_relative_timeout(dnsengine_cares_timer, &timeout);
 		iotimer_start(dnsengine_cares_timer);
-	}
+	} else
+		iotimer_set_relative_timeout(dnsengine_cares_timer, &timeout);
 }
 
 static IOTIMER_CALLBACK(dnsengine_cares_timer_callback) {
@@ -206,8 +200,19 @@ static void dnsengine_cares_socket_callback(struct _IOSocket *iosock, int wantre
 }
 
 static void dnsengine_cares_stop() {
-	if(dnsengine_cares_timer)
+	int i;
+	if(dnsengine_cares_timer) {
 		iotimer_destroy(dnsengine_cares_timer);
+		dnsengine_cares_timer = NULL;
+	}
+	// the fds are closed by ares_destroy (pending queries are completed with ARES_EDESTRUCTION)
+	for(i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+		if(dnsengine_cares_sockets[i].iosock) {
+			_free_socket(dnsengine_cares_sockets[i].iosock);
+			dnsengine_cares_sockets[i].iosock = NULL;
+		}
+	}
+	ares_destroy(dnsengine_cares_channel);
 }
 
 
@@ -219,14 +224,14 @@ static void dnsengine_cares_callback(void *arg, int status, int timeouts, struct
 		if(!(iodns->flags & IODNSFLAG_RUNNING)) {
 			// query stopped
 			query->iodns = NULL;
-			iodns = NULL;
 			iodns_free_result(iodns->result);
 			_free_dnsquery(iodns);
+			iodns = NULL;
 		}
 		if(iodns && status == ARES_SUCCESS) {
 			if((iodns->type & IODNS_FORWARD)) {
-				char **h_addr;
-				for(h_addr = host->h_addr_list; *h_addr; h_addr++) {
+				char **addrptr;
+				for(addrptr = host->h_addr_list; *addrptr; addrptr++) {
 					struct IODNSResult *dnsresult = malloc(sizeof(*dnsresult));
 					if(!dnsresult) {
 						iolog_trigger(IOLOG_ERROR, "Failed to allocate memory for IODNSResult in %s:%d", __FILE__, __LINE__);
@@ -241,14 +246,11 @@ static void dnsengine_cares_callback(void *arg, int status, int timeouts, struct
 						dnsresult->type = IODNS_RECORD_AAAA;
 						sockaddrlen = sizeof(struct sockaddr_in6);
 					}
+					memset(&dnsresult->result.addr.storage, 0, sizeof(dnsresult->result.addr.storage));
 					dnsresult->result.addr.addresslen = sockaddrlen;
-					dnsresult->result.addr.address = malloc(sockaddrlen);
-					if(!dnsresult->result.addr.address) {
-						iolog_trigger(IOLOG_ERROR, "Failed to allocate memory for sockaddr in %s:%d", __FILE__, __LINE__);
-						goto dnsengine_cares_callback_finally;
-					}
+					dnsresult->result.addr.address = (struct sockaddr *) &dnsresult->result.addr.storage;
 					void *target = (host->h_addrtype == AF_INET ? ((void *) &((struct sockaddr_in *)dnsresult->result.addr.address)->sin_addr) : ((void *) &((struct sockaddr_in6 *)dnsresult->result.addr.address)->sin6_addr));
-					memcpy(target, *h_addr, host->h_length);
+					memcpy(target, *addrptr, host->h_length);
 					
 					dnsresult->result.addr.address->sa_family = host->h_addrtype;
 					if(host->h_addrtype == AF_INET) {
@@ -284,18 +286,77 @@ static void dnsengine_cares_callback(void *arg, int status, int timeouts, struct
 			}
 			
 			query->query_successful++;
-		}
+		} else if(status == ARES_ENOTFOUND)
+			query->query_notfound++;
 	}
 	dnsengine_cares_callback_finally:
 	if(query->query_count <= 0) {
 		if(iodns) {
 			iodns->flags &= ~(IODNSFLAG_PROCESSING | IODNSFLAG_RUNNING);
+			if(!query->query_successful && query->query_notfound)
+				iodns->flags |= IODNSFLAG_NOTFOUND;
 			iodns_event_callback(iodns, (query->query_successful ? IODNSEVENT_SUCCESS : IODNSEVENT_FAILED));
 		}
 		free(query);
 	}
 }
 
+#ifdef HAVE_ARES_GETADDRINFO
+static void dnsengine_cares_addrinfo_callback(void *arg, int status, int timeouts, struct ares_addrinfo *addrinfo) {
+	struct dnsengine_cares_query *query = arg;
+	struct _IODNSQuery *iodns = query->iodns;
+	struct IODNSResult *dnsresult, **tail = &iodns->result;
+	struct ares_addrinfo_node *node;
+	unsigned int ttl = UINT_MAX; /* lowest record ttl */
+	free(query);
+	
+	if(!(iodns->flags & IODNSFLAG_RUNNING)) {
+		// query stopped
+		if(addrinfo)
+			ares_freeaddrinfo(addrinfo);
+		iodns_free_result(iodns->result);
+		_free_dnsquery(iodns);
+		return;
+	}
+	
+	if(status == ARES_SUCCESS) {
+		for(node = addrinfo->nodes; node; node = node->ai_next) {
+			int type = (node->ai_family == AF_INET6 ? IODNS_RECORD_AAAA : (node->ai_family == AF_INET ? IODNS_RECORD_A : 0));
+			if(!(iodns->type & type))
+				continue;
+			dnsresult = malloc(sizeof(*dnsresult));
+			if(!dnsresult) {
+				iolog_trigger(IOLOG_ERROR, "Failed to allocate memory for IODNSResult in %s:%d", __FILE__, __LINE__);
+				break;
+			}
+			dnsresult->type = type;
+			dnsresult->next = NULL;
+			iodns_set_address(&dnsresult->result.addr, node->ai_addr, node->ai_addrlen);
+			
+			char str[INET6_ADDRSTRLEN];
+			iodns_print_address(&dnsresult->result.addr, (type == IODNS_RECORD_AAAA), str, sizeof(str));
+			iolog_trigger(IOLOG_DEBUG, "Resolved %s to (%s): %s (ttl %d)", iodns->request.host, (type == IODNS_RECORD_AAAA ? "AAAA" : "A"), str, node->ai_ttl);
+			
+			if(node->ai_ttl >= 0 && (unsigned int) node->ai_ttl < ttl)
+				ttl = node->ai_ttl;
+			
+			// keep the order c-ares sorted the addresses in
+			*tail = dnsresult;
+			tail = &dnsresult->next;
+		}
+		// replaces the IODNS_CACHE_TTL default (the cache caps it to IODNS_CACHE_MAX_TTL)
+		if(ttl != UINT_MAX)
+			iodns->ttl = ttl;
+	} else if(status == ARES_ENOTFOUND)
+		iodns->flags |= IODNSFLAG_NOTFOUND;
+	if(addrinfo)
+		ares_freeaddrinfo(addrinfo);
+	
+	iodns->flags &= ~(IODNSFLAG_PROCESSING | IODNSFLAG_RUNNING);
+	iodns_event_callback(iodns, (iodns->result ? IODNSEVENT_SUCCESS : IODNSEVENT_FAILED));
+}
+#endif
+
 static void dnsengine_cares_add(struct _IODNSQuery *iodns) {
 	struct dnsengine_cares_query *query = malloc(sizeof(*query));
 	if(!query) {
@@ -306,17 +367,30 @@ static void dnsengine_cares_add(struct _IODNSQuery *iodns) {
 	iodns->query = query;
 	query->query_count = 0;
 	query->query_successful = 0;
+	query->query_notfound = 0;
 	query->iodns = iodns;
 	iodns->flags |= IODNSFLAG_PROCESSING;
 	if((iodns->type & IODNS_FORWARD)) {
-		if((iodns->type & IODNS_RECORD_A)) {
-			query->query_count++;
+		#ifdef HAVE_ARES_GETADDRINFO
+		// ares_getaddrinfo reports the record ttls (used by the dns cache)
+		struct ares_addrinfo_hints hints;
+		memset(&hints, 0, sizeof(hints));
+		if((iodns->type & IODNS_FORWARD) == IODNS_FORWARD)
+			hints.ai_family = AF_UNSPEC;
+		else
+			hints.ai_family = ((iodns->type & IODNS_RECORD_AAAA) ? AF_INET6 : AF_INET);
+		hints.ai_socktype = SOCK_STREAM;
+		query->query_count = 1;
+		ares_getaddrinfo(dnsengine_cares_channel, iodns->request.host, NULL, &hints, dnsengine_cares_addrinfo_callback, query);
+		#else
+		// count all sub queries first: c-ares calls back synchronously for hosts file entries
+		int lookup_a = (iodns->type & IODNS_RECORD_A), lookup_aaaa = (iodns->type & IODNS_RECORD_AAAA);
+		query->query_count = (lookup_a ? 1 : 0) + (lookup_aaaa ? 1 : 0);
+		if(lookup_a)
 			ares_gethostbyname(dnsengine_cares_channel, iodns->request.host, AF_INET, dnsengine_cares_callback, query);
-		}
-		if((iodns->type & IODNS_RECORD_AAAA)) {
-			query->query_count++;
+		if(lookup_aaaa)
 			ares_gethostbyname(dnsengine_cares_channel, iodns->request.host, AF_INET6, dnsengine_cares_callback, query);
-		}
+		#endif
 	} else if((iodns->type & IODNS_REVERSE)) {
 		query->query_count++;
 		struct sockaddr *addr = iodns->request.addr.address;
@@ -38,249 +38,244 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* getaddrinfo / getnameinfo block, so they run on a worker pool (_enqueue_job).
+ * workers only see a copy of the request (struct dnsengine_default_job) and don't log:
+ * errors are recorded in the job and logged by the loop.
+ * without threads the queries are resolved in the loop (blocking).
+ */
 
-#ifdef IODNS_USE_THREADS
-#define IODNS_MAX_THREAD 10
-#define IODNS_INC_THREAD_BY_LOAD 5 /* add another thread when there are more than IODNS_INC_THREAD_BY_LOAD querys per thread */
-static pthread_t *iodns_thread[IODNS_MAX_THREAD];
-static int iodns_threads_wanted = 1;
-static int iodns_threads_running = 0;
-
-static pthread_cond_t iodns_cond;
-static pthread_mutex_t iodns_sync, iodns_sync2;
-#endif
-static int iodns_loop_blocking = 0;
-
-static void iodns_process_queries();
+struct dnsengine_default_job {
+	#ifdef IODNS_USE_THREADS
+	struct IOWorkerJob worker; /* (first member) */
+	#endif
+	struct _IODNSQuery *iodns; /* only touched by the owning loop */
+	
+	unsigned int type : 8;
+	unsigned int notfound : 1;
+	unsigned int nomem : 1;
+	int error; /* getaddrinfo / getnameinfo error code */
+	union {
+		struct IODNSAddress addr;
+		char *host;
+	} request;
+	struct IODNSResult *result;
+};
 
-#ifdef IODNS_USE_THREADS
-static void *dnsengine_worker_main(void *arg) {
-	struct _IODNSQuery *query;
-	while(1) {
-		IOSYNCHRONIZE(iodns_sync);
-		if(iodns_threads_wanted < iodns_threads_running) {
-			iodns_threads_running--;
-			break;
-		}
-		
-		for(query = iodnsquery_first; query; query = query->next) {
-			if((query->flags & IODNSFLAG_RUNNING))
-				break;
+static enum IODNSEventType dnsengine_default_resolve(struct dnsengine_default_job *job) {
+	enum IODNSEventType querystate = IODNSEVENT_FAILED;
+	struct addrinfo hints, *res, *allres;
+	struct IODNSResult *dnsresult, **tail = &job->result;
+	int ret;
+	
+	if((job->type & IODNS_FORWARD)) {
+		memset (&hints, 0, sizeof (hints));
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags |= AI_CANONNAME;
+		if (!(ret = getaddrinfo(job->request.host, NULL, &hints, &allres))) {
+			for(res = allres; res; res = res->ai_next) {
+				int type = (res->ai_family == AF_INET6 ? IODNS_RECORD_AAAA : (res->ai_family == AF_INET ? IODNS_RECORD_A : 0));
+				if(!(job->type & type))
+					continue;
+				dnsresult = malloc(sizeof(*dnsresult));
+				if(!dnsresult) {
+					job->nomem = 1;
+					break;
+				}
+				dnsresult->type = type;
+				dnsresult->next = NULL;
+				iodns_set_address(&dnsresult->result.addr, res->ai_addr, res->ai_addrlen);
+				
+				// keep the order getaddrinfo sorted the addresses in
+				*tail = dnsresult;
+				tail = &dnsresult->next;
+				querystate = IODNSEVENT_SUCCESS;
+			}
+			freeaddrinfo(allres);
+		} else {
+			if(ret == EAI_NONAME)
+				job->notfound = 1;
+			job->error = ret;
 		}
-		IODESYNCHRONIZE(iodns_sync);
-		if(!query)
-			pthread_cond_wait(&iodns_cond, &iodns_sync2);
-		
-		if(iodns_threads_wanted < iodns_threads_running) {
-			iodns_threads_running--;
-			break;
+	} else if((job->type & IODNS_REVERSE)) {
+		char hostname[NI_MAXHOST];
+		if(!(ret = getnameinfo(job->request.addr.address, job->request.addr.addresslen, hostname, sizeof(hostname), NULL, 0, 0))) {
+			dnsresult = malloc(sizeof(*dnsresult));
+			if(!dnsresult) {
+				job->nomem = 1;
+				return querystate;
+			}
+			dnsresult->type = IODNS_RECORD_PTR;
+			dnsresult->result.host = strdup(hostname);
+			dnsresult->next = NULL;
+			*tail = dnsresult;
+			
+			querystate = IODNSEVENT_SUCCESS;
+		} else
+			job->error = ret;
+	}
+	return querystate;
+}
+
+static void dnsengine_default_log(struct dnsengine_default_job *job) {
+	struct IODNSResult *dnsresult;
+	char str[INET6_ADDRSTRLEN];
+	if(job->nomem)
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IODNSResult in %s:%d", __FILE__, __LINE__);
+	if(job->error)
+		iolog_trigger(IOLOG_WARNING, "%s returned error code: %d", ((job->type & IODNS_FORWARD) ? "getaddrinfo" : "getnameinfo"), job->error);
+	for(dnsresult = job->result; dnsresult; dnsresult = dnsresult->next) {
+		if(dnsresult->type == IODNS_RECORD_PTR) {
+			iodns_print_address(&job->request.addr, (job->request.addr.address->sa_family == AF_INET6), str, sizeof(str));
+			iolog_trigger(IOLOG_DEBUG, "Resolved %s to (PTR): %s", str, dnsresult->result.host);
+		} else {
+			iodns_print_address(&dnsresult->result.addr, (dnsresult->type == IODNS_RECORD_AAAA), str, sizeof(str));
+			iolog_trigger(IOLOG_DEBUG, "Resolved %s to (%s): %s", job->request.host, (dnsresult->type == IODNS_RECORD_AAAA ? "AAAA" : "A"), str);
 		}
-		
-		iodns_process_queries();
 	}
-	return NULL;
 }
 
-static int dnsengine_default_start_worker() {
-	if(iodns_threads_wanted >= IODNS_MAX_THREAD-1)
-		return 0;
-	int i;
-	for(i = 0; i < IODNS_MAX_THREAD; i++) {
-		if(!iodns_thread[i]) 
-			break;
+static void dnsengine_default_finish(struct _IODNSQuery *iodns, struct dnsengine_default_job *job) {
+	enum IODNSEventType querystate = (job->result ? IODNSEVENT_SUCCESS : IODNSEVENT_FAILED);
+	dnsengine_default_log(job);
+	iodns->query = NULL;
+	if(!(iodns->flags & IODNSFLAG_RUNNING)) {
+		// query stopped
+		iodns_free_result(job->result);
+		_free_dnsquery(iodns);
+		return;
 	}
-	if(i >= IODNS_MAX_THREAD)
-		return 0;
-	iodns_thread[i] = malloc(sizeof(**iodns_thread));
-	if(!iodns_thread[i])
+	iodns->result = job->result;
+	if(job->notfound)
+		iodns->flags |= IODNSFLAG_NOTFOUND;
+	iodns->flags &= ~(IODNSFLAG_PROCESSING | IODNSFLAG_RUNNING);
+	iodns_event_callback(iodns, querystate);
+}
+
+#ifdef IODNS_USE_THREADS
+static void dnsengine_default_free_job(struct dnsengine_default_job *job) {
+	if((job->type & IODNS_FORWARD))
+		free(job->request.host);
+	free(job);
+}
+
+static IOWORKER_JOB(dnsengine_default_step) {
+	dnsengine_default_resolve((struct dnsengine_default_job *) job);
+}
+
+static IOWORKER_JOB(dnsengine_default_complete) {
+	struct dnsengine_default_job *dnsjob = (struct dnsengine_default_job *) job;
+	dnsengine_default_finish(dnsjob->iodns, dnsjob);
+	dnsengine_default_free_job(dnsjob);
+}
+
+static IOWORKER_JOB(dnsengine_default_drop) {
+	struct dnsengine_default_job *dnsjob = (struct dnsengine_default_job *) job;
+	iodns_free_result(dnsjob->result);
+	dnsengine_default_free_job(dnsjob);
+}
+
+static pthread_t dnsengine_default_threads[IODNS_THREADS];
+static struct IOWorkerPool dnsengine_default_pool = IOWORKER_POOL(dnsengine_default_step, dnsengine_default_complete, dnsengine_default_drop, dnsengine_default_threads);
+
+static int dnsengine_default_enqueue(struct _IODNSQuery *iodns) {
+	struct dnsengine_default_job *job = calloc(1, sizeof(*job));
+	if(!job) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for dnsengine_default_job in %s:%d", __FILE__, __LINE__);
 		return 0;
-	iodns_threads_wanted++;
-	if(pthread_create(iodns_thread[i], NULL, dnsengine_worker_main, NULL)) {
-		iodns_threads_wanted--;
-		iolog_trigger(IOLOG_ERROR, "could not create pthread in %s:%d (Returned: %i)", __FILE__, __LINE__, thread_err);
+	}
+	job->iodns = iodns;
+	job->type = iodns->type;
+	if((iodns->type & IODNS_FORWARD)) {
+		if(!(job->request.host = strdup(iodns->request.host))) {
+			free(job);
+			return 0;
+		}
+	} else
+		iodns_set_address(&job->request.addr, iodns->request.addr.address, iodns->request.addr.addresslen);
+	
+	if(!_enqueue_job(&dnsengine_default_pool, &job->worker)) {
+		dnsengine_default_free_job(job);
 		return 0;
 	}
-	iodns_threads_running++;
+	iodns->query = job;
+	iodns->flags |= IODNSFLAG_PROCESSING;
 	return 1;
 }
+
+static void dnsengine_default_release(struct IOWorkerJob *jobs) {
+	// the queries are resolved by dnsengine_default_loop if the thread keeps running
+	struct dnsengine_default_job *job;
+	while((job = (struct dnsengine_default_job *) jobs)) {
+		jobs = jobs->next;
+		job->iodns->query = NULL;
+		job->iodns->flags &= ~IODNSFLAG_PROCESSING;
+		if(!(job->iodns->flags & IODNSFLAG_RUNNING))
+			_free_dnsquery(job->iodns); // query stopped
+		dnsengine_default_drop(&job->worker);
+	}
+}
+
+static void dnsengine_default_detach(struct IOHandlerLoop *loop) {
+	// the loop stops: take its jobs back, so no worker posts to it afterwards
+	struct IOWorkerJob *queued, *finished;
+	finished = _detach_workers(&dnsengine_default_pool, loop, &queued);
+	dnsengine_default_release(finished);
+	dnsengine_default_release(queued);
+}
 #endif
 
 static int dnsengine_default_init() {
 	#ifdef IODNS_USE_THREADS
-	/* create worker thread */
-	pthread_cond_init(&iodns_cond, NULL);
-	IOTHREAD_MUTEX_INIT(iodns_sync);
-	IOTHREAD_MUTEX_INIT(iodns_sync2);
-	
-	if(!dnsengine_default_start_worker()) {
-		iodns_loop_blocking = 1;
-		iodns_threads_running = 0;
-	}
-	#else
-	iodns_loop_blocking = 1;
+	// workers are started on demand and shared by all loops
+	_start_workers(&dnsengine_default_pool, IODNS_THREADS);
 	#endif
 	return 1;
 }
 
 static void dnsengine_default_stop() {
 	#ifdef IODNS_USE_THREADS
-	int i;
-	if(iodns_thread_running) {
-		iodns_threads_wanted = 0;
-		IOSYNCHRONIZE(iodns_sync2);
-		pthread_cond_broadcast(&iodns_cond);
-		IODESYNCHRONIZE(iodns_sync2);
-		for(i = 0; i < IODNS_MAX_THREAD; i++) {
-			if(iodns_thread[i]) {
-				pthread_join(*iodns_thread[i], NULL);
-				free(iodns_thread[i]);
-				iodns_thread[i] = NULL;
-			}
-		}
-	}
+	_stop_workers(&dnsengine_default_pool);
 	#endif
 }
 
 static void dnsengine_default_add(struct _IODNSQuery *iodns) {
 	#ifdef IODNS_USE_THREADS
-	if(iodns_thread_running) {
-		IOSYNCHRONIZE(iodns_sync2);
-		pthread_cond_signal(&iodns_cond);
-		IODESYNCHRONIZE(iodns_sync2);
-		
-		int querycount = 0;
-		for(iodns = iodnsquery_first; iodns; iodns = iodns->next) {
-			if(!(iodns->flags & IODNSFLAG_RUNNING))
-				continue;
-			if((iodns->flags & IODNSFLAG_PROCESSING))
-				continue;
-			querycount++;
-		}
-		if(querycount / iodns_threads_wanted > IODNS_INC_THREAD_BY_LOAD) {
-			dnsengine_default_start_worker();
-		}
-	}
+	if(dnsengine_default_enqueue(iodns))
+		return;
 	#endif
+	// resolved by dnsengine_default_loop
 }
 
 static void dnsengine_default_remove(struct _IODNSQuery *iodns) {
-	/* unused */
+	/* running jobs are dropped when they complete */
 }
 
 static void dnsengine_default_loop() {
-	if(iodns_loop_blocking)
-		iodns_process_queries();
-}
-
-static void iodns_process_queries() {
-	enum IODNSEventType querystate;
-	struct addrinfo hints, *res, *allres;
-	struct _IODNSQuery *iodns, *next_iodns;
-	struct IODNSResult *dnsresult;
-	int ret;
-	iodns_process_queries_start:
-	IOSYNCHRONIZE(iodns_sync);
-	for(iodns = iodnsquery_first; iodns; iodns = next_iodns) {
-		next_iodns = iodns->next;
-		
+	// blocking fallback for queries that could not be handed to a worker
+	struct _IODNSQuery *iodns;
+	struct dnsengine_default_job job;
+	
+	dnsengine_default_loop_start:
+	for(iodns = iodnsquery_first; iodns; iodns = iodns->next) {
 		if(!(iodns->flags & IODNSFLAG_RUNNING))
 			continue;
 		if((iodns->flags & IODNSFLAG_PROCESSING))
 			continue;
-		iodns->flags |= IODNSFLAG_PROCESSING;
 		
-		IODESYNCHRONIZE(iodns_sync);
+		memset(&job, 0, sizeof(job));
+		job.type = iodns->type;
+		if((iodns->type & IODNS_FORWARD))
+			job.request.host = iodns->request.host;
+		else
+			iodns_set_address(&job.request.addr, iodns->request.addr.address, iodns->request.addr.addresslen);
 		
-		querystate = IODNSEVENT_FAILED;
+		iodns->flags |= IODNSFLAG_PROCESSING;
+		dnsengine_default_resolve(&job);
+		dnsengine_default_finish(iodns, &job);
 		
-		if((iodns->type & IODNS_FORWARD)) {
-			memset (&hints, 0, sizeof (hints));
-			hints.ai_family = PF_UNSPEC;
-			hints.ai_socktype = SOCK_STREAM;
-			hints.ai_flags |= AI_CANONNAME;
-			if (!(ret = getaddrinfo(iodns->request.host, NULL, &hints, &allres))) {
-				res = allres;
-				while (res) {
-					switch (res->ai_family) {
-					case AF_INET:
-						if((iodns->type & IODNS_RECORD_A)) {
-							dnsresult = malloc(sizeof(*dnsresult));
-							dnsresult->type = IODNS_RECORD_A;
-							dnsresult->result.addr.addresslen = res->ai_addrlen;
-							dnsresult->result.addr.address = calloc(dnsresult->result.addr.addresslen, 1);
-							dnsresult->result.addr.address->sa_family = AF_INET;
-							memcpy(dnsresult->result.addr.address, res->ai_addr, dnsresult->result.addr.addresslen);
-							dnsresult->next = iodns->result;
-							iodns->result = dnsresult;
-							
-							char str[INET_ADDRSTRLEN];
-							inet_ntop( AF_INET, &((struct sockaddr_in *)dnsresult->result.addr.address)->sin_addr, str, INET_ADDRSTRLEN );
-							iolog_trigger(IOLOG_DEBUG, "Resolved %s to (A): %s", iodns->request.host, str);
-							
-							querystate = IODNSEVENT_SUCCESS;
-						}
-						break;
-					case AF_INET6:
-						if((iodns->type & IODNS_RECORD_AAAA)) {
-							dnsresult = malloc(sizeof(*dnsresult));
-							dnsresult->type = IODNS_RECORD_AAAA;
-							dnsresult->result.addr.addresslen = res->ai_addrlen;
-							dnsresult->result.addr.address = calloc(dnsresult->result.addr.addresslen, 1);
-							dnsresult->result.addr.address->sa_family = AF_INET6;
-							memcpy(dnsresult->result.addr.address, res->ai_addr, dnsresult->result.addr.addresslen);
-							dnsresult->next = iodns->result;
-							iodns->result = dnsresult;
-							
-							char str[INET6_ADDRSTRLEN];
-							inet_ntop( AF_INET6, &((struct sockaddr_in6 *)dnsresult->result.addr.address)->sin6_addr, str, INET6_ADDRSTRLEN );
-							iolog_trigger(IOLOG_DEBUG, "Resolved %s to (AAAA): %s", iodns->request.host, str);
-							
-							querystate = IODNSEVENT_SUCCESS;
-						}
-						break;
-					}
-					res = res->ai_next;
-				}
-				freeaddrinfo(allres);
-			} else {
-				iolog_trigger(IOLOG_WARNING, "getaddrinfo returned error code: %d", ret);
-			}
-		} else if((iodns->type & IODNS_REVERSE)) {
-			char hostname[NI_MAXHOST];
-			if(!(ret = getnameinfo(iodns->request.addr.address, iodns->request.addr.addresslen, hostname, sizeof(hostname), NULL, 0, 0))) {
-				dnsresult = malloc(sizeof(*dnsresult));
-				dnsresult->type = IODNS_RECORD_PTR;
-				dnsresult->result.host = strdup(hostname);
-				dnsresult->next = iodns->result;
-				iodns->result = dnsresult;
-				
-				if(iodns->request.addr.address->sa_family == AF_INET) {
-					char str[INET_ADDRSTRLEN];
-					inet_ntop(AF_INET, &((struct sockaddr_in *)iodns->request.addr.address)->sin_addr, str, INET_ADDRSTRLEN);
-					iolog_trigger(IOLOG_DEBUG, "Resolved %s to (PTR): %s", str, hostname);
-				} else {
-					char str[INET6_ADDRSTRLEN];
-					inet_ntop(AF_INET6, &((struct sockaddr_in6 *)iodns->request.addr.address)->sin6_addr, str, INET6_ADDRSTRLEN);
-					iolog_trigger(IOLOG_DEBUG, "Resolved %s to (PTR): %s", str, hostname);
-				}
-				
-				querystate = IODNSEVENT_SUCCESS;
-			} else {
-				iolog_trigger(IOLOG_WARNING, "getnameinfo returned error code: %d", ret);
-			}
-			
-		}
-		IOSYNCHRONIZE(iodns_sync);
-		if(!(iodns->flags & IODNSFLAG_RUNNING)) {
-			iodns_free_result(iodns->result);
-			_free_dnsquery(iodns);
-			IODESYNCHRONIZE(iodns_sync);
-			goto iodns_process_queries_start;
-		}
-		iodns->flags &= ~(IODNSFLAG_PROCESSING | IODNSFLAG_RUNNING);
-		IODESYNCHRONIZE(iodns_sync);
-		iodns_event_callback(iodns, querystate);
-		goto iodns_process_queries_start;
+		// the callback may have changed the query list
+		goto dnsengine_default_loop_start;
 	}
 }
 
@@ -288,6 +283,9 @@ struct IODNSEngine dnsengine_default = {
 	.name = "default",
 	.init = dnsengine_default_init,
 	.stop = dnsengine_default_stop,
+	#ifdef IODNS_USE_THREADS
+	.detach = dnsengine_default_detach,
+	#endif
 	.add = dnsengine_default_add,
 	.remove = dnsengine_default_remove,
 	.loop = dnsengine_default_loop,
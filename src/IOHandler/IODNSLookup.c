@@ -21,6 +21,7 @@
 #include "IODNSLookup.h"
 #include "IOLog.h"
 #include "IOSockets.h"
+#include "IOTimer.h"
 
 #ifdef WIN32
 #ifdef _WIN32_WINNT
@@ -41,11 +42,39 @@
 #include "compat/inet.h"
 
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
-struct _IODNSQuery *iodnsquery_first = NULL;
-struct _IODNSQuery *iodnsquery_last = NULL;
+struct IODNSCacheEntry {
+	char *host;
+	unsigned int type : 8;
+	unsigned int delivering : 1;
+	unsigned int bucket;
+	struct timeval expire;
+	struct IODNSResult *result; /* NULL for negative entries */
+	
+	struct _IODNSQuery *query; /* running engine query */
+	struct _IODNSQuery *waiting; /* queries waiting for the engine query */
+	
+	struct IODNSCacheEntry *next;
+};
+
+IOTHREAD_LOCAL struct _IODNSQuery *iodnsquery_first = NULL;
+IOTHREAD_LOCAL struct _IODNSQuery *iodnsquery_last = NULL;
 
-struct IODNSEngine *dnsengine = NULL;
+IOTHREAD_LOCAL struct IODNSEngine *dnsengine = NULL;
+
+static IOTHREAD_LOCAL struct IODNSCacheEntry *iodns_cache[IODNS_CACHE_BUCKETS];
+static IOTHREAD_LOCAL int iodns_cache_count = 0;
+static IOTHREAD_LOCAL struct _IODNSQuery *iodns_cache_ready = NULL; /* cache hits waiting for iodns_cache_flush */
+static IOTHREAD_LOCAL struct _IODNSQuery **iodns_cache_ready_tail = NULL; /* (valid while iodns_cache_ready is set) */
+
+static int iodns_cache_start(struct _IODNSQuery *query);
+static void iodns_cache_detach(struct _IODNSQuery *query);
+static void iodns_cache_complete(struct _IODNSQuery *lookup, enum IODNSEventType state);
+static void iodns_cache_clear();
+static void iodns_cache_flush();
+static struct IODNSResult *iodns_copy_result(struct IODNSResult *result);
 
 static void iodns_init_engine() {
 	if(dnsengine)
@@ -66,6 +95,39 @@ void _init_iodns() {
 	iodns_init_engine();
 }
 
+void _detach_iodns(struct IOHandlerLoop *loop) {
+	// the posted flush won't run anymore
+	iodns_cache_flush();
+	if(dnsengine && dnsengine->detach)
+		dnsengine->detach(loop);
+}
+
+void _stop_iodns() {
+	// release the dns state of the current thread (no further events are triggered)
+	struct _IODNSQuery *query;
+	struct IOSocketDNSLookup *lookup;
+	for(query = iodnsquery_first; query; query = query->next) {
+		if((query->flags & IODNSFLAG_PARENT_PUBLIC))
+			free(query->parent);
+		else if((query->flags & IODNSFLAG_PARENT_SOCKET) && !(lookup = query->parent)->iosocket)
+			free(lookup); // socket closed while the lookup was pending
+		query->parent = NULL;
+		query->flags &= ~(IODNSFLAG_RUNNING | IODNSFLAG_PARENT_PUBLIC | IODNSFLAG_PARENT_SOCKET); // queries completed by the engine while stopping are just freed
+	}
+	if(dnsengine) {
+		if(dnsengine->stop)
+			dnsengine->stop();
+		dnsengine = NULL;
+	}
+	while((query = iodnsquery_first)) {
+		if(query->result)
+			iodns_free_result(query->result);
+		_free_dnsquery(query);
+	}
+	iodns_cache_ready = NULL;
+	iodns_cache_clear();
+}
+
 struct _IODNSQuery *_create_dnsquery() {
 	struct _IODNSQuery *query = calloc(1, sizeof(*query));
 	if(!query) {
@@ -82,6 +144,8 @@ struct _IODNSQuery *_create_dnsquery() {
 }
 
 void _start_dnsquery(struct _IODNSQuery *query) {
+	if((query->type & IODNS_FORWARD) && iodns_cache_start(query))
+		return;
 	query->flags |= IODNSFLAG_RUNNING;
 	dnsengine->add(query);
 }
@@ -95,13 +159,20 @@ void _free_dnsquery(struct _IODNSQuery *query) {
 		query->next->prev = query->prev;
 	else
 		iodnsquery_last = query->prev;
-	if((query->type & IODNS_REVERSE) && query->request.addr.address)
-		free(query->request.addr.address);
+	if((query->type & IODNS_FORWARD) && query->request.host)
+		free(query->request.host);
 	free(query);
 }
 
 void _stop_dnsquery(struct _IODNSQuery *query) {
-	if((query->flags & IODNSFLAG_RUNNING)) {
+	if((query->flags & IODNSFLAG_WAITING)) {
+		iodns_cache_detach(query);
+		if(query->result) {
+			// copied cache hit that has not been delivered
+			iodns_free_result(query->result);
+			query->result = NULL;
+		}
+	} else if((query->flags & IODNSFLAG_RUNNING)) {
 		query->flags &= ~IODNSFLAG_RUNNING;
 		dnsengine->remove(query);
 	}
@@ -139,6 +210,8 @@ void iodns_event_callback(struct _IODNSQuery *query, enum IODNSEventType state)
 		_stop_dnsquery(query);
 		iosocket_lookup_callback(parent, &event);
 		
+	} else if((query->flags & IODNSFLAG_PARENT_CACHE)) {
+		iodns_cache_complete(query, state);
 	}
 }
 
@@ -147,6 +220,223 @@ void iodns_poll() {
 		dnsengine->loop();
 }
 
+/* forward lookup cache
+ * identical queries share one engine query (entry->query) and receive copies of its result.
+ * results are kept for their ttl, nonexistent names for IODNS_CACHE_NEGATIVE_TTL.
+ */
+
+static unsigned int iodns_cache_hash(const char *host, int type) {
+	unsigned int hash = type;
+	for(; *host; host++)
+		hash = hash * 31 + tolower((unsigned char) *host);
+	return hash % IODNS_CACHE_BUCKETS;
+}
+
+static void iodns_cache_clear() {
+	struct IODNSCacheEntry *entry;
+	int i;
+	for(i = 0; i < IODNS_CACHE_BUCKETS; i++) {
+		while((entry = iodns_cache[i])) {
+			iodns_cache[i] = entry->next;
+			iodns_free_result(entry->result);
+			free(entry->host);
+			free(entry);
+		}
+	}
+	iodns_cache_count = 0;
+}
+
+static int iodns_cache_valid(struct IODNSCacheEntry *entry) {
+	return (entry->query || timeval_is_bigger(entry->expire, iotimer_now));
+}
+
+static void iodns_cache_remove(struct IODNSCacheEntry *entry) {
+	struct IODNSCacheEntry **link;
+	for(link = &iodns_cache[entry->bucket]; *link; link = &(*link)->next) {
+		if(*link == entry) {
+			*link = entry->next;
+			break;
+		}
+	}
+	iodns_cache_count--;
+	iodns_free_result(entry->result);
+	free(entry->host);
+	free(entry);
+}
+
+static void iodns_cache_evict() {
+	// drop expired entries first, then the one expiring next
+	struct IODNSCacheEntry *entry, *next_entry, *oldest = NULL;
+	int i;
+	for(i = 0; i < IODNS_CACHE_BUCKETS; i++) {
+		for(entry = iodns_cache[i]; entry; entry = next_entry) {
+			next_entry = entry->next;
+			if(entry->query || entry->delivering)
+				continue;
+			if(!iodns_cache_valid(entry))
+				iodns_cache_remove(entry);
+			else if(!oldest || timeval_is_smaler(entry->expire, oldest->expire))
+				oldest = entry;
+		}
+	}
+	if(iodns_cache_count >= IODNS_CACHE_SIZE && oldest)
+		iodns_cache_remove(oldest);
+}
+
+static struct IODNSCacheEntry *iodns_cache_find(const char *host, int type, unsigned int bucket) {
+	struct IODNSCacheEntry *entry, *next_entry;
+	for(entry = iodns_cache[bucket]; entry; entry = next_entry) {
+		next_entry = entry->next;
+		if(iodns_cache_valid(entry)) {
+			if(entry->type == type && !strcasecmp(entry->host, host))
+				return entry;
+		} else if(!entry->delivering)
+			iodns_cache_remove(entry);
+	}
+	return NULL;
+}
+
+static void iodns_cache_deliver(struct _IODNSQuery *query, struct IODNSCacheEntry *entry) {
+	if(entry->result && (query->result = iodns_copy_result(entry->result)))
+		iodns_event_callback(query, IODNSEVENT_SUCCESS);
+	else
+		iodns_event_callback(query, IODNSEVENT_FAILED);
+}
+
+static void iodns_cache_flush() {
+	struct _IODNSQuery *query;
+	// queries started by the callbacks are appended & delivered by this loop as well
+	while((query = iodns_cache_ready)) {
+		iodns_cache_detach(query);
+		iodns_event_callback(query, (query->result ? IODNSEVENT_SUCCESS : IODNSEVENT_FAILED));
+	}
+}
+
+static IOHANDLER_TASK(iodns_cache_flush_task) {
+	iodns_cache_flush();
+}
+
+static int iodns_cache_hit(struct _IODNSQuery *query, struct IODNSCacheEntry *entry) {
+	// delivered from the loop: the caller gets the query before its callback runs
+	if(!iodns_cache_ready && !iohandler_post(NULL, iodns_cache_flush_task, NULL))
+		return 0;
+	if(entry->result)
+		query->result = iodns_copy_result(entry->result); // NULL (failed) if out of memory
+	query->flags |= IODNSFLAG_WAITING;
+	query->cache = NULL;
+	query->cache_next = NULL;
+	if(!iodns_cache_ready)
+		iodns_cache_ready_tail = &iodns_cache_ready;
+	*iodns_cache_ready_tail = query;
+	iodns_cache_ready_tail = &query->cache_next;
+	return 1;
+}
+
+static void iodns_cache_attach(struct _IODNSQuery *query, struct IODNSCacheEntry *entry) {
+	query->flags |= IODNSFLAG_WAITING;
+	query->cache = entry;
+	query->cache_next = entry->waiting;
+	entry->waiting = query;
+}
+
+static void iodns_cache_detach(struct _IODNSQuery *query) {
+	struct _IODNSQuery **link;
+	for(link = (query->cache ? &query->cache->waiting : &iodns_cache_ready); *link; link = &(*link)->cache_next) {
+		if(*link == query) {
+			*link = query->cache_next;
+			if(!query->cache && iodns_cache_ready_tail == &query->cache_next)
+				iodns_cache_ready_tail = link;
+			break;
+		}
+	}
+	query->flags &= ~IODNSFLAG_WAITING;
+	query->cache = NULL;
+	query->cache_next = NULL;
+}
+
+static int iodns_cache_start(struct _IODNSQuery *query) {
+	unsigned int bucket = iodns_cache_hash(query->request.host, query->type);
+	struct IODNSCacheEntry *entry = iodns_cache_find(query->request.host, query->type, bucket);
+	struct _IODNSQuery *lookup;
+	
+	if(entry) {
+		if(!entry->query)
+			return iodns_cache_hit(query, entry); // 0: ask the engine
+		iodns_cache_attach(query, entry);
+		return 1;
+	}
+	
+	if(iodns_cache_count >= IODNS_CACHE_SIZE)
+		iodns_cache_evict();
+	
+	entry = calloc(1, sizeof(*entry));
+	if(!entry) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IODNSCacheEntry in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	lookup = _create_dnsquery();
+	if(!lookup) {
+		free(entry);
+		return 0;
+	}
+	lookup->type = query->type;
+	entry->host = strdup(query->request.host);
+	lookup->request.host = strdup(query->request.host);
+	if(!entry->host || !lookup->request.host) {
+		iolog_trigger(IOLOG_ERROR, "could not duplicate hostname for IODNSCacheEntry in %s:%d", __FILE__, __LINE__);
+		if(entry->host)
+			free(entry->host);
+		free(entry);
+		_free_dnsquery(lookup);
+		return 0;
+	}
+	entry->type = query->type;
+	entry->bucket = bucket;
+	entry->query = lookup;
+	entry->next = iodns_cache[bucket];
+	iodns_cache[bucket] = entry;
+	iodns_cache_count++;
+	
+	lookup->flags |= IODNSFLAG_PARENT_CACHE;
+	lookup->parent = entry;
+	lookup->ttl = IODNS_CACHE_TTL;
+	
+	iodns_cache_attach(query, entry);
+	
+	lookup->flags |= IODNSFLAG_RUNNING;
+	dnsengine->add(lookup);
+	return 1;
+}
+
+static void iodns_cache_complete(struct _IODNSQuery *lookup, enum IODNSEventType state) {
+	struct IODNSCacheEntry *entry = lookup->parent;
+	struct _IODNSQuery *query;
+	
+	entry->query = NULL;
+	entry->expire = iotimer_now;
+	if(state == IODNSEVENT_SUCCESS && lookup->result) {
+		entry->result = lookup->result;
+		entry->expire.tv_sec += (lookup->ttl > IODNS_CACHE_MAX_TTL ? IODNS_CACHE_MAX_TTL : lookup->ttl);
+	} else {
+		iodns_free_result(lookup->result);
+		if((lookup->flags & IODNSFLAG_NOTFOUND))
+			entry->expire.tv_sec += IODNS_CACHE_NEGATIVE_TTL;
+	}
+	lookup->result = NULL;
+	_stop_dnsquery(lookup);
+	
+	// the entry must survive new queries started from the callbacks
+	entry->delivering = 1;
+	while((query = entry->waiting)) {
+		iodns_cache_detach(query);
+		iodns_cache_deliver(query, entry);
+	}
+	entry->delivering = 0;
+	
+	if(!iodns_cache_valid(entry))
+		iodns_cache_remove(entry);
+}
+
 /* public functions */
 
 struct IODNSQuery *iodns_getaddrinfo(char *hostname, int records, iodns_callback *callback, void *arg) {
@@ -201,15 +491,12 @@ struct IODNSQuery *iodns_getnameinfo(const struct sockaddr *addr, size_t addrlen
 	descriptor->data = arg;
 	
 	query->type = IODNS_RECORD_PTR;
-	query->request.addr.addresslen = addrlen;
-	query->request.addr.address = malloc(addrlen);
-	if(!query->request.addr.address) {
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for sockaddr in %s:%d", __FILE__, __LINE__);
+	if(!iodns_set_address(&query->request.addr, addr, addrlen)) {
+		iolog_trigger(IOLOG_ERROR, "invalid sockaddr length (%d) in %s:%d", (int) addrlen, __FILE__, __LINE__);
 		_free_dnsquery(query);
 		free(descriptor);
 		return NULL;
 	}
-	memcpy(query->request.addr.address, addr, addrlen);
 	
 	descriptor->callback = callback;
 	
@@ -230,6 +517,16 @@ void iodns_abort(struct IODNSQuery *descriptor) {
 	_stop_dnsquery(query);
 }
 
+int iodns_set_address(struct IODNSAddress *target, const void *address, size_t addresslen) {
+	if(addresslen > sizeof(target->storage))
+		return 0;
+	memset(&target->storage, 0, sizeof(target->storage));
+	memcpy(&target->storage, address, addresslen);
+	target->address = (struct sockaddr *) &target->storage;
+	target->addresslen = addresslen;
+	return 1;
+}
+
 int iodns_print_address(struct IODNSAddress *address, int ipv6, char *buffer, int length) {
 	int af;
 	void *addr;
@@ -247,15 +544,32 @@ int iodns_print_address(struct IODNSAddress *address, int ipv6, char *buffer, in
 		return strlen(buffer);
 }
 
+static struct IODNSResult *iodns_copy_result(struct IODNSResult *result) {
+	struct IODNSResult *copy = NULL, **tail = &copy;
+	for(;result;result = result->next) {
+		struct IODNSResult *dnsresult = malloc(sizeof(*dnsresult));
+		if(!dnsresult) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for IODNSResult in %s:%d", __FILE__, __LINE__);
+			iodns_free_result(copy);
+			return NULL;
+		}
+		dnsresult->type = result->type;
+		dnsresult->next = NULL;
+		if((result->type & IODNS_REVERSE))
+			dnsresult->result.host = (result->result.host ? strdup(result->result.host) : NULL);
+		else
+			iodns_set_address(&dnsresult->result.addr, result->result.addr.address, result->result.addr.addresslen);
+		*tail = dnsresult;
+		tail = &dnsresult->next;
+	}
+	return copy;
+}
+
 void iodns_free_result(struct IODNSResult *result) {
 	struct IODNSResult *next;
 	for(;result;result = next) {
 		next = result->next;
 		
-		if((result->type & IODNS_FORWARD)) {
-			if(result->result.addr.address)
-				free(result->result.addr.address);
-		}
 		if((result->type & IODNS_REVERSE)) {
 			if(result->result.host)
 				free(result->result.host);
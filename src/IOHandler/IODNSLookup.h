@@ -28,8 +28,8 @@ extern struct IODNSEngine dnsengine_cares;
 extern struct IODNSEngine dnsengine_default;
 
 struct _IODNSQuery;
-extern struct _IODNSQuery *iodnsquery_first;
-extern struct _IODNSQuery *iodnsquery_last;
+extern IOTHREAD_LOCAL struct _IODNSQuery *iodnsquery_first;
+extern IOTHREAD_LOCAL struct _IODNSQuery *iodnsquery_last;
 
 /* Multithreading */
 #ifdef IODNS_USE_THREADS
@@ -62,9 +62,14 @@ extern struct _IODNSQuery *iodnsquery_last;
 #define IODNSFLAG_PROCESSING     0x02
 #define IODNSFLAG_PARENT_PUBLIC  0x04
 #define IODNSFLAG_PARENT_SOCKET  0x08
+#define IODNSFLAG_PARENT_CACHE   0x10
+#define IODNSFLAG_WAITING        0x20 /* attached to a running query of the dns cache or a cache hit waiting for delivery */
+#define IODNSFLAG_NOTFOUND       0x40 /* set by the engine if the name does not exist (NXDOMAIN) */
 
 struct IODNSResult;
+struct IODNSCacheEntry;
 struct _IOSocket;
+struct IOHandlerLoop;
 
 struct _IODNSQuery {
 	void *query;
@@ -77,9 +82,13 @@ struct _IODNSQuery {
 	} request;
 	
 	struct IODNSResult *result;
+	unsigned int ttl; /* seconds the result may be cached (IODNS_CACHE_TTL unless the engine reports the record ttls) */
 	
 	void *parent;
 	
+	struct IODNSCacheEntry *cache;
+	struct _IODNSQuery *cache_next;
+	
 	struct _IODNSQuery *next, *prev;
 };
 
@@ -87,6 +96,7 @@ struct IODNSEngine {
 	const char *name;
 	int (*init)();
 	void (*stop)();
+	void (*detach)(struct IOHandlerLoop *loop); /* optional: the loop stops, its queries must not be completed through it anymore */
 	void (*add)(struct _IODNSQuery *query);
 	void (*remove)(struct _IODNSQuery *query);
 	void (*loop)();
@@ -95,6 +105,7 @@ struct IODNSEngine {
 
 void _init_iodns();
 void _stop_iodns();
+void _detach_iodns(struct IOHandlerLoop *loop);
 struct _IODNSQuery *_create_dnsquery();
 void _start_dnsquery(struct _IODNSQuery *query);
 void _stop_dnsquery(struct _IODNSQuery *query);
@@ -106,6 +117,9 @@ void iodns_socket_callback(struct _IOSocket *iosock, int wantread, int wantwrite
 void iodns_event_callback(struct _IODNSQuery *query, enum IODNSEventType state);
 void iodns_poll();
 
+/* copy a sockaddr into the inline storage of an IODNSAddress (returns 0 if it does not fit) */
+int iodns_set_address(struct IODNSAddress *target, const void *address, size_t addresslen);
+
 #endif
 
 struct IODNSEvent;
@@ -148,6 +162,7 @@ struct IODNSEvent {
 	struct IODNSResult *result;
 };
 
+/* results (cached ones too) are delivered by the event loop, never before iodns_getaddrinfo returns */
 struct IODNSQuery *iodns_getaddrinfo(char *hostname, int records, iodns_callback *callback, void *arg);
 struct IODNSQuery *iodns_getnameinfo(const struct sockaddr *addr, size_t addrlen, iodns_callback *callback, void *arg);
 void iodns_abort(struct IODNSQuery *query);
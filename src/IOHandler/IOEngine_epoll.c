@@ -29,7 +29,7 @@
 
 #define MAX_EVENTS 32
 
-static int epoll_fd;
+static IOTHREAD_LOCAL int epoll_fd;
 
 static int engine_epoll_init() {
 	epoll_fd = epoll_create(IOHANDLER_MAX_SOCKETS);
@@ -38,20 +38,29 @@ static int engine_epoll_init() {
 	return 1;
 }
 
-static void engine_epoll_add(struct _IOSocket *iosock) {
+static int engine_epoll_add(struct _IOSocket *iosock) {
 	//add Socket FD to the epoll queue
 	struct epoll_event evt;
 	int res;
 
-	evt.events = EPOLLHUP | (iosocket_wants_reads(iosock) ? EPOLLIN : 0) | (iosocket_wants_writes(iosock) ? EPOLLOUT : 0);
+	if(iosocket_edge_triggered && (iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC) && !(iosock->socket_flags & (IOSOCKETFLAG_LISTENING | IOSOCKETFLAG_OVERRIDE_WANT_RW))) {
+		//register for both directions once; the socket layer reads & writes until EAGAIN
+		iosock->socket_flags |= IOSOCKETFLAG_EDGE_TRIGGERED;
+		evt.events = EPOLLHUP | EPOLLIN | EPOLLOUT | EPOLLET;
+	} else
+		evt.events = EPOLLHUP | (iosocket_wants_reads(iosock) ? EPOLLIN : 0) | (iosocket_wants_writes(iosock) ? EPOLLOUT : 0);
 	evt.data.ptr = iosock;
 	res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, iosock->fd, &evt);
-	if(res < 0)
+	if(res < 0) {
 		iolog_trigger(IOLOG_ERROR, "could not add _IOSocket %d to epoll queue. (returned: %d)", iosock->fd, res);
+		return 0;
+	}
+	return 1;
 }
 
 static void engine_epoll_remove(struct _IOSocket *iosock) {
 	struct epoll_event evt;
+	iosock->socket_flags &= ~IOSOCKETFLAG_EDGE_TRIGGERED;
 	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, iosock->fd, &evt);
 }
 
@@ -59,6 +68,8 @@ static void engine_epoll_update(struct _IOSocket *iosock) {
 	struct epoll_event evt;
 	int res;
 
+	if((iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED))
+		return; // interest mask never changes for edge triggered sockets
 	evt.events = EPOLLHUP | (iosocket_wants_reads(iosock) ? EPOLLIN : 0) | (iosocket_wants_writes(iosock) ? EPOLLOUT : 0);
 	evt.data.ptr = iosock;
 	res = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, iosock->fd, &evt);
@@ -74,24 +85,29 @@ static void engine_epoll_loop(struct timeval *timeout) {
 	struct timeval now;
 	
 	//check timers
-	gettimeofday(&now, NULL);
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 	
 	//get timeout (timer or given timeout)
-	if(iotimer_sorted_descriptors) {
-		msec = (iotimer_sorted_descriptors->timeout.tv_sec - now.tv_sec) * 1000;
-		msec += (iotimer_sorted_descriptors->timeout.tv_usec - now.tv_usec) / 1000;
+	if(iotimer_next_timer()) {
+		long long usec = (long long) (iotimer_next_timer()->timeout.tv_sec - now.tv_sec) * 1000000;
+		usec += iotimer_next_timer()->timeout.tv_usec - now.tv_usec;
+		msec = (usec + 999) / 1000; // round up (don't spin on sub-millisecond timeouts)
 	}
 	if(timeout) {
 		msec2 = (timeout->tv_sec * 1000 + timeout->tv_usec / 1000);
-		if(!iotimer_sorted_descriptors || msec2 < msec)
+		if(!iotimer_next_timer() || msec2 < msec)
 			msec = msec2;
-	} else if(!iotimer_sorted_descriptors)
+	} else if(!iotimer_next_timer())
 		msec = -1;
 	
+	//apply pending interest updates
+	iosocket_flush_updates();
+	
 	//epoll system call
 	epoll_result = epoll_wait(epoll_fd, evts, MAX_EVENTS, msec);
+	iotimer_update_clock();
 	
 	if (epoll_result < 0) {
 		if (errno != EINTR) {
@@ -102,13 +118,13 @@ static void engine_epoll_loop(struct timeval *timeout) {
 		int i;
 		for(i = 0; i < epoll_result; i++) {
 			events = evts[i].events;
-			iosocket_events_callback(evts[i].data.ptr, (events & (EPOLLIN | EPOLLHUP)), (events & EPOLLOUT));
+			iosocket_events_callback(evts[i].data.ptr, (events & (EPOLLIN | EPOLLHUP | EPOLLERR)), (events & EPOLLOUT));
 		}
 	}
 	
 	//check timers
-	gettimeofday(&now, NULL);
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 }
 
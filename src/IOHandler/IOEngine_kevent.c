@@ -19,14 +19,22 @@
 #include "IOHandler.h"
 #include "IOLog.h"
 #include "IOSockets.h"
+#include "IOTimer.h"
 
 #ifdef HAVE_SYS_EVENT_H
 #include <sys/event.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define MAX_EVENTS 32
 
-static int kevent_fd;
+static IOTHREAD_LOCAL int kevent_fd;
+
+/* interest updates collected by iosocket_flush_updates, submitted with the next kevent() wait */
+static IOTHREAD_LOCAL struct kevent *kevent_changes = NULL;
+static IOTHREAD_LOCAL int kevent_changes_count = 0, kevent_changes_size = 0;
 
 static int engine_kevent_init() {
 	kevent_fd = kqueue();
@@ -35,20 +43,22 @@ static int engine_kevent_init() {
 	return 1;
 }
 
-static void engine_kevent_add(struct _IOSocket *iosock) {
+static int engine_kevent_add(struct _IOSocket *iosock) {
 	//add Socket FD to the kevent queue
 	struct kevent changes[2];
 	int nchanges = 0;
 	int res;
 
-	if (iosocket_wants_reads(iosock))
-		EV_SET(&changes[nchanges++], iosock->fd, EVFILT_READ, EV_ADD, 0, 0, iosock);
-	if (iosocket_wants_writes(iosock))
-		EV_SET(&changes[nchanges++], iosock->fd, EVFILT_WRITE, EV_ADD, 0, 0, iosock);
+	//register both filters, so later updates only need to enable / disable them
+	EV_SET(&changes[nchanges++], iosock->fd, EVFILT_READ, EV_ADD | (iosocket_wants_reads(iosock) ? EV_ENABLE : EV_DISABLE), 0, 0, iosock);
+	EV_SET(&changes[nchanges++], iosock->fd, EVFILT_WRITE, EV_ADD | (iosocket_wants_writes(iosock) ? EV_ENABLE : EV_DISABLE), 0, 0, iosock);
 	
 	res = kevent(kevent_fd, changes, nchanges, NULL, 0, NULL);
-	if(res < 0)
+	if(res < 0) {
 		iolog_trigger(IOLOG_ERROR, "could not add _IOSocket %d to kevent queue. (returned: %d)", iosock->fd, res);
+		return 0;
+	}
+	return 1;
 }
 
 static void engine_kevent_remove(struct _IOSocket *iosock) {
@@ -61,33 +71,35 @@ static void engine_kevent_remove(struct _IOSocket *iosock) {
 }
 
 static void engine_kevent_update(struct _IOSocket *iosock) {
-	struct kevent changes[2];
-	int nchanges = 0;
-	int res;
-
-	EV_SET(&changes[nchanges++], iosock->fd, EVFILT_READ, iosocket_wants_reads(iosock) ? EV_ADD : EV_DELETE, 0, 0, iosock);
-	EV_SET(&changes[nchanges++], iosock->fd, EVFILT_WRITE, iosocket_wants_writes(iosock) ? EV_ADD : EV_DELETE, 0, 0, iosock);
+	if(kevent_changes_count + 2 > kevent_changes_size) {
+		int new_size = (kevent_changes_size ? kevent_changes_size * 2 : MAX_EVENTS);
+		struct kevent *new_changes = realloc(kevent_changes, new_size * sizeof(*new_changes));
+		if(!new_changes) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for kevent changelist in %s:%d", __FILE__, __LINE__);
+			return;
+		}
+		kevent_changes = new_changes;
+		kevent_changes_size = new_size;
+	}
 	
-	res = kevent(kevent_fd, changes, nchanges, NULL, 0, NULL);
-	if(res < 0)
-		iolog_trigger(IOLOG_ERROR, "could not update _IOSocket %d in kevent queue. (returned: %d)", iosock->fd, res);
+	EV_SET(&kevent_changes[kevent_changes_count++], iosock->fd, EVFILT_READ, EV_ADD | (iosocket_wants_reads(iosock) ? EV_ENABLE : EV_DISABLE), 0, 0, iosock);
+	EV_SET(&kevent_changes[kevent_changes_count++], iosock->fd, EVFILT_WRITE, EV_ADD | (iosocket_wants_writes(iosock) ? EV_ENABLE : EV_DISABLE), 0, 0, iosock);
 }
 
 static void engine_kevent_loop(struct timeval *timeout) {
 	struct kevent events[MAX_EVENTS];
 	struct timespec ts;
-	int msec;
 	int kevent_result;
 	struct timeval now, tout;
 	
 	//check timers
-	gettimeofday(&now, NULL);
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 	
 	//get timeout (timer or given timeout)
-	if(iotimer_sorted_descriptors) {
-		tout = iotimer_sorted_descriptors->timeout;
+	if(iotimer_next_timer()) {
+		tout = iotimer_next_timer()->timeout;
 		tout.tv_sec -= now.tv_sec;
 		tout.tv_usec -= now.tv_usec;
 		if(tout.tv_usec < 0) {
@@ -96,17 +108,26 @@ static void engine_kevent_loop(struct timeval *timeout) {
 		}
 	}
 	if(timeout) {
-		if(!iotimer_sorted_descriptors || timeval_is_smaler((*timeout), tout)) {
+		if(!iotimer_next_timer() || timeval_is_smaler((*timeout), tout)) {
 			tout.tv_usec = timeout->tv_usec;
 			tout.tv_sec = timeout->tv_sec;
 		}
 		timeout = &tout;
-	} else if(iotimer_sorted_descriptors)
+	} else if(iotimer_next_timer())
 		timeout = &tout;
 	
 	
-	//select system call
-	kevent_result = kevent(kevent_fd, NULL, 0, events, MAX_EVENTS, timeout);
+	//apply pending interest updates (collected in kevent_changes)
+	iosocket_flush_updates();
+	
+	//kevent system call (submits the changelist and waits for events)
+	if(timeout) {
+		ts.tv_sec = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_usec * 1000;
+	}
+	kevent_result = kevent(kevent_fd, kevent_changes, kevent_changes_count, events, MAX_EVENTS, (timeout ? &ts : NULL));
+	kevent_changes_count = 0;
+	iotimer_update_clock();
 	
 	if (kevent_result < 0) {
 		if (errno != EINTR) {
@@ -115,18 +136,28 @@ static void engine_kevent_loop(struct timeval *timeout) {
 		}
 	} else {
 		int i;
-		for(i = 0; i < kevent_result; i++)
+		for(i = 0; i < kevent_result; i++) {
+			if((events[i].flags & EV_ERROR)) {
+				iolog_trigger(IOLOG_ERROR, "could not update _IOSocket %d in kevent queue. (error: %d)", (int) events[i].ident, (int) events[i].data);
+				continue;
+			}
 			iosocket_events_callback(events[i].udata, (events[i].filter == EVFILT_READ), (events[i].filter == EVFILT_WRITE));
+		}
 	}
 	
 	//check timers
-	gettimeofday(&now, NULL);
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 }
 
 static void engine_kevent_cleanup() {
 	close(kevent_fd);
+	if(kevent_changes)
+		free(kevent_changes);
+	kevent_changes = NULL;
+	kevent_changes_count = 0;
+	kevent_changes_size = 0;
 }
 
 struct IOEngine engine_kevent = {
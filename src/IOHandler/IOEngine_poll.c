@@ -0,0 +1,187 @@
+/* IOEngine_poll.c - IOMultiplexer
+ * Copyright (C) 2014  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+#define _IOHandler_internals
+#include "IOInternal.h"
+#include "IOHandler.h"
+#include "IOLog.h"
+#include "IOSockets.h"
+#include "IOTimer.h"
+
+#if defined(HAVE_POLL_H) && !defined(WIN32)
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* persistent pollfd array (updated by add / remove / update, never rebuilt) */
+static IOTHREAD_LOCAL struct pollfd *poll_fds = NULL;
+static IOTHREAD_LOCAL struct _IOSocket **poll_sockets = NULL;
+static IOTHREAD_LOCAL int poll_count = 0, poll_size = 0;
+
+/* engine_data holds the position in poll_fds + 1 (0 = not registered) */
+#define ENGINE_POLL_INDEX(iosock) ((int) (intptr_t) (iosock)->engine_data - 1)
+
+static int engine_poll_init() {
+	return 1;
+}
+
+static short engine_poll_events(struct _IOSocket *iosock) {
+	return (iosocket_wants_reads(iosock) ? POLLIN : 0) | (iosocket_wants_writes(iosock) ? POLLOUT : 0);
+}
+
+static int engine_poll_add(struct _IOSocket *iosock) {
+	if(poll_count == poll_size) {
+		int new_size = (poll_size ? poll_size * 2 : 64);
+		struct pollfd *new_fds = realloc(poll_fds, new_size * sizeof(*new_fds));
+		if(!new_fds) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for pollfd array in %s:%d", __FILE__, __LINE__);
+			return 0;
+		}
+		poll_fds = new_fds;
+		struct _IOSocket **new_sockets = realloc(poll_sockets, new_size * sizeof(*new_sockets));
+		if(!new_sockets) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for pollfd array in %s:%d", __FILE__, __LINE__);
+			// shrink poll_fds back, so both arrays keep the size of poll_size
+			if(!poll_size) {
+				free(poll_fds);
+				poll_fds = NULL;
+			} else if((new_fds = realloc(poll_fds, poll_size * sizeof(*new_fds))))
+				poll_fds = new_fds;
+			return 0;
+		}
+		poll_sockets = new_sockets;
+		poll_size = new_size;
+	}
+	poll_fds[poll_count].fd = iosock->fd;
+	poll_fds[poll_count].events = engine_poll_events(iosock);
+	poll_fds[poll_count].revents = 0;
+	poll_sockets[poll_count] = iosock;
+	iosock->engine_data = (void *) (intptr_t) (++poll_count);
+	return 1;
+}
+
+static void engine_poll_remove(struct _IOSocket *iosock) {
+	int index = ENGINE_POLL_INDEX(iosock);
+	if(index < 0)
+		return;
+	iosock->engine_data = NULL;
+	// move the last entry into the gap
+	poll_count--;
+	if(index != poll_count) {
+		poll_fds[index] = poll_fds[poll_count];
+		poll_sockets[index] = poll_sockets[poll_count];
+		poll_sockets[index]->engine_data = (void *) (intptr_t) (index + 1);
+	}
+}
+
+static void engine_poll_update(struct _IOSocket *iosock) {
+	int index = ENGINE_POLL_INDEX(iosock);
+	if(index < 0)
+		return;
+	poll_fds[index].events = engine_poll_events(iosock);
+}
+
+static void engine_poll_loop(struct timeval *timeout) {
+	int msec, msec2;
+	int poll_result;
+	struct timeval now;
+	
+	//check timers
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
+		_trigger_timer();
+	
+	//get timeout (timer or given timeout)
+	if(iotimer_next_timer()) {
+		long long usec = (long long) (iotimer_next_timer()->timeout.tv_sec - now.tv_sec) * 1000000;
+		usec += iotimer_next_timer()->timeout.tv_usec - now.tv_usec;
+		msec = (usec + 999) / 1000; // round up (don't spin on sub-millisecond timeouts)
+	}
+	if(timeout) {
+		msec2 = (timeout->tv_sec * 1000 + timeout->tv_usec / 1000);
+		if(!iotimer_next_timer() || msec2 < msec)
+			msec = msec2;
+	} else if(!iotimer_next_timer())
+		msec = -1;
+	
+	//apply pending interest updates
+	iosocket_flush_updates();
+	
+	//poll system call
+	poll_result = poll(poll_fds, poll_count, msec);
+	iotimer_update_clock();
+	
+	if (poll_result < 0) {
+		if (errno != EINTR) {
+			iolog_trigger(IOLOG_FATAL, "poll() failed with errno %d: %s", errno, strerror(errno));
+			return;
+		}
+	} else if(poll_result > 0) {
+		// callbacks may add or remove sockets: new entries have no revents and removed entries are
+		// replaced by the last one, so an entry has to be checked again if its socket has changed
+		int i = 0;
+		while(i < poll_count) {
+			struct _IOSocket *iosock = poll_sockets[i];
+			short revents = poll_fds[i].revents;
+			poll_fds[i].revents = 0;
+			if(revents)
+				iosocket_events_callback(iosock, (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)), (revents & POLLOUT));
+			if(i < poll_count && poll_sockets[i] != iosock)
+				continue;
+			i++;
+		}
+	}
+	
+	//check timers
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
+		_trigger_timer();
+}
+
+static void engine_poll_cleanup() {
+	free(poll_fds);
+	free(poll_sockets);
+	poll_fds = NULL;
+	poll_sockets = NULL;
+	poll_count = 0;
+	poll_size = 0;
+}
+
+struct IOEngine engine_poll = {
+	.name = "poll",
+	.init = engine_poll_init,
+	.add = engine_poll_add,
+	.remove = engine_poll_remove,
+	.update = engine_poll_update,
+	.loop = engine_poll_loop,
+	.cleanup = engine_poll_cleanup,
+};
+
+#else
+
+struct IOEngine engine_poll = {
+	.name = "poll",
+	.init = NULL,
+	.add = NULL,
+	.remove = NULL,
+	.update = NULL,
+	.loop = NULL,
+	.cleanup = NULL,
+};
+
+#endif
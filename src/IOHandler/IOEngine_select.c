@@ -39,16 +39,25 @@
 /* compat */
 #include "compat/utime.h"
 
+/* result of the last select call (sockets removed by a callback are cleared, so a new socket reusing the fd gets no stale events) */
+static IOTHREAD_LOCAL fd_set engine_select_read_fds;
+static IOTHREAD_LOCAL fd_set engine_select_write_fds;
+
 static int engine_select_init() {
 	return 1;
 }
 
-static void engine_select_add(struct _IOSocket *iosock) {
-	/* empty */
+static int engine_select_add(struct _IOSocket *iosock) {
+	return 1;
 }
 
 static void engine_select_remove(struct _IOSocket *iosock) {
-	/* empty */
+	#ifndef WIN32
+	if(iosock->fd >= FD_SETSIZE)
+		return; // never set, FD_CLR would write past the fd_set
+	#endif
+	FD_CLR(iosock->fd, &engine_select_read_fds);
+	FD_CLR(iosock->fd, &engine_select_write_fds);
 }
 
 static void engine_select_update(struct _IOSocket *iosock) {
@@ -56,25 +65,28 @@ static void engine_select_update(struct _IOSocket *iosock) {
 }
 
 static void engine_select_loop(struct timeval *timeout) {
-	fd_set read_fds;
-	fd_set write_fds;
+	fd_set *read_fds = &engine_select_read_fds;
+	fd_set *write_fds = &engine_select_write_fds;
+	int ready_fds[FD_SETSIZE];
+	int ready_count = 0;
 	unsigned int fds_size = 0;
-	struct _IOSocket *iosock, *next_iosock;
+	struct _IOSocket *iosock;
 	struct timeval now, tout;
 	int select_result;
+	int i;
 	
 	//clear fds
-	FD_ZERO(&read_fds);
-	FD_ZERO(&write_fds);
+	FD_ZERO(read_fds);
+	FD_ZERO(write_fds);
 	
 	//check timers
-	gettimeofday(&now, NULL);
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 	
 	//get timeout (timer or given timeout)
-	if(iotimer_sorted_descriptors) {
-		tout = iotimer_sorted_descriptors->timeout;
+	if(iotimer_next_timer()) {
+		tout = iotimer_next_timer()->timeout;
 		tout.tv_sec -= now.tv_sec;
 		tout.tv_usec -= now.tv_usec;
 		if(tout.tv_usec < 0) {
@@ -83,34 +95,41 @@ static void engine_select_loop(struct timeval *timeout) {
 		}
 	}
 	if(timeout) {
-		if(!iotimer_sorted_descriptors || timeval_is_smaler((*timeout), tout)) {
+		if(!iotimer_next_timer() || timeval_is_smaler((*timeout), tout)) {
 			tout.tv_usec = timeout->tv_usec;
 			tout.tv_sec = timeout->tv_sec;
 		}
 		timeout = &tout;
-	} else if(iotimer_sorted_descriptors)
+	} else if(iotimer_next_timer())
 		timeout = &tout;
 	
+	//apply pending interest updates
+	iosocket_flush_updates();
+	
 	select_result = 0;
-	for(iosock = iosocket_first; iosock; iosock = iosock->next) {
-		if(!(iosock->socket_flags & IOSOCKETFLAG_ACTIVE)) 
-			continue;
+	for(i = 0; i < iosocket_active_count; i++) {
+		iosock = iosocket_active[i];
+		#ifndef WIN32
+		if(iosock->fd >= FD_SETSIZE)
+			continue; // can't be watched by select
+		#endif
 		if(iosock->fd > fds_size)
 			fds_size = iosock->fd;
 		select_result++;
 		if(iosocket_wants_reads(iosock))
-			FD_SET(iosock->fd, &read_fds);
+			FD_SET(iosock->fd, read_fds);
 		if(iosocket_wants_writes(iosock))
-			FD_SET(iosock->fd, &write_fds);
+			FD_SET(iosock->fd, write_fds);
 	}
 
 	if(select_result) //select system call
-		select_result = select(fds_size + 1, &read_fds, &write_fds, NULL, timeout);
+		select_result = select(fds_size + 1, read_fds, write_fds, NULL, timeout);
 	else if(timeout) {
 		usleep_tv(*timeout);
 		select_result = 0;
 	} else
 		usleep(10000); // 10ms
+	iotimer_update_clock();
 	
 	if (select_result < 0) {
 		if (errno != EINTR) {
@@ -119,19 +138,30 @@ static void engine_select_loop(struct timeval *timeout) {
 		}
 	}
 	
-	gettimeofday(&now, NULL);
+	now = iotimer_now;
 	
-	//check all descriptors
-	for(iosock = iosocket_first; iosock; iosock = next_iosock) {
-		next_iosock = iosock->next;
-		if(!(iosock->socket_flags & IOSOCKETFLAG_ACTIVE))
-			return;
-		if(FD_ISSET(iosock->fd, &read_fds) || FD_ISSET(iosock->fd, &write_fds))
-			iosocket_events_callback(iosock, FD_ISSET(iosock->fd, &read_fds), FD_ISSET(iosock->fd, &write_fds));
+	//collect ready descriptors first (callbacks may add or remove active sockets)
+	for(i = 0; i < iosocket_active_count && ready_count < select_result; i++) {
+		iosock = iosocket_active[i];
+		#ifndef WIN32
+		if(iosock->fd >= FD_SETSIZE)
+			continue;
+		#endif
+		if(FD_ISSET(iosock->fd, read_fds) || FD_ISSET(iosock->fd, write_fds))
+			ready_fds[ready_count++] = iosock->fd;
+	}
+	for(i = 0; i < ready_count; i++) {
+		int readable = FD_ISSET(ready_fds[i], read_fds);
+		int writeable = FD_ISSET(ready_fds[i], write_fds);
+		if(!readable && !writeable)
+			continue; // socket has been removed in the meantime
+		iosock = iosocket_get_by_fd(ready_fds[i]);
+		if(iosock)
+			iosocket_events_callback(iosock, readable, writeable);
 	}
 	
 	//check timers
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 	
 }
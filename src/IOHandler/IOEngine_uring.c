@@ -0,0 +1,749 @@
+/* IOEngine_uring.c - IOMultiplexer
+ * Copyright (C) 2014  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+#define _IOHandler_internals
+#include "IOInternal.h"
+#include "IOHandler.h"
+#include "IOLog.h"
+#include "IOSockets.h"
+#include "IOTimer.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The io_uring engine performs the socket I/O of plain TCP connections
+ * itself: connected sockets keep an IORING_OP_RECV (into a buffer of the
+ * loop's provided buffer group) in flight, the write queue is sent with
+ * IORING_OP_SENDMSG and listeners keep IOURING_ACCEPT_DEPTH IORING_OP_ACCEPT
+ * requests in flight. The results are handed to iosocket_events_callback,
+ * which picks them up through the accept/recv/send hooks instead of calling
+ * into the kernel.
+ * SSL, connecting, dns & wakeup sockets keep the readiness semantics of the
+ * other engines (oneshot IORING_OP_POLL_ADD).
+ * All requests queued during a loop iteration are submitted together with
+ * the wait for new completions in a single io_uring_enter call.
+ */
+
+#define URING_ENTRIES 256
+#define URING_SEND_IOV 16 /* max. writeq chunks per send request */
+#define URING_BUFFER_GROUP 0
+#define URING_DATA_BUFFERS 1 /* user_data of buffer requests (0: completion is ignored) */
+#define URING_TAG_SHIFT 48 /* user_data: request tag << 48 | op (user space pointers fit into 48 bits) */
+
+enum engine_uring_optype {
+	URING_OP_POLL,
+	URING_OP_RECV,
+	URING_OP_SEND,
+	URING_OP_ACCEPT
+};
+
+struct engine_uring_socket;
+
+struct engine_uring_op {
+	struct engine_uring_socket *sock;
+	unsigned long long user_data; /* tagged user_data of the request in flight (cancel key) */
+	unsigned int type : 2;
+	unsigned int pending : 1; /* request in flight */
+	unsigned int done : 1; /* result not picked up by the socket yet */
+	int res;
+};
+
+struct engine_uring_accept {
+	struct engine_uring_op op;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+};
+
+struct engine_uring_socket {
+	struct _IOSocket *iosock; /* NULL if the socket has been removed */
+	struct engine_uring_op poll, recv, send;
+	struct engine_uring_accept *accept; /* listeners: IOURING_ACCEPT_DEPTH requests */
+	unsigned int poll_events;
+	unsigned int recv_bid, recv_pos; /* received data: buffer id & read position */
+	struct msghdr send_msg;
+	struct iovec send_iov[URING_SEND_IOV];
+	struct IOSocketWriteQueue orphaned_writeq; /* taken over from a removed socket while sending */
+	unsigned int dispatching : 1; /* iosocket_events_callback running */
+	unsigned int recv_nobufs : 1; /* no receive buffer left: poll & recv() */
+	unsigned int ready : 1; /* on the ready list */
+	struct engine_uring_socket *ready_next;
+};
+
+static IOTHREAD_LOCAL int uring_fd;
+
+static IOTHREAD_LOCAL void *uring_sq_ptr, *uring_cq_ptr;
+static IOTHREAD_LOCAL size_t uring_sq_size, uring_cq_size;
+static IOTHREAD_LOCAL struct io_uring_sqe *uring_sqes;
+static IOTHREAD_LOCAL unsigned int uring_sqes_size;
+
+static IOTHREAD_LOCAL unsigned int *uring_sq_khead, *uring_sq_ktail, *uring_sq_array;
+static IOTHREAD_LOCAL unsigned int uring_sq_mask, uring_sq_entries;
+static IOTHREAD_LOCAL unsigned int uring_sq_tail, uring_sq_queued;
+
+static IOTHREAD_LOCAL unsigned int *uring_cq_khead, *uring_cq_ktail;
+static IOTHREAD_LOCAL unsigned int uring_cq_mask;
+static IOTHREAD_LOCAL struct io_uring_cqe *uring_cqes;
+
+static IOTHREAD_LOCAL char *uring_buffers; /* IOURING_RECV_BUFFERS receive buffers (NULL: recv() after POLLIN) */
+static IOTHREAD_LOCAL unsigned short uring_tag;
+static IOTHREAD_LOCAL unsigned int uring_pending; /* requests in flight */
+static IOTHREAD_LOCAL struct engine_uring_socket *uring_ready_first; /* received data waiting for the socket */
+
+static void engine_uring_provide(unsigned int bid, unsigned int count);
+
+static int engine_uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsize) {
+	return syscall(__NR_io_uring_enter, uring_fd, to_submit, min_complete, flags, arg, argsize);
+}
+
+static int engine_uring_init() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if(uring_fd < 0)
+		return 0;
+	if(!(params.features & IORING_FEAT_EXT_ARG)) {
+		// kernel too old (< 5.11)
+		close(uring_fd);
+		return 0;
+	}
+
+	uring_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if((params.features & IORING_FEAT_SINGLE_MMAP)) {
+		if(uring_cq_size > uring_sq_size)
+			uring_sq_size = uring_cq_size;
+		uring_cq_size = uring_sq_size;
+	}
+
+	uring_sq_ptr = mmap(NULL, uring_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+	if(uring_sq_ptr == MAP_FAILED)
+		goto engine_uring_init_err_sq;
+
+	if((params.features & IORING_FEAT_SINGLE_MMAP))
+		uring_cq_ptr = uring_sq_ptr;
+	else {
+		uring_cq_ptr = mmap(NULL, uring_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+		if(uring_cq_ptr == MAP_FAILED)
+			goto engine_uring_init_err_cq;
+	}
+
+	uring_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring_sqes = mmap(NULL, uring_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+	if(uring_sqes == MAP_FAILED)
+		goto engine_uring_init_err_sqes;
+
+	uring_sq_khead = (unsigned int *)((char *)uring_sq_ptr + params.sq_off.head);
+	uring_sq_ktail = (unsigned int *)((char *)uring_sq_ptr + params.sq_off.tail);
+	uring_sq_array = (unsigned int *)((char *)uring_sq_ptr + params.sq_off.array);
+	uring_sq_mask = *(unsigned int *)((char *)uring_sq_ptr + params.sq_off.ring_mask);
+	uring_sq_entries = *(unsigned int *)((char *)uring_sq_ptr + params.sq_off.ring_entries);
+	uring_sq_tail = *uring_sq_ktail;
+	uring_sq_queued = 0;
+
+	uring_cq_khead = (unsigned int *)((char *)uring_cq_ptr + params.cq_off.head);
+	uring_cq_ktail = (unsigned int *)((char *)uring_cq_ptr + params.cq_off.tail);
+	uring_cq_mask = *(unsigned int *)((char *)uring_cq_ptr + params.cq_off.ring_mask);
+	uring_cqes = (struct io_uring_cqe *)((char *)uring_cq_ptr + params.cq_off.cqes);
+
+	uring_ready_first = NULL;
+	uring_pending = 0;
+	uring_buffers = malloc(IOURING_RECV_BUFFERS * IOURING_RECV_BUFFER_SIZE);
+	if(uring_buffers)
+		engine_uring_provide(0, IOURING_RECV_BUFFERS);
+	else
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for uring receive buffers in %s:%d (polling sockets instead)", __FILE__, __LINE__);
+	return 1;
+
+engine_uring_init_err_sqes:
+	if(uring_cq_ptr != uring_sq_ptr)
+		munmap(uring_cq_ptr, uring_cq_size);
+engine_uring_init_err_cq:
+	munmap(uring_sq_ptr, uring_sq_size);
+engine_uring_init_err_sq:
+	close(uring_fd);
+	return 0;
+}
+
+static void engine_uring_submit() {
+	if(!uring_sq_queued)
+		return;
+	__atomic_store_n(uring_sq_ktail, uring_sq_tail, __ATOMIC_RELEASE);
+	int res = engine_uring_enter(uring_sq_queued, 0, 0, NULL, 0);
+	if(res > 0)
+		uring_sq_queued -= res;
+}
+
+static struct io_uring_sqe *engine_uring_get_sqe() {
+	unsigned int head = __atomic_load_n(uring_sq_khead, __ATOMIC_ACQUIRE);
+	if(uring_sq_tail - head >= uring_sq_entries) {
+		// submission queue full - hand the queued entries to the kernel first
+		engine_uring_submit();
+		head = __atomic_load_n(uring_sq_khead, __ATOMIC_ACQUIRE);
+		if(uring_sq_tail - head >= uring_sq_entries)
+			return NULL;
+	}
+	unsigned int index = uring_sq_tail & uring_sq_mask;
+	struct io_uring_sqe *sqe = &uring_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring_sq_array[index] = index;
+	uring_sq_tail++;
+	uring_sq_queued++;
+	return sqe;
+}
+
+static struct io_uring_sqe *engine_uring_prepare(struct engine_uring_op *op, int opcode, int fd) {
+	struct io_uring_sqe *sqe = engine_uring_get_sqe();
+	if(!sqe) {
+		iolog_trigger(IOLOG_ERROR, "could not add request for fd %d to uring queue (submission queue full)", fd);
+		return NULL;
+	}
+	// the tag keeps cancel requests from matching a later request of a reused op
+	op->user_data = ((unsigned long long) ++uring_tag << URING_TAG_SHIFT) | (unsigned long) op;
+	op->pending = 1;
+	uring_pending++;
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = op->user_data;
+	return sqe;
+}
+
+static void engine_uring_cancel(struct engine_uring_op *op) {
+	if(!op->pending)
+		return;
+	struct io_uring_sqe *sqe = engine_uring_get_sqe();
+	if(!sqe) {
+		iolog_trigger(IOLOG_ERROR, "could not cancel uring request (submission queue full)");
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = op->user_data;
+	sqe->user_data = 0; /* completion of the cancel request itself is ignored */
+}
+
+static void engine_uring_provide(unsigned int bid, unsigned int count) {
+	struct io_uring_sqe *sqe = engine_uring_get_sqe();
+	if(!sqe) {
+		iolog_trigger(IOLOG_ERROR, "could not return receive buffer to uring (submission queue full)");
+		return;
+	}
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (unsigned long) (uring_buffers + bid * IOURING_RECV_BUFFER_SIZE);
+	sqe->len = IOURING_RECV_BUFFER_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_DATA_BUFFERS;
+}
+
+static unsigned int engine_uring_events(struct engine_uring_socket *sock, int io) {
+	struct _IOSocket *iosock = sock->iosock;
+	unsigned int events = 0;
+	if(iosocket_wants_reads(iosock)) {
+		if((io & IOSOCKET_ENGINE_RECV) ? (!uring_buffers || sock->recv_nobufs) : !((io & IOSOCKET_ENGINE_ACCEPT) && sock->accept))
+			events |= POLLIN;
+	}
+	if(iosocket_wants_writes(iosock) && !(io & IOSOCKET_ENGINE_SEND))
+		events |= POLLOUT;
+	if(events || !io)
+		events |= POLLHUP | POLLERR;
+	return events; /* 0: no readiness request needed */
+}
+
+static void engine_uring_arm_poll(struct engine_uring_socket *sock, unsigned int events) {
+	struct io_uring_sqe *sqe = engine_uring_prepare(&sock->poll, IORING_OP_POLL_ADD, sock->iosock->fd);
+	if(!sqe)
+		return;
+	sock->poll_events = events;
+	sqe->poll32_events = events;
+}
+
+static void engine_uring_arm_recv(struct engine_uring_socket *sock) {
+	struct io_uring_sqe *sqe = engine_uring_prepare(&sock->recv, IORING_OP_RECV, sock->iosock->fd);
+	if(!sqe)
+		return;
+	sqe->len = IOURING_RECV_BUFFER_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT; // the kernel picks a buffer when data arrives
+	sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+static void engine_uring_arm_send(struct engine_uring_socket *sock) {
+	struct _IOSocket *iosock = sock->iosock;
+	struct IOSocketWriteChunk *chunk;
+	int count;
+	// send straight from the writeq: the chunks stay queued until the request completes
+	for(chunk = iosock->writeq.first, count = 0; chunk && count < URING_SEND_IOV; chunk = chunk->next, count++) {
+		sock->send_iov[count].iov_base = chunk->data + chunk->pos;
+		sock->send_iov[count].iov_len = chunk->len - chunk->pos;
+	}
+	memset(&sock->send_msg, 0, sizeof(sock->send_msg));
+	sock->send_msg.msg_iov = sock->send_iov;
+	sock->send_msg.msg_iovlen = count;
+	struct io_uring_sqe *sqe = engine_uring_prepare(&sock->send, IORING_OP_SENDMSG, iosock->fd);
+	if(!sqe)
+		return;
+	sqe->addr = (unsigned long) &sock->send_msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+static void engine_uring_arm_accept(struct engine_uring_socket *sock, struct engine_uring_accept *accept) {
+	struct io_uring_sqe *sqe = engine_uring_prepare(&accept->op, IORING_OP_ACCEPT, sock->iosock->fd);
+	if(!sqe)
+		return;
+	accept->addrlen = sizeof(accept->addr);
+	sqe->addr = (unsigned long) &accept->addr;
+	sqe->off = (unsigned long) &accept->addrlen;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void engine_uring_ready(struct engine_uring_socket *sock) {
+	if(sock->ready)
+		return;
+	sock->ready = 1;
+	sock->ready_next = uring_ready_first;
+	uring_ready_first = sock;
+}
+
+static void engine_uring_sync(struct engine_uring_socket *sock) {
+	// bring the requests in flight in line with what the socket wants
+	struct _IOSocket *iosock = sock->iosock;
+	int io = iosocket_engine_io(iosock);
+	unsigned int events = engine_uring_events(sock, io);
+	int i;
+	if(!sock->poll.pending) {
+		if(events)
+			engine_uring_arm_poll(sock, events);
+	} else if(sock->poll_events != events)
+		engine_uring_cancel(&sock->poll); /* re-armed with the new mask when the old request completes */
+	if((io & IOSOCKET_ENGINE_RECV) && uring_buffers && !sock->recv_nobufs && !sock->recv.pending && iosocket_wants_reads(iosock)) {
+		if(!sock->recv.done)
+			engine_uring_arm_recv(sock);
+		else if(!sock->dispatching)
+			engine_uring_ready(sock); // reads have been re-enabled while data was waiting
+	}
+	if((io & IOSOCKET_ENGINE_SEND) && iosock->writeq.first && !sock->send.pending && !sock->send.done)
+		engine_uring_arm_send(sock);
+	if((io & IOSOCKET_ENGINE_ACCEPT) && sock->accept) {
+		for(i = 0; i < IOURING_ACCEPT_DEPTH; i++) {
+			if(!sock->accept[i].op.pending && !sock->accept[i].op.done)
+				engine_uring_arm_accept(sock, &sock->accept[i]);
+		}
+	}
+}
+
+static void engine_uring_init_op(struct engine_uring_socket *sock, struct engine_uring_op *op, int type) {
+	op->sock = sock;
+	op->type = type;
+}
+
+static int engine_uring_add(struct _IOSocket *iosock) {
+	struct engine_uring_socket *sock = calloc(1, sizeof(*sock));
+	int i;
+	if(!sock) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for engine_uring_socket in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	sock->iosock = iosock;
+	engine_uring_init_op(sock, &sock->poll, URING_OP_POLL);
+	engine_uring_init_op(sock, &sock->recv, URING_OP_RECV);
+	engine_uring_init_op(sock, &sock->send, URING_OP_SEND);
+	if((iosocket_engine_io(iosock) & IOSOCKET_ENGINE_ACCEPT)) {
+		sock->accept = calloc(IOURING_ACCEPT_DEPTH, sizeof(*sock->accept));
+		if(sock->accept) {
+			for(i = 0; i < IOURING_ACCEPT_DEPTH; i++)
+				engine_uring_init_op(sock, &sock->accept[i].op, URING_OP_ACCEPT);
+		} else
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for engine_uring_accept in %s:%d (polling listener instead)", __FILE__, __LINE__);
+	}
+	iosock->engine_data = sock;
+	engine_uring_sync(sock);
+	return 1;
+}
+
+static void engine_uring_release(struct engine_uring_socket *sock) {
+	// the state of a removed socket is freed once no request is in flight anymore
+	int i;
+	if(sock->iosock || sock->dispatching || sock->ready || sock->poll.pending || sock->recv.pending || sock->send.pending)
+		return;
+	if(sock->accept) {
+		for(i = 0; i < IOURING_ACCEPT_DEPTH; i++) {
+			if(sock->accept[i].op.pending)
+				return;
+		}
+		free(sock->accept);
+	}
+	free(sock);
+}
+
+static void engine_uring_remove(struct _IOSocket *iosock) {
+	struct engine_uring_socket *sock = iosock->engine_data;
+	int i;
+	if(!sock)
+		return;
+	iosock->engine_data = NULL;
+	sock->iosock = NULL;
+	engine_uring_cancel(&sock->poll);
+	engine_uring_cancel(&sock->recv);
+	if(sock->recv.done && sock->recv.res > 0)
+		engine_uring_provide(sock->recv_bid, 1);
+	sock->recv.done = 0;
+	if(sock->send.pending) {
+		// the kernel might still read from the queued chunks
+		sock->orphaned_writeq = iosock->writeq;
+		memset(&iosock->writeq, 0, sizeof(iosock->writeq));
+		engine_uring_cancel(&sock->send);
+	}
+	sock->send.done = 0;
+	if(sock->accept) {
+		for(i = 0; i < IOURING_ACCEPT_DEPTH; i++) {
+			engine_uring_cancel(&sock->accept[i].op);
+			if(sock->accept[i].op.done && sock->accept[i].op.res >= 0)
+				close(sock->accept[i].op.res);
+			sock->accept[i].op.done = 0;
+		}
+	}
+	engine_uring_release(sock);
+}
+
+static void engine_uring_update(struct _IOSocket *iosock) {
+	struct engine_uring_socket *sock = iosock->engine_data;
+	if(!sock)
+		return;
+	engine_uring_sync(sock);
+}
+
+static int engine_uring_accept(struct _IOSocket *iosock, struct sockaddr *addr, socklen_t *addrlen) {
+	struct engine_uring_socket *sock = iosock->engine_data;
+	int i;
+	if(!sock || !sock->accept)
+		return accept4(iosock->fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	for(i = 0; i < IOURING_ACCEPT_DEPTH; i++) {
+		struct engine_uring_accept *accept = &sock->accept[i];
+		if(!accept->op.done)
+			continue;
+		accept->op.done = 0; // re-armed after the event
+		if(accept->op.res < 0) {
+			errno = -accept->op.res;
+			return -1;
+		}
+		memcpy(addr, &accept->addr, (accept->addrlen < *addrlen ? accept->addrlen : *addrlen));
+		*addrlen = accept->addrlen;
+		return accept->op.res;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+static int engine_uring_recv(struct _IOSocket *iosock, char *buffer, int len) {
+	struct engine_uring_socket *sock = iosock->engine_data;
+	if(sock && sock->recv.done) {
+		if(sock->recv.res <= 0) {
+			// EOF or error: reported until the socket gets closed
+			if(sock->recv.res == 0)
+				return 0;
+			errno = -sock->recv.res;
+			return -1;
+		}
+		if(len > sock->recv.res - (int) sock->recv_pos)
+			len = sock->recv.res - sock->recv_pos;
+		memcpy(buffer, uring_buffers + sock->recv_bid * IOURING_RECV_BUFFER_SIZE + sock->recv_pos, len);
+		sock->recv_pos += len;
+		if(sock->recv_pos == sock->recv.res) {
+			sock->recv.done = 0; // re-armed after the event
+			engine_uring_provide(sock->recv_bid, 1);
+		}
+		return len;
+	}
+	if(sock && uring_buffers && !sock->recv_nobufs) {
+		errno = EAGAIN; // picked up by the next receive request
+		return -1;
+	}
+	return recv(iosock->fd, buffer, len, 0); // out of receive buffers
+}
+
+static int engine_uring_send(struct _IOSocket *iosock) {
+	struct engine_uring_socket *sock = iosock->engine_data;
+	if(sock && sock->send.done) {
+		sock->send.done = 0;
+		if(sock->send.res < 0) {
+			errno = -sock->send.res;
+			return -1;
+		}
+		return sock->send.res; // consumed from the writeq by the caller
+	}
+	if(sock && !sock->send.pending && iosock->writeq.first)
+		engine_uring_arm_send(sock);
+	errno = EAGAIN;
+	return -1;
+}
+
+static int engine_uring_dispatch(struct engine_uring_socket *sock, int readable, int writeable) {
+	sock->dispatching = 1;
+	iosocket_events_callback(sock->iosock, readable, writeable);
+	sock->dispatching = 0;
+	return (sock->iosock != NULL); // 0: socket has been removed in the callback
+}
+
+static int engine_uring_dispatch_recv(struct engine_uring_socket *sock) {
+	unsigned int pos;
+	do {
+		// the readbuf might be too small for the whole receive buffer
+		pos = sock->recv_pos;
+		if(!engine_uring_dispatch(sock, 1, 0))
+			return 0;
+	} while(sock->recv.done && sock->recv.res > 0 && sock->recv_pos != pos && iosocket_wants_reads(sock->iosock));
+	return 1;
+}
+
+static void engine_uring_completion(struct engine_uring_op *op, struct io_uring_cqe *cqe) {
+	struct engine_uring_socket *sock = op->sock;
+	int res = cqe->res, alive;
+	op->pending = 0;
+	uring_pending--;
+	if(res == -ECANCELED) {
+		if(sock->iosock)
+			engine_uring_sync(sock); // re-arm with the current mask
+		else {
+			if(op->type == URING_OP_SEND)
+				iosocket_writeq_release(&sock->orphaned_writeq);
+			engine_uring_release(sock);
+		}
+		return;
+	}
+	if(op->type == URING_OP_RECV && res <= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+		engine_uring_provide(cqe->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+	if(!sock->iosock) {
+		// socket has been removed: drop the result
+		if(op->type == URING_OP_RECV && res > 0)
+			engine_uring_provide(cqe->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+		else if(op->type == URING_OP_SEND)
+			iosocket_writeq_release(&sock->orphaned_writeq);
+		else if(op->type == URING_OP_ACCEPT && res >= 0)
+			close(res);
+		engine_uring_release(sock);
+		return;
+	}
+	alive = 1;
+	switch(op->type) {
+	case URING_OP_POLL:
+		if(res > 0) {
+			alive = engine_uring_dispatch(sock, (res & (POLLIN | POLLHUP | POLLERR)), (res & POLLOUT));
+			if(alive && (res & POLLIN))
+				sock->recv_nobufs = 0; // try to get a receive buffer again
+		}
+		break;
+	case URING_OP_RECV:
+		if(res == -ENOBUFS) {
+			sock->recv_nobufs = 1;
+			break;
+		}
+		if(res > 0) {
+			sock->recv_bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			sock->recv_pos = 0;
+		}
+		op->done = 1;
+		op->res = res;
+		if(iosocket_wants_reads(sock->iosock))
+			alive = engine_uring_dispatch_recv(sock);
+		break;
+	case URING_OP_SEND:
+	case URING_OP_ACCEPT:
+		op->done = 1;
+		op->res = res;
+		if(op->type == URING_OP_SEND)
+			alive = engine_uring_dispatch(sock, 0, 1);
+		else
+			alive = engine_uring_dispatch(sock, 1, 0);
+		break;
+	}
+	if(alive)
+		engine_uring_sync(sock);
+	else
+		engine_uring_release(sock);
+}
+
+static void engine_uring_run_ready() {
+	struct engine_uring_socket *sock, *next_sock;
+	sock = uring_ready_first;
+	uring_ready_first = NULL;
+	for(; sock; sock = next_sock) {
+		next_sock = sock->ready_next;
+		sock->ready = 0;
+		if(sock->iosock && sock->recv.done && iosocket_wants_reads(sock->iosock) && !engine_uring_dispatch_recv(sock)) {
+			engine_uring_release(sock);
+			continue;
+		}
+		if(sock->iosock)
+			engine_uring_sync(sock);
+		else
+			engine_uring_release(sock);
+	}
+}
+
+static void engine_uring_reap() {
+	unsigned int head = *uring_cq_khead;
+	unsigned int tail = __atomic_load_n(uring_cq_ktail, __ATOMIC_ACQUIRE);
+	while(head != tail) {
+		struct io_uring_cqe cqe = uring_cqes[head & uring_cq_mask];
+		head++;
+		__atomic_store_n(uring_cq_khead, head, __ATOMIC_RELEASE);
+
+		if(cqe.user_data == URING_DATA_BUFFERS) {
+			if(cqe.res < 0)
+				iolog_trigger(IOLOG_ERROR, "could not provide receive buffers to uring: %s", strerror(-cqe.res));
+		} else if(cqe.user_data)
+			engine_uring_completion((struct engine_uring_op *) (unsigned long) (cqe.user_data & ((1ULL << URING_TAG_SHIFT) - 1)), &cqe);
+
+		if(head == tail)
+			tail = __atomic_load_n(uring_cq_ktail, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void engine_uring_loop(struct timeval *timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int res;
+	struct timeval now, tout;
+
+	//check timers
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
+		_trigger_timer();
+
+	//get timeout (timer or given timeout)
+	if(iotimer_next_timer()) {
+		tout = iotimer_next_timer()->timeout;
+		tout.tv_sec -= now.tv_sec;
+		tout.tv_usec -= now.tv_usec;
+		if(tout.tv_usec < 0) {
+			tout.tv_sec --;
+			tout.tv_usec += 1000000;
+		}
+	}
+	if(timeout) {
+		if(!iotimer_next_timer() || timeval_is_smaler((*timeout), tout)) {
+			tout.tv_usec = timeout->tv_usec;
+			tout.tv_sec = timeout->tv_sec;
+		}
+		timeout = &tout;
+	} else if(iotimer_next_timer())
+		timeout = &tout;
+
+	//apply pending interest updates (queues the requests)
+	iosocket_flush_updates();
+
+	memset(&arg, 0, sizeof(arg));
+	if(uring_ready_first) {
+		// received data is waiting: don't block
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		arg.ts = (unsigned long) &ts;
+	} else if(timeout) {
+		ts.tv_sec = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_usec * 1000;
+		arg.ts = (unsigned long) &ts;
+	}
+
+	//io_uring_enter system call (submit all queued requests and wait for completions)
+	__atomic_store_n(uring_sq_ktail, uring_sq_tail, __ATOMIC_RELEASE);
+	res = engine_uring_enter(uring_sq_queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	iotimer_update_clock();
+
+	if(res < 0) {
+		if(errno != EINTR && errno != ETIME && errno != EBUSY) {
+			iolog_trigger(IOLOG_FATAL, "io_uring_enter() failed with errno %d: %s", errno, strerror(errno));
+			return;
+		}
+	} else
+		uring_sq_queued -= res;
+
+	engine_uring_reap();
+	engine_uring_run_ready();
+
+	//check timers
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
+		_trigger_timer();
+}
+
+static void engine_uring_cleanup() {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int i;
+	engine_uring_run_ready();
+	// wait for the cancelled requests of removed sockets (their state is freed on completion)
+	for(i = 0; uring_pending && i < 10; i++) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = 0;
+		ts.tv_nsec = 100000000;
+		arg.ts = (unsigned long) &ts;
+		__atomic_store_n(uring_sq_ktail, uring_sq_tail, __ATOMIC_RELEASE);
+		int res = engine_uring_enter(uring_sq_queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if(res > 0)
+			uring_sq_queued -= res;
+		engine_uring_reap();
+	}
+	munmap(uring_sqes, uring_sqes_size);
+	if(uring_cq_ptr != uring_sq_ptr)
+		munmap(uring_cq_ptr, uring_cq_size);
+	munmap(uring_sq_ptr, uring_sq_size);
+	close(uring_fd);
+	if(uring_buffers)
+		free(uring_buffers);
+	uring_buffers = NULL;
+}
+
+struct IOEngine engine_uring = {
+	.name = "uring",
+	.init = engine_uring_init,
+	.add = engine_uring_add,
+	.remove = engine_uring_remove,
+	.update = engine_uring_update,
+	.loop = engine_uring_loop,
+	.cleanup = engine_uring_cleanup,
+	.accept = engine_uring_accept,
+	.recv = engine_uring_recv,
+	.send = engine_uring_send,
+};
+
+#else
+
+struct IOEngine engine_uring = {
+	.name = "uring",
+	.init = NULL,
+	.add = NULL,
+	.remove = NULL,
+	.update = NULL,
+	.loop = NULL,
+	.cleanup = NULL,
+	.accept = NULL,
+	.recv = NULL,
+	.send = NULL,
+};
+
+#endif
@@ -42,16 +42,7 @@
 #define IDT_TIMER2 1001
 #define IDT_SOCKET 1002
 
-static HWND ioset_window;
-
-static struct _IOSocket *engine_win32_get_iosock(int fd) {
-	struct _IOSocket *iosock;
-	for(iosock = iosocket_first; iosock; iosock = iosock->next) {
-		if(iosock->fd == fd)
-			return iosock;
-	}
-	return NULL;
-}
+static IOTHREAD_LOCAL HWND ioset_window;
 
 static LRESULT CALLBACK engine_win32_wndproc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 	struct _IOSocket *iosock;
@@ -66,7 +57,7 @@ static LRESULT CALLBACK engine_win32_wndproc(HWND hWnd, UINT uMsg, WPARAM wParam
 			_trigger_timer();
 			return 0;
 		case IDT_SOCKET:
-			iosock = engine_win32_get_iosock(wParam);
+			iosock = iosocket_get_by_fd(wParam);
 			if(!iosock)
 				return 0;
 			events = WSAGETSELECTEVENT(lParam);
@@ -131,8 +122,9 @@ static void engine_win32_update(struct _IOSocket *iosock) {
 	WSAAsyncSelect(iosock->fd, ioset_window, IDT_SOCKET, events);
 }
 
-static void engine_win32_add(struct _IOSocket *iosock) {
+static int engine_win32_add(struct _IOSocket *iosock) {
 	engine_win32_update(iosock);
+	return 1;
 }
 
 static void engine_win32_remove(struct _IOSocket *iosock) {
@@ -148,22 +140,26 @@ static void engine_win32_loop(struct timeval *timeout) {
 	struct timeval now;
 	
 	//check timers
-	gettimeofday(&now, NULL);
-	if(iotimer_sorted_descriptors && timeval_is_bigger(now, iotimer_sorted_descriptors->timeout))
+	now = iotimer_now;
+	if(iotimer_next_timer() && timeval_is_bigger(now, iotimer_next_timer()->timeout))
 		_trigger_timer();
 	
 	//get timeout (timer or given timeout)
-	if(iotimer_sorted_descriptors) {
-		msec = (iotimer_sorted_descriptors->timeout.tv_sec - now.tv_sec) * 1000;
-		msec += (iotimer_sorted_descriptors->timeout.tv_usec - now.tv_usec) / 1000;
+	if(iotimer_next_timer()) {
+		long long usec = (long long) (iotimer_next_timer()->timeout.tv_sec - now.tv_sec) * 1000000;
+		usec += iotimer_next_timer()->timeout.tv_usec - now.tv_usec;
+		msec = (usec + 999) / 1000; // round up (don't spin on sub-millisecond timeouts)
 	}
 	if(timeout) {
 		msec2 = (timeout->tv_sec * 1000 + timeout->tv_usec / 1000);
-		if(!iotimer_sorted_descriptors || msec2 < msec)
+		if(!iotimer_next_timer() || msec2 < msec)
 			msec = msec2;
-	} else if(!iotimer_sorted_descriptors)
+	} else if(!iotimer_next_timer())
 		msec = -1;
 	
+	//apply pending interest updates
+	iosocket_flush_updates();
+	
 	//set TIMER
 	SetTimer(ioset_window, IDT_TIMER1, 1000, NULL);
 	if(msec > -1)
@@ -171,6 +167,7 @@ static void engine_win32_loop(struct timeval *timeout) {
 	
 	//GetMessage system call
 	res = GetMessage(&msg, NULL, 0, 0);
+	iotimer_update_clock();
 	
 	//kill TIMER
 	KillTimer(ioset_window, IDT_TIMER1);
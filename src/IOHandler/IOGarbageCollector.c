@@ -18,6 +18,7 @@
 #include "IOInternal.h"
 #include "IOHandler.h"
 #include "IOGarbageCollector.h"
+#include "IOTimer.h"
 #include "IOLog.h"
 
 #include <sys/time.h>
@@ -33,7 +34,7 @@ struct IOGCObject {
 
 static int iogc_enabled = 1;
 static struct timeval iogc_timeout;
-static struct IOGCObject *first_object = NULL, *last_object = NULL;
+static IOTHREAD_LOCAL struct IOGCObject *first_object = NULL, *last_object = NULL;
 
 void iogc_init() {
 	iogc_timeout.tv_usec = 0;
@@ -71,7 +72,7 @@ void iogc_add_callback(void *object, iogc_free *free_callback) {
 	}
 	obj->object = object;
 	obj->free_callback = free_callback;
-	gettimeofday(&obj->timeout, NULL);
+	obj->timeout = iotimer_now;
 	obj->timeout.tv_sec += IOGC_TIMEOUT;
 	
 	obj->next = NULL;
@@ -83,12 +84,9 @@ void iogc_add_callback(void *object, iogc_free *free_callback) {
 }
 
 void iogc_exec() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	
 	struct IOGCObject *obj, *next_obj;
 	for(obj = first_object; obj; obj = next_obj) {
-		if(timeval_is_smaler(obj->timeout, now)) {
+		if(timeval_is_smaler(obj->timeout, iotimer_now)) {
 			next_obj = obj->next;
 			if(obj->free_callback)
 				obj->free_callback(obj->object);
@@ -100,3 +98,17 @@ void iogc_exec() {
 	}
 	first_object = obj;
 }
+
+void iogc_flush() {
+	struct IOGCObject *obj;
+	while((obj = first_object)) {
+		first_object = obj->next; // (free callbacks might add further objects)
+		if(!first_object)
+			last_object = NULL;
+		if(obj->free_callback)
+			obj->free_callback(obj->object);
+		else
+			free(obj->object);
+		free(obj);
+	}
+}
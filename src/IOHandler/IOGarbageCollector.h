@@ -22,6 +22,7 @@
 
 void iogc_init();
 void iogc_exec();
+void iogc_flush(); /* free all objects right away (loop teardown) */
 
 #endif
 #endif
@@ -23,9 +23,23 @@
 #include "IOTimer.h"
 #include "IODNSLookup.h"
 #include "IOSockets.h"
+#include "IOSSLBackend.h"
 
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include <stdint.h>
 
 /* compat */
 #include "compat/utime.h"
@@ -33,21 +47,463 @@
 #define IOHANDLER_STATE_INITIALIZED  0x0001
 #define IOHANDLER_STATE_RUNNING      0x0002
 
-static int iohandler_state = 0;
+struct IOHandlerTask {
+	iohandler_task *task;
+	void *arg;
+	struct IOHandlerTask *next;
+};
 
+struct IOHandlerLoop {
+	int id;
+	int stop; /* set by any thread (atomic access) */
+	#ifdef HAVE_PTHREAD_H
+	pthread_t thread;
+	#endif
+	iohandler_loop_init *init;
+	void *arg;
+	
+	struct IOHandlerTask *tasks; /* lock free LIFO, pushed by any thread & taken by the loop thread */
+	int wakeup_fd[2]; /* eventfd (both equal) or pipe; -1 if unavailable */
+	struct _IOSocket *wakeup_sock;
+};
+
+static IOTHREAD_LOCAL int iohandler_state = 0;
+static IOTHREAD_LOCAL struct IOHandlerLoop *iohandler_current = NULL;
+
+static struct IOHandlerLoop *iohandler_loops = NULL;
+static int iohandler_loop_count = 0;
+
+static void iohandler_init_global() {
+	srand(time(NULL));
+	
+	iolog_init();
+	iossl_init();
+	iosocket_scan_init();
+}
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t iohandler_global_once = PTHREAD_ONCE_INIT;
+#else
+static int iohandler_global_initialized = 0;
+#endif
+
+static void iohandler_loop_wakeup(struct IOHandlerLoop *loop) {
+	#ifndef WIN32
+	if(loop->wakeup_fd[1] == -1)
+		return;
+	#ifdef HAVE_SYS_EVENTFD_H
+	if(loop->wakeup_fd[0] == loop->wakeup_fd[1]) {
+		uint64_t value = 1;
+		if(write(loop->wakeup_fd[1], &value, sizeof(value)) < 0 && errno != EAGAIN)
+			iolog_trigger(IOLOG_ERROR, "could not wake up loop %d: %d", loop->id, errno);
+		return;
+	}
+	#endif
+	char value = 1;
+	if(write(loop->wakeup_fd[1], &value, 1) < 0 && errno != EAGAIN)
+		iolog_trigger(IOLOG_ERROR, "could not wake up loop %d: %d", loop->id, errno);
+	#endif
+}
+
+static void iohandler_loop_setup(struct IOHandlerLoop *loop) {
+	loop->wakeup_fd[0] = -1;
+	loop->wakeup_fd[1] = -1;
+	#ifndef WIN32
+	#ifdef HAVE_SYS_EVENTFD_H
+	loop->wakeup_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop->wakeup_fd[1] = loop->wakeup_fd[0];
+	#endif
+	if(loop->wakeup_fd[0] == -1) {
+		if(pipe(loop->wakeup_fd) == -1) {
+			iolog_trigger(IOLOG_ERROR, "could not create wakeup pipe for loop %d: %d", loop->id, errno);
+			loop->wakeup_fd[0] = -1;
+			loop->wakeup_fd[1] = -1;
+			return;
+		}
+		fcntl(loop->wakeup_fd[0], F_SETFL, fcntl(loop->wakeup_fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(loop->wakeup_fd[1], F_SETFL, fcntl(loop->wakeup_fd[1], F_GETFL) | O_NONBLOCK);
+	}
+	
+	struct _IOSocket *iosock = _create_socket();
+	if(!iosock)
+		return;
+	iosock->socket_flags |= IOSOCKETFLAG_PARENT_LOOP | IOSOCKETFLAG_OVERRIDE_WANT_RW | IOSOCKETFLAG_OVERRIDE_WANT_R;
+	iosock->fd = loop->wakeup_fd[0];
+	iosock->parent = loop;
+	if(!iosocket_activate(iosock)) {
+		_free_socket(iosock);
+		return;
+	}
+	loop->wakeup_sock = iosock;
+	#endif
+}
+
+static void iohandler_loop_teardown(struct IOHandlerLoop *loop) {
+	// take pending dns & ssl jobs back from the workers first (they post to the loop)
+	_detach_iodns(loop);
+	iossl_detach(loop);
+	
+	if(loop->wakeup_sock) {
+		_free_socket(loop->wakeup_sock);
+		loop->wakeup_sock = NULL;
+	}
+}
+
+static void iohandler_loop_release(struct IOHandlerLoop *loop) {
+	struct IOHandlerTask *task, *next_task;
+	// other threads may still wake up / post to the loop until all loops have been joined
+	#ifndef WIN32
+	if(loop->wakeup_fd[0] != -1)
+		close(loop->wakeup_fd[0]);
+	if(loop->wakeup_fd[1] != -1 && loop->wakeup_fd[1] != loop->wakeup_fd[0])
+		close(loop->wakeup_fd[1]);
+	#endif
+	loop->wakeup_fd[0] = -1;
+	loop->wakeup_fd[1] = -1;
+	
+	// drop tasks that have not been executed
+	for(task = __atomic_exchange_n(&loop->tasks, NULL, __ATOMIC_ACQUIRE); task; task = next_task) {
+		next_task = task->next;
+		free(task);
+	}
+}
+
+static void iohandler_run_tasks(struct IOHandlerLoop *loop) {
+	struct IOHandlerTask *task, *next_task, *tasks = NULL;
+	if(!__atomic_load_n(&loop->tasks, __ATOMIC_RELAXED))
+		return;
+	
+	// take all pending tasks at once and restore posting order
+	for(task = __atomic_exchange_n(&loop->tasks, NULL, __ATOMIC_ACQUIRE); task; task = next_task) {
+		next_task = task->next;
+		task->next = tasks;
+		tasks = task;
+	}
+	for(task = tasks; task; task = next_task) {
+		next_task = task->next;
+		task->task(task->arg);
+		free(task);
+	}
+}
+
+void iohandler_wakeup_callback(struct _IOSocket *iosock) {
+	struct IOHandlerLoop *loop = iosock->parent;
+	#ifndef WIN32
+	char buf[64];
+	while(read(loop->wakeup_fd[0], buf, sizeof(buf)) > 0) {
+		// drain eventfd counter / pipe
+	}
+	#endif
+	iohandler_run_tasks(loop);
+}
+
+struct IOHandlerTask *_create_task(iohandler_task *task, void *arg) {
+	struct IOHandlerTask *new_task = malloc(sizeof(*new_task));
+	if(!new_task) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOHandlerTask in %s:%d", __FILE__, __LINE__);
+		return NULL;
+	}
+	new_task->task = task;
+	new_task->arg = arg;
+	return new_task;
+}
+
+void _post_task(struct IOHandlerLoop *loop, struct IOHandlerTask *task) {
+	struct IOHandlerTask *head = __atomic_load_n(&loop->tasks, __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while(!__atomic_compare_exchange_n(&loop->tasks, &head, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	
+	// only the first task of a batch needs to wake up the loop
+	// (task may already be executed & freed by the loop at this point)
+	if(!head)
+		iohandler_loop_wakeup(loop);
+}
+
+int iohandler_post(struct IOHandlerLoop *loop, iohandler_task *task, void *arg) {
+	struct IOHandlerTask *new_task;
+	if(!loop)
+		loop = iohandler_current;
+	if(!loop) {
+		iolog_trigger(IOLOG_ERROR, "iohandler_post called without an initialized loop in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	if(!(new_task = _create_task(task, arg)))
+		return 0;
+	_post_task(loop, new_task);
+	return 1;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* call with pool->sync locked. prepends the finished jobs of loop to jobs in completion order */
+static struct IOWorkerJob *ioworker_take_finished(struct IOWorkerPool *pool, struct IOHandlerLoop *loop, struct IOWorkerJob *jobs) {
+	struct IOWorkerJob *job, **link;
+	for(link = &pool->finished; (job = *link); ) {
+		if(job->loop == loop) {
+			*link = job->next;
+			job->next = jobs;
+			jobs = job;
+		} else
+			link = &job->next;
+	}
+	return jobs;
+}
+
+/* call with pool->sync locked */
+static void ioworker_unqueue(struct IOWorkerPool *pool, struct IOWorkerJob *job) {
+	struct IOWorkerJob *entry, **link;
+	pool->last = NULL;
+	for(link = &pool->first; (entry = *link); ) {
+		if(entry == job) {
+			*link = entry->next;
+			pool->pending--;
+		} else {
+			pool->last = entry;
+			link = &entry->next;
+		}
+	}
+}
+
+/* call with pool->sync locked */
+static void ioworker_deactivate(struct IOWorkerPool *pool, struct IOWorkerJob *job) {
+	struct IOWorkerJob *entry, **link;
+	for(link = &pool->active; (entry = *link); link = &entry->next) {
+		if(entry == job) {
+			*link = entry->next;
+			return;
+		}
+	}
+}
+
+static void ioworker_release(struct IOWorkerJob *job) {
+	if(job->complete) {
+		free(job->complete); // never posted
+		job->complete = NULL;
+	}
+}
+
+static IOHANDLER_TASK(ioworker_collect) {
+	// complete all finished jobs of this loop (the jobs of several posts might be completed by one task)
+	struct IOWorkerPool *pool = arg;
+	struct IOWorkerJob *jobs, *job;
+	pthread_mutex_lock(&pool->sync);
+	jobs = ioworker_take_finished(pool, iohandler_current, NULL);
+	pthread_mutex_unlock(&pool->sync);
+	
+	while((job = jobs)) {
+		jobs = job->next;
+		pool->complete(job);
+	}
+}
+
+static void *ioworker_main(void *arg) {
+	struct IOWorkerPool *pool = arg;
+	struct IOWorkerJob *job;
+	pthread_mutex_lock(&pool->sync);
+	while(!pool->shutdown) {
+		if(!(job = pool->first)) {
+			pool->idle++;
+			pthread_cond_wait(&pool->cond, &pool->sync);
+			pool->idle--;
+			continue;
+		}
+		pool->first = job->next;
+		if(!pool->first)
+			pool->last = NULL;
+		pool->pending--;
+		job->state = IOWORKER_JOB_RUNNING;
+		job->next = pool->active;
+		pool->active = job;
+		pthread_mutex_unlock(&pool->sync);
+	
+		pool->step(job);
+	
+		pthread_mutex_lock(&pool->sync);
+		ioworker_deactivate(pool, job);
+		job->state = IOWORKER_JOB_DONE;
+		job->next = pool->finished;
+		pool->finished = job;
+		// posted with the lock held: the loop can't be detached (and freed) meanwhile
+		_post_task(job->loop, job->complete);
+		job->complete = NULL;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->sync);
+	return NULL;
+}
+
+/* call with pool->sync locked */
+static int ioworker_spawn(struct IOWorkerPool *pool) {
+	sigset_t sigmask, oldmask;
+	int ret;
+	if(pool->running >= pool->max)
+		return 0;
+	// workers must not take signals meant for the loops
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_SETMASK, &sigmask, &oldmask);
+	ret = pthread_create(&pool->threads[pool->running], NULL, ioworker_main, pool);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if(ret) {
+		iolog_trigger(IOLOG_ERROR, "could not create pthread in %s:%d (Returned: %i)", __FILE__, __LINE__, ret);
+		return 0;
+	}
+	pool->running++;
+	return 1;
+}
+
+void _start_workers(struct IOWorkerPool *pool, int threads) {
+	pthread_mutex_lock(&pool->sync);
+	// a stop in progress joins the workers without the lock: let it finish first
+	while(pool->stopping)
+		pthread_cond_wait(&pool->done, &pool->sync);
+	pool->users++;
+	pool->shutdown = 0;
+	pool->max = (threads < pool->size ? threads : pool->size);
+	pthread_mutex_unlock(&pool->sync);
+}
+
+void _stop_workers(struct IOWorkerPool *pool) {
+	struct IOWorkerJob *job;
+	int i, running;
+	pthread_mutex_lock(&pool->sync);
+	if(--pool->users > 0) {
+		pthread_mutex_unlock(&pool->sync);
+		return;
+	}
+	pool->shutdown = 1;
+	pool->stopping = 1;
+	running = pool->running;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->sync);
+	
+	for(i = 0; i < running; i++)
+		pthread_join(pool->threads[i], NULL);
+	
+	// all loops have been detached, drop what is left (jobs of loops that were never detached)
+	pthread_mutex_lock(&pool->sync);
+	pool->running = 0;
+	while((job = pool->first)) {
+		pool->first = job->next;
+		ioworker_release(job);
+		pool->drop(job);
+	}
+	pool->last = NULL;
+	pool->pending = 0;
+	while((job = pool->finished)) {
+		pool->finished = job->next;
+		pool->drop(job);
+	}
+	pool->stopping = 0;
+	pthread_cond_broadcast(&pool->done);
+	pthread_mutex_unlock(&pool->sync);
+}
+
+int _enqueue_job(struct IOWorkerPool *pool, struct IOWorkerJob *job) {
+	if(!iohandler_current)
+		return 0;
+	if(!(job->complete = _create_task(ioworker_collect, pool)))
+		return 0;
+	job->loop = iohandler_current;
+	job->state = IOWORKER_JOB_QUEUED;
+	job->next = NULL;
+	
+	pthread_mutex_lock(&pool->sync);
+	if(pool->shutdown || (pool->idle <= pool->pending && !ioworker_spawn(pool) && !pool->running)) {
+		pthread_mutex_unlock(&pool->sync);
+		ioworker_release(job);
+		return 0;
+	}
+	if(pool->last)
+		pool->last->next = job;
+	else
+		pool->first = job;
+	pool->last = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->sync);
+	return 1;
+}
+
+int _cancel_job(struct IOWorkerPool *pool, struct IOWorkerJob *job) {
+	pthread_mutex_lock(&pool->sync);
+	if(job->state == IOWORKER_JOB_QUEUED) {
+		ioworker_unqueue(pool, job);
+		pthread_mutex_unlock(&pool->sync);
+		ioworker_release(job);
+		return 1;
+	}
+	// the worker may still use the resources of the job: wait for the step to finish
+	while(job->state != IOWORKER_JOB_DONE)
+		pthread_cond_wait(&pool->done, &pool->sync);
+	pthread_mutex_unlock(&pool->sync);
+	return 0;
+}
+
+struct IOWorkerJob *_detach_workers(struct IOWorkerPool *pool, struct IOHandlerLoop *loop, struct IOWorkerJob **queued) {
+	// the loop stops: take its jobs back, so no worker posts to it afterwards
+	struct IOWorkerJob *jobs = NULL, *job, **link;
+	int busy;
+	pthread_mutex_lock(&pool->sync);
+	pool->last = NULL;
+	for(link = &pool->first; (job = *link); ) {
+		if(job->loop == loop) {
+			*link = job->next;
+			ioworker_release(job);
+			job->next = jobs;
+			jobs = job;
+			pool->pending--;
+		} else {
+			pool->last = job;
+			link = &job->next;
+		}
+	}
+	*queued = jobs;
+	do {
+		busy = 0;
+		for(job = pool->active; job; job = job->next) {
+			if(job->loop == loop)
+				busy = 1;
+		}
+		if(busy)
+			pthread_cond_wait(&pool->done, &pool->sync);
+	} while(busy);
+	jobs = ioworker_take_finished(pool, loop, NULL);
+	pthread_mutex_unlock(&pool->sync);
+	// (the completion tasks of the finished jobs are dropped with the loop)
+	return jobs;
+}
+#endif
 
 void iohandler_init() {
 	if((iohandler_state & IOHANDLER_STATE_INITIALIZED)) 
 		return;
 	
-	srand(time(NULL));
+	// process wide initialization (only once)
+	#ifdef HAVE_PTHREAD_H
+	pthread_once(&iohandler_global_once, iohandler_init_global);
+	#else
+	if(!iohandler_global_initialized) {
+		iohandler_global_initialized = 1;
+		iohandler_init_global();
+	}
+	#endif
 	
-	iolog_init();
+	// event loop initialization (once per thread)
 	iogc_init();
 	
 	_init_timers();
 	_init_iodns();
 	_init_sockets();
+	iossl_start();
+	
+	if(!iohandler_current) {
+		// single loop mode: the loop of the initializing thread
+		iohandler_current = calloc(1, sizeof(*iohandler_current));
+		if(!iohandler_current)
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOHandlerLoop in %s:%d", __FILE__, __LINE__);
+	}
+	if(iohandler_current)
+		iohandler_loop_setup(iohandler_current);
 	
 	iohandler_state |= IOHANDLER_STATE_INITIALIZED;
 }
@@ -58,7 +514,14 @@ void iohandler_stop() {
 
 static void iohandler_loop() {
 	while(iohandler_state & IOHANDLER_STATE_RUNNING) { // endless loop
+		if(iohandler_current && __atomic_load_n(&iohandler_current->stop, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&iohandler_current->stop, 0, __ATOMIC_RELAXED);
+			break;
+		}
+		
 		// iohandler calls
+		if(iohandler_current)
+			iohandler_run_tasks(iohandler_current);
 		iogc_exec();
 		iodns_poll();
 		iosocket_loop(IOHANDLER_LOOP_MAXTIME);
@@ -72,3 +535,117 @@ void iohandler_run() {
 	iohandler_loop();
 }
 
+struct timeval iohandler_now() {
+	return iotimer_now;
+}
+
+/* multi loop mode */
+
+struct IOHandlerLoop *iohandler_current_loop() {
+	return iohandler_current;
+}
+
+int iohandler_loop_id(struct IOHandlerLoop *loop) {
+	if(!loop)
+		return 0;
+	return loop->id;
+}
+
+void iohandler_stop_loop(struct IOHandlerLoop *loop) {
+	__atomic_store_n(&loop->stop, 1, __ATOMIC_RELEASE);
+	if(loop != iohandler_current)
+		iohandler_loop_wakeup(loop);
+}
+
+void iohandler_stop_loops() {
+	int i;
+	for(i = 0; i < iohandler_loop_count; i++)
+		iohandler_stop_loop(&iohandler_loops[i]);
+}
+
+static void iohandler_loop_cleanup() {
+	// release the event loop state of the current thread (dns, sockets, engine, timers & object caches)
+	_stop_iodns();
+	_stop_sockets();
+	iossl_stop();
+	_stop_timers();
+	iohandler_state = 0;
+}
+
+static void *iohandler_loop_main(void *arg) {
+	struct IOHandlerLoop *loop = arg;
+	struct IOHandlerLoop *prev_loop = iohandler_current;
+	int initialized = (iohandler_state & IOHANDLER_STATE_INITIALIZED);
+	iohandler_current = loop;
+	
+	if(initialized)
+		iohandler_loop_setup(loop); // thread has been initialized in single loop mode before
+	else
+		iohandler_init();
+	if(loop->init)
+		loop->init(loop, loop->arg);
+	iohandler_run();
+	
+	iohandler_loop_teardown(loop);
+	if(!initialized)
+		iohandler_loop_cleanup(); // the thread state belongs to this loop only
+	iohandler_current = prev_loop;
+	return NULL;
+}
+
+int iohandler_run_loops(int count, iohandler_loop_init *init, void *arg) {
+	int i;
+	if(iohandler_loops) {
+		iolog_trigger(IOLOG_ERROR, "iohandler_run_loops called while loops are already running");
+		return 0;
+	}
+	#ifndef HAVE_PTHREAD_H
+	if(count > 1) {
+		iolog_trigger(IOLOG_WARNING, "compiled without pthread support: running a single event loop only");
+		count = 1;
+	}
+	#endif
+	if(count < 1)
+		count = 1;
+	iohandler_loops = calloc(count, sizeof(*iohandler_loops));
+	if(!iohandler_loops) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOHandlerLoop in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	iohandler_loop_count = count;
+	for(i = 0; i < count; i++) {
+		iohandler_loops[i].id = i;
+		iohandler_loops[i].init = init;
+		iohandler_loops[i].arg = arg;
+		iohandler_loops[i].wakeup_fd[0] = -1;
+		iohandler_loops[i].wakeup_fd[1] = -1;
+	}
+	
+	// the calling thread runs loop 0, all other loops get their own thread
+	#ifdef HAVE_PTHREAD_H
+	for(i = 1; i < count; i++) {
+		int thread_err = pthread_create(&iohandler_loops[i].thread, NULL, iohandler_loop_main, &iohandler_loops[i]);
+		if(thread_err) {
+			iolog_trigger(IOLOG_ERROR, "could not create pthread in %s:%d (Returned: %i)", __FILE__, __LINE__, thread_err);
+			count = i;
+			iohandler_loop_count = count;
+			break;
+		}
+	}
+	#endif
+	iohandler_loop_main(&iohandler_loops[0]);
+	
+	// stop & wait for the other loops
+	iohandler_stop_loops();
+	#ifdef HAVE_PTHREAD_H
+	for(i = 1; i < count; i++)
+		pthread_join(iohandler_loops[i].thread, NULL);
+	#endif
+	for(i = 0; i < count; i++)
+		iohandler_loop_release(&iohandler_loops[i]);
+	
+	free(iohandler_loops);
+	iohandler_loops = NULL;
+	iohandler_loop_count = 0;
+	return count;
+}
@@ -17,14 +17,99 @@
 #ifndef _IOHandler_h
 #define _IOHandler_h
 #include "IOHandler_config.h"
+#include <sys/time.h>
 #ifdef _IOHandler_internals
+struct _IOSocket;
+
+void iohandler_wakeup_callback(struct _IOSocket *iosock);
 
 #endif
 
 void iohandler_init();
 void iohandler_run();
 void iohandler_stop();
+struct timeval iohandler_now(); /* monotonic time of the current loop iteration (not wall clock, use for intervals & timeouts) */
+
+/* multi loop mode (one event loop per thread, each loop owns its sockets, timers & dns queries) */
+struct IOHandlerLoop;
+
+#define IOHANDLER_LOOP_INIT(NAME) void NAME(struct IOHandlerLoop *loop, void *arg)
+typedef IOHANDLER_LOOP_INIT(iohandler_loop_init);
+
+int iohandler_run_loops(int count, iohandler_loop_init *init, void *arg); /* runs init & the event loop on count threads (loop 0 on the calling thread). returns after all loops stopped */
+struct IOHandlerLoop *iohandler_current_loop(); /* loop of the calling thread (NULL before iohandler_init) */
+int iohandler_loop_id(struct IOHandlerLoop *loop);
+void iohandler_stop_loop(struct IOHandlerLoop *loop);
+void iohandler_stop_loops();
+
+/* cross thread task posting */
+#define IOHANDLER_TASK(NAME) void NAME(void *arg)
+typedef IOHANDLER_TASK(iohandler_task);
+
+int iohandler_post(struct IOHandlerLoop *loop, iohandler_task *task, void *arg); /* thread safe: runs task(arg) on the loop's thread (loop NULL: current loop). returns 0 on error */
+
+#ifdef _IOHandler_internals
+struct IOHandlerTask;
+
+struct IOHandlerTask *_create_task(iohandler_task *task, void *arg); /* allocated up front for _post_task (free() if never posted) */
+void _post_task(struct IOHandlerLoop *loop, struct IOHandlerTask *task); /* thread safe & can't fail: the loop owns the task afterwards */
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+/* worker pool (blocking work of the loops, shared by all threads)
+ * the engine embeds struct IOWorkerJob as the first member of its jobs. step runs on a worker (must not log),
+ * complete runs on the loop that queued the job, drop frees jobs that are never completed (pool stopped).
+ * workers are started on demand and joined with the last user (_start_workers / _stop_workers).
+ */
+struct IOWorkerJob {
+	struct IOHandlerLoop *loop;
+	struct IOHandlerTask *complete; /* hands the job back to its loop (allocated up front, so it can't fail) */
+	int state; /* IOWORKER_JOB_* (protected by the pool) */
+	struct IOWorkerJob *next;
+};
+
+#define IOWORKER_JOB_QUEUED  0
+#define IOWORKER_JOB_RUNNING 1
+#define IOWORKER_JOB_DONE    2
+
+#define IOWORKER_JOB(NAME) void NAME(struct IOWorkerJob *job)
+typedef IOWORKER_JOB(ioworker_job);
+
+struct IOWorkerPool {
+	ioworker_job *step;
+	ioworker_job *complete;
+	ioworker_job *drop;
+	pthread_t *threads;
+	int size; /* capacity of threads */
+	
+	pthread_mutex_t sync;
+	pthread_cond_t cond; /* new jobs & shutdown */
+	pthread_cond_t done; /* a step finished / the pool stopped */
+	int max, running, idle, pending;
+	int users, shutdown, stopping;
+	struct IOWorkerJob *first, *last; /* queued */
+	struct IOWorkerJob *active; /* running on a worker */
+	struct IOWorkerJob *finished; /* not yet taken by their loop (newest first) */
+};
+
+#define IOWORKER_POOL(STEP, COMPLETE, DROP, THREADS) { \
+	.step = STEP, .complete = COMPLETE, .drop = DROP, \
+	.threads = THREADS, .size = sizeof(THREADS) / sizeof(*(THREADS)), \
+	.sync = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER \
+}
+
+void _start_workers(struct IOWorkerPool *pool, int threads); /* adds a user (thread state). threads: max. workers (up to size) */
+void _stop_workers(struct IOWorkerPool *pool); /* removes a user, the last one joins the workers & drops what is left */
+int _enqueue_job(struct IOWorkerPool *pool, struct IOWorkerJob *job); /* queues job for the current loop. returns 0 if it has to run inline */
+int _cancel_job(struct IOWorkerPool *pool, struct IOWorkerJob *job); /* returns 1 if job was still queued (owned by the caller again), otherwise waits for the step: job is completed as usual */
+struct IOWorkerJob *_detach_workers(struct IOWorkerPool *pool, struct IOHandlerLoop *loop, struct IOWorkerJob **queued); /* takes the jobs of a stopping loop back: returns the finished ones (completion order), queued ones in *queued */
+#endif
+#endif
 
 void iohandler_set_gc(int enabled); /* default: enabled */
+void iohandler_set_edge_triggered(int enabled); /* default: disabled (epoll engine only, call before iohandler_init) */
+void iohandler_set_ktls(int enabled); /* default: disabled. kernel TLS for established SSL connections (if supported by the SSL library & kernel) */
+void iohandler_set_ssl_threads(int threads); /* default: 0. run the handshakes of incoming SSL connections on up to threads workers (max. IOSSL_HANDSHAKE_THREADS, call before iohandler_init) */
 
 #endif
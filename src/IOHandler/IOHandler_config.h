@@ -17,8 +17,8 @@
 
 /* required configure script checks
  AC_FUNC_MALLOC
- AC_CHECK_FUNCS([usleep select socket inet_pton inet_ntop])
- AC_CHECK_HEADERS([fcntl.h sys/socket.h sys/select.h sys/time.h sys/types.h unistd.h windows.h winsock2.h errno.h sys/epoll.h sys/event.h])
+ AC_CHECK_FUNCS([usleep select socket inet_pton inet_ntop accept4])
+ AC_CHECK_HEADERS([fcntl.h sys/socket.h sys/select.h sys/time.h sys/types.h unistd.h windows.h winsock2.h errno.h sys/epoll.h sys/event.h sys/eventfd.h sys/syscall.h linux/io_uring.h poll.h])
  
  AC_CHECK_LIB(ws2_32, main, [ LIBS="$LIBS -lws2_32" ], [])
  have_gnutls="no"
@@ -45,6 +45,7 @@
  AC_CHECK_LIB(cares, ares_init, [
    AC_CHECK_HEADERS(ares.h, [
      LIBS="$LIBS -lcares"
+     AC_CHECK_FUNCS([ares_getaddrinfo])
    ])
  ])
 */
@@ -57,7 +58,32 @@
 #define IOSOCKET_PARSE_DELIMITERS_COUNT 5
 #define IOSOCKET_PARSE_LINE_LIMIT 1024
 #define IOSOCKET_PRINTF_LINE_LEN  1024
+#define IOSOCKET_WRITE_CHUNK_SIZE 4096 /* small writes are collected in chunks of this size */
+#define IOSOCKET_WRITEV_MAX       64   /* max. chunks per writev call */
+#define IOSOCKET_READBUF_SIZE     1024 /* initial readbuf size (allocated on the first read) */
+#define IOSOCKET_ACCEPT_BATCH     64   /* max. connections accepted per listener event */
+#define IOSOCKET_LINGER_TIMEOUT   10000 /* msec: max. time a closed socket may spend flushing its write queue */
+#define IOSOCKET_CONNECT_DELAY    250  /* msec: delay before racing the next address of a connecting socket (RFC 8305) */
 
-//#define IODNS_USE_THREADS
+#define IOURING_RECV_BUFFERS      256  /* receive buffers provided to the kernel per loop (io_uring engine) */
+#define IOURING_RECV_BUFFER_SIZE  4096 /* size of each receive buffer */
+#define IOURING_ACCEPT_DEPTH      8    /* accept requests kept in flight per listener */
+
+#define IOSSL_SESSION_CACHE_SIZE    128  /* max. cached client sessions (one per host:port) */
+#define IOSSL_SESSION_CACHE_TIMEOUT 3600 /* sec: max. age of a cached client session */
+#define IOSSL_SERVER_CACHE_SIZE     1024 /* default max. cached sessions per SSL listener */
+#define IOSSL_SERVER_CACHE_TIMEOUT  3600 /* sec: default max. age of a resumable server session (cache & tickets) */
+#define IOSSL_TICKET_KEY_LIFETIME   3600 /* sec: session ticket keys are rotated after this time (OpenSSL, GnuTLS rotates internally) */
+#define IOSSL_HANDSHAKE_THREADS     8    /* max. handshake worker threads (shared by all loops, see iohandler_set_ssl_threads) */
+
+#define IOSLAB_BLOCK_OBJECTS 64 /* objects per slab block */
+
+#define IODNS_USE_THREADS /* resolve with a worker pool if there is no c-ares (pthread required) */
+#define IODNS_THREADS            4    /* max. getaddrinfo worker threads (shared by all loops) */
+#define IODNS_CACHE_SIZE         256  /* max. cached hostnames per loop */
+#define IODNS_CACHE_BUCKETS      64
+#define IODNS_CACHE_TTL          60   /* sec: cache time for results without ttl (getaddrinfo) */
+#define IODNS_CACHE_MAX_TTL      3600 /* sec: upper limit for record ttls */
+#define IODNS_CACHE_NEGATIVE_TTL 5    /* sec: cache time for nonexistent names (NXDOMAIN) */
 
 #define IOGC_TIMEOUT 60
@@ -19,6 +19,14 @@
 #ifndef _IOHandler_internals
 #include "IOHandler.h"
 #else
+#include <stddef.h>
+
+/* thread local storage: every event loop thread owns its engine, sockets, timers & dns queries */
+#if defined(_MSC_VER)
+#define IOTHREAD_LOCAL __declspec(thread)
+#else
+#define IOTHREAD_LOCAL __thread
+#endif
 
 #define timeval_is_bigger(x,y) ((x.tv_sec > y.tv_sec) || (x.tv_sec == y.tv_sec && x.tv_usec > y.tv_usec))
 #define timeval_is_smaler(x,y) ((x.tv_sec < y.tv_sec) || (x.tv_sec == y.tv_sec && x.tv_usec < y.tv_usec))
@@ -28,5 +36,17 @@ typedef IOGC_FREE(iogc_free);
 void iogc_add(void *object);
 void iogc_add_callback(void *object, iogc_free *free_callback);
 
+/* fixed size object cache (use one thread local slab per object type; objects must be freed by the allocating thread) */
+struct IOSlabBlock;
+struct IOSlab {
+	size_t objsize;
+	struct IOSlabBlock *partial; /* blocks with free objects */
+	unsigned int empty_blocks;
+};
+#define IOSLAB_INIT(TYPE) { sizeof(TYPE), NULL, 0 }
+void *ioslab_alloc(struct IOSlab *slab); /* returns zeroed memory */
+void ioslab_free(void *object);
+void ioslab_release(struct IOSlab *slab); /* free the blocks of a slab without live objects (loop teardown) */
+
 #endif
 #endif
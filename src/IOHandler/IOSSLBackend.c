@@ -20,11 +20,439 @@
 #include "IOLog.h"
 #include "IOSockets.h"
 #include "IOSSLBackend.h"
+#include "IOTimer.h"
 
-#if defined(HAVE_GNUTLS_GNUTLS_H)
+static int iossl_ktls = 0;
+static int iossl_threads = 0; /* max. handshake workers (0: handshakes run on the loop) */
+
+void iohandler_set_ktls(int enabled) {
+	iossl_ktls = (enabled ? 1 : 0);
+}
+
+void iohandler_set_ssl_threads(int threads) {
+	if(threads < 0)
+		threads = 0;
+	else if(threads > IOSSL_HANDSHAKE_THREADS)
+		threads = IOSSL_HANDSHAKE_THREADS;
+	iossl_threads = threads;
+}
+
+#if defined(HAVE_GNUTLS_GNUTLS_H) || defined(HAVE_OPENSSL_SSL_H)
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+#include "compat/inet.h"
+
+/* client profiles: one context per profile, shared by all outgoing connections & loops */
+struct IOSSLProfile {
+	char *name;
+	unsigned int refcount; /* list & sockets (protected by iossl_sync) */
+	unsigned int verify : 1;
+	#if defined(HAVE_GNUTLS_GNUTLS_H)
+	gnutls_priority_t priority;
+	gnutls_certificate_credentials_t credentials;
+	#else
+	SSL_CTX *context;
+	#endif
+	struct IOSSLProfile *next;
+};
+
+/* client session cache
+ * the last session of every destination (profile/host:port) is kept for resumption, shared by all loops.
+ * bounded LRU: the most recently used entry is first.
+ */
+struct IOSSLSession {
+	char *peer;
+	struct timeval expire;
+	#if defined(HAVE_GNUTLS_GNUTLS_H)
+	gnutls_datum_t data;
+	#else
+	SSL_SESSION *session;
+	#endif
+	struct IOSSLSession *prev, *next;
+};
+
+static struct IOSSLProfile *iossl_profiles = NULL;
+static struct IOSSLSession *iossl_sessions_first = NULL, *iossl_sessions_last = NULL;
+static int iossl_session_count = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t iossl_sync = PTHREAD_MUTEX_INITIALIZER;
+#define IOSSL_LOCK() pthread_mutex_lock(&iossl_sync)
+#define IOSSL_UNLOCK() pthread_mutex_unlock(&iossl_sync)
+#else
+#define IOSSL_LOCK()
+#define IOSSL_UNLOCK()
+#endif
+
+#define IOSSL_DEFAULT_PROFILE "default"
+
+/* backend specific (context setup & cleanup) */
+static int iossl_profile_setup(struct IOSSLProfile *profile, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile);
+static void iossl_profile_cleanup(struct IOSSLProfile *profile);
+
+static struct IOSSLProfile *iossl_profile_create(const char *name, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile) {
+	struct IOSSLProfile *profile = calloc(1, sizeof(*profile));
+	if(!profile || !(profile->name = strdup(name))) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSSLProfile in %s:%d", __FILE__, __LINE__);
+		if(profile)
+			free(profile);
+		return NULL;
+	}
+	profile->refcount = 1;
+	if(!iossl_profile_setup(profile, ciphers, cafile, certfile, keyfile)) {
+		iossl_profile_cleanup(profile);
+		free(profile->name);
+		free(profile);
+		return NULL;
+	}
+	return profile;
+}
+
+int iossl_add_profile(const char *name, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile) {
+	struct IOSSLProfile *profile = iossl_profile_create(name, ciphers, cafile, certfile, keyfile), *old = NULL, **link;
+	if(!profile)
+		return 0;
+	IOSSL_LOCK();
+	// replace the old profile (sockets keep their reference)
+	for(link = &iossl_profiles; *link; link = &(*link)->next) {
+		if(!strcmp((*link)->name, name)) {
+			old = *link;
+			*link = old->next;
+			break;
+		}
+	}
+	profile->next = iossl_profiles;
+	iossl_profiles = profile;
+	IOSSL_UNLOCK();
+	if(old)
+		iossl_release_profile(old);
+	return 1;
+}
+
+struct IOSSLProfile *iossl_get_profile(const char *name) {
+	struct IOSSLProfile *profile;
+	if(!name)
+		name = IOSSL_DEFAULT_PROFILE;
+	IOSSL_LOCK();
+	for(profile = iossl_profiles; profile; profile = profile->next) {
+		if(!strcmp(profile->name, name))
+			break;
+	}
+	if(!profile && !strcmp(name, IOSSL_DEFAULT_PROFILE)) {
+		// created on first use
+		if((profile = iossl_profile_create(name, NULL, NULL, NULL, NULL))) {
+			profile->next = iossl_profiles;
+			iossl_profiles = profile;
+		}
+	}
+	if(profile)
+		profile->refcount++;
+	IOSSL_UNLOCK();
+	return profile;
+}
+
+void iossl_release_profile(struct IOSSLProfile *profile) {
+	unsigned int refcount;
+	IOSSL_LOCK();
+	refcount = --profile->refcount;
+	IOSSL_UNLOCK();
+	if(refcount)
+		return;
+	iossl_profile_cleanup(profile);
+	free(profile->name);
+	free(profile);
+}
+
+static int iossl_is_address(const char *host) {
+	struct in6_addr addr;
+	return (inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1);
+}
+
+static void iossl_session_key(struct _IOSocket *iosock, struct IOSSLProfile *profile, char *key, size_t keylen) {
+	snprintf(key, keylen, "%s/%s:%u", profile->name, iosock->ssl_peer, iosock->port);
+}
+
+static void iossl_session_unlink(struct IOSSLSession *entry) {
+	if(entry->prev)
+		entry->prev->next = entry->next;
+	else
+		iossl_sessions_first = entry->next;
+	if(entry->next)
+		entry->next->prev = entry->prev;
+	else
+		iossl_sessions_last = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void iossl_session_free(struct IOSSLSession *entry) {
+	iossl_session_unlink(entry);
+	iossl_session_count--;
+	#if defined(HAVE_GNUTLS_GNUTLS_H)
+	gnutls_free(entry->data.data);
+	#else
+	SSL_SESSION_free(entry->session);
+	#endif
+	free(entry->peer);
+	free(entry);
+}
+
+/* call with iossl_sync locked; returns the valid entry of peer (moved to the front) */
+static struct IOSSLSession *iossl_session_find(const char *peer) {
+	struct IOSSLSession *entry;
+	for(entry = iossl_sessions_first; entry; entry = entry->next) {
+		if(strcmp(entry->peer, peer))
+			continue;
+		if(!timeval_is_bigger(entry->expire, iotimer_now)) {
+			iossl_session_free(entry);
+			return NULL;
+		}
+		if(entry != iossl_sessions_first) {
+			iossl_session_unlink(entry);
+			entry->next = iossl_sessions_first;
+			iossl_sessions_first->prev = entry;
+			iossl_sessions_first = entry;
+		}
+		return entry;
+	}
+	return NULL;
+}
+
+/* call with iossl_sync locked; returns a new or recycled entry at the front */
+static struct IOSSLSession *iossl_session_add(const char *peer, unsigned int lifetime) {
+	struct IOSSLSession *entry = iossl_session_find(peer);
+	if(entry) {
+		#if defined(HAVE_GNUTLS_GNUTLS_H)
+		gnutls_free(entry->data.data);
+		entry->data.data = NULL;
+		#else
+		SSL_SESSION_free(entry->session);
+		entry->session = NULL;
+		#endif
+	} else {
+		if(iossl_session_count >= IOSSL_SESSION_CACHE_SIZE)
+			iossl_session_free(iossl_sessions_last);
+		entry = calloc(1, sizeof(*entry));
+		if(!entry || !(entry->peer = strdup(peer))) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSSLSession in %s:%d", __FILE__, __LINE__);
+			if(entry)
+				free(entry);
+			return NULL;
+		}
+		entry->next = iossl_sessions_first;
+		if(iossl_sessions_first)
+			iossl_sessions_first->prev = entry;
+		else
+			iossl_sessions_last = entry;
+		iossl_sessions_first = entry;
+		iossl_session_count++;
+	}
+	if(!lifetime || lifetime > IOSSL_SESSION_CACHE_TIMEOUT)
+		lifetime = IOSSL_SESSION_CACHE_TIMEOUT;
+	entry->expire = iotimer_now;
+	entry->expire.tv_sec += lifetime;
+	return entry;
+}
+
+static void iossl_session_forget(const char *peer) {
+	struct IOSSLSession *entry;
+	IOSSL_LOCK();
+	if((entry = iossl_session_find(peer)))
+		iossl_session_free(entry);
+	IOSSL_UNLOCK();
+}
+
+/* handshake offloading (iohandler_set_ssl_threads)
+ * the key exchange of incoming connections is expensive, so every handshake step (the library call on the
+ * nonblocking fd) runs on a worker pool (_enqueue_job). the socket is parked (ssl_job set, no events)
+ * until the result is handed back to its loop and processed like an inline step.
+ * a stopping loop takes its jobs back and finishes them inline (iossl_detach).
+ */
+#define IOSSL_JOB_ERRORS 4
+
+struct IOSSLHandshakeJob {
+	#ifdef HAVE_PTHREAD_H
+	struct IOWorkerJob worker; /* (first member) */
+	#endif
+	struct _IOSocket *iosock; /* NULL: socket closed while the step was running */
+	struct IOSSLDescriptor *sslnode;
+	struct timeval now; /* loop time (session expiry in the backend callbacks) */
+	int ret, err;
+	unsigned long errors[IOSSL_JOB_ERRORS]; /* library error codes of the step */
+	const char *message; /* error of a backend callback during the step */
+	int missed; /* socket events while the step was running (loop only) */
+};
+
+/* backend specific (runs on the worker / processes the result on the loop) */
+static void iossl_server_handshake_step(struct IOSSLHandshakeJob *job);
+static int iossl_server_handshake_finish(struct _IOSocket *iosock, struct IOSSLHandshakeJob *job); /* returns 1 if the handshake continues */
+static int iossl_handshake_offload(struct _IOSocket *iosock);
+
+/* the step may run on a worker: errors are kept in the job and logged by the loop */
+static IOTHREAD_LOCAL struct IOSSLHandshakeJob *iossl_step_job = NULL;
+
+static void iossl_handshake_step(struct IOSSLHandshakeJob *job) {
+	iossl_step_job = job;
+	iossl_server_handshake_step(job);
+	iossl_step_job = NULL;
+}
+
+/* error of a backend callback (returns 0 if it has to be logged right away) */
+static int iossl_step_error(const char *message) {
+	if(!iossl_step_job)
+		return 0;
+	if(!iossl_step_job->message)
+		iossl_step_job->message = message;
+	return 1;
+}
+
+static int iossl_handshake_result(struct _IOSocket *iosock, struct IOSSLHandshakeJob *job) {
+	if(job->message)
+		iolog_trigger(IOLOG_ERROR, "%s (fd %d)", job->message, iosock->fd);
+	return iossl_server_handshake_finish(iosock, job);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void iossl_handshake_complete(struct IOSSLHandshakeJob *job) {
+	struct _IOSocket *iosock = job->iosock;
+	int missed = job->missed, pending;
+	if(!iosock) {
+		free(job); // closed in the meantime
+		return;
+	}
+	iosock->ssl_job = NULL;
+	iosocket_update(iosock); // the socket has been parked while the step was running
+	pending = iossl_handshake_result(iosock, job);
+	free(job);
+	// edge triggered sockets won't report data that arrived during the step again
+	if(pending && missed)
+		iossl_server_handshake(iosock);
+}
+
+static IOTHREAD_LOCAL int iossl_detaching = 0; /* the loop of this thread is being detached (no new jobs) */
+
+static IOWORKER_JOB(iossl_worker_step) {
+	struct IOSSLHandshakeJob *ssljob = (struct IOSSLHandshakeJob *) job;
+	iotimer_now = ssljob->now;
+	iossl_handshake_step(ssljob);
+}
+
+static IOWORKER_JOB(iossl_worker_complete) {
+	iossl_handshake_complete((struct IOSSLHandshakeJob *) job);
+}
+
+static IOWORKER_JOB(iossl_worker_drop) {
+	free(job);
+}
+
+static pthread_t iossl_workers[IOSSL_HANDSHAKE_THREADS];
+static struct IOWorkerPool iossl_pool = IOWORKER_POOL(iossl_worker_step, iossl_worker_complete, iossl_worker_drop, iossl_workers);
+#endif
+
+/* hands the next handshake step of iosock to a worker. returns 0 if it has to run inline */
+static int iossl_handshake_offload(struct _IOSocket *iosock) {
+	#ifdef HAVE_PTHREAD_H
+	struct IOSSLHandshakeJob *job;
+	if(!iossl_threads || iossl_detaching)
+		return 0;
+	if(!(job = calloc(1, sizeof(*job)))) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSSLHandshakeJob in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	job->iosock = iosock;
+	job->sslnode = iosock->sslnode;
+	job->now = iotimer_now;
+	if(!_enqueue_job(&iossl_pool, &job->worker)) {
+		free(job);
+		return 0;
+	}
+	iosock->ssl_job = job;
+	iosocket_update(iosock); // no events until the step is done
+	return 1;
+	#else
+	return 0;
+	#endif
+}
+
+/* called before the ssl descriptor of iosock is freed */
+static void iossl_handshake_detach(struct _IOSocket *iosock) {
+	#ifdef HAVE_PTHREAD_H
+	struct IOSSLHandshakeJob *job = iosock->ssl_job;
+	if(!job)
+		return;
+	iosock->ssl_job = NULL;
+	// the worker still uses the session & fd: _cancel_job waits for a running step
+	if(_cancel_job(&iossl_pool, &job->worker))
+		free(job);
+	else
+		job->iosock = NULL; // freed by iossl_handshake_complete
+	#endif
+}
+
+void iossl_start() {
+	#ifdef HAVE_PTHREAD_H
+	// workers are started on demand and shared by all threads
+	_start_workers(&iossl_pool, iossl_threads);
+	#endif
+}
+
+void iossl_detach(struct IOHandlerLoop *loop) {
+	#ifdef HAVE_PTHREAD_H
+	// the loop stops: take its jobs back, so no worker posts to it afterwards
+	struct IOWorkerJob *queued, *finished;
+	struct IOSSLHandshakeJob *job;
+	finished = _detach_workers(&iossl_pool, loop, &queued);
+	
+	// finish everything inline
+	iossl_detaching = 1;
+	while((job = (struct IOSSLHandshakeJob *) finished)) {
+		finished = finished->next;
+		iossl_handshake_complete(job);
+	}
+	while((job = (struct IOSSLHandshakeJob *) queued)) {
+		queued = queued->next;
+		job->now = iotimer_now;
+		iossl_handshake_step(job);
+		iossl_handshake_complete(job);
+	}
+	iossl_detaching = 0;
+	#endif
+}
+
+void iossl_stop() {
+	#ifdef HAVE_PTHREAD_H
+	_stop_workers(&iossl_pool);
+	#endif
+}
+
+void iossl_server_handshake(struct _IOSocket *iosock) {
+	struct IOSSLHandshakeJob job;
+	if(iosock->ssl_job) {
+		iosock->ssl_job->missed = 1; // step in progress
+		return;
+	}
+	if(iossl_handshake_offload(iosock))
+		return;
+	memset(&job, 0, sizeof(job));
+	job.iosock = iosock;
+	job.sslnode = iosock->sslnode;
+	iossl_handshake_step(&job);
+	iossl_handshake_result(iosock, &job);
+}
+#endif
+
+#if defined(HAVE_GNUTLS_GNUTLS_H)
 #include <errno.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
 /* GnuTLS Backend */
 static gnutls_dh_params_t dh_params;
 static unsigned int dh_params_bits;
@@ -46,23 +474,109 @@ void iossl_init() {
 	generate_dh_params();
 }
 
+static const char *iossl_priority = "SECURE128:+SECURE192:-VERS-TLS-ALL:+VERS-TLS1.2";
+
+static int iossl_profile_setup(struct IOSSLProfile *profile, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile) {
+	int ret;
+	if((ret = gnutls_priority_init(&profile->priority, (ciphers ? ciphers : iossl_priority), NULL)) < 0) {
+		profile->priority = NULL;
+		iolog_trigger(IOLOG_ERROR, "SSL: invalid priority string for profile %s (%s): %s", profile->name, ciphers, gnutls_strerror(ret));
+		return 0;
+	}
+	if((ret = gnutls_certificate_allocate_credentials(&profile->credentials)) < 0) {
+		profile->credentials = NULL;
+		iolog_trigger(IOLOG_ERROR, "SSL: could not allocate credentials for profile %s: %s", profile->name, gnutls_strerror(ret));
+		return 0;
+	}
+	if(cafile) {
+		if((ret = gnutls_certificate_set_x509_trust_file(profile->credentials, cafile, GNUTLS_X509_FMT_PEM)) < 0) {
+			iolog_trigger(IOLOG_ERROR, "SSL: could not load CA file for profile %s (%s): %s", profile->name, cafile, gnutls_strerror(ret));
+			return 0;
+		}
+		profile->verify = 1;
+	}
+	if(certfile && keyfile) {
+		if((ret = gnutls_certificate_set_x509_key_file(profile->credentials, certfile, keyfile, GNUTLS_X509_FMT_PEM)) < 0) {
+			iolog_trigger(IOLOG_ERROR, "SSL: could not load client certificate/key for profile %s (%s %s): %s", profile->name, certfile, keyfile, gnutls_strerror(ret));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void iossl_profile_cleanup(struct IOSSLProfile *profile) {
+	if(profile->credentials)
+		gnutls_certificate_free_credentials(profile->credentials);
+	if(profile->priority)
+		gnutls_priority_deinit(profile->priority);
+}
+
+static void iossl_session_store(struct _IOSocket *iosock) {
+	struct IOSSLSession *entry;
+	gnutls_datum_t data;
+	char key[512];
+	if(gnutls_session_get_data2(iosock->sslnode->ssl.client.session, &data) < 0)
+		return;
+	iossl_session_key(iosock, iosock->sslnode->ssl.client.profile, key, sizeof(key));
+	IOSSL_LOCK();
+	if((entry = iossl_session_add(key, 0)))
+		entry->data = data;
+	else
+		gnutls_free(data.data);
+	IOSSL_UNLOCK();
+}
+
+static void iossl_ktls_check(struct _IOSocket *iosock) {
+	#if GNUTLS_VERSION_NUMBER >= 0x030703
+	// GnuTLS enables kTLS by its system configuration (ktls = true), we just skip the library when it did
+	gnutls_session_t session = iosock->sslnode->ssl.client.session;
+	int ktls;
+	if(!iossl_ktls)
+		return;
+	ktls = gnutls_transport_is_ktls_enabled(session);
+	if((ktls & GNUTLS_KTLS_SEND))
+		iosock->ssl_ktls |= IOSSL_KTLS_SEND;
+	if((ktls & GNUTLS_KTLS_RECV) && !gnutls_record_check_pending(session))
+		iosock->ssl_ktls |= IOSSL_KTLS_RECV;
+	if(iosock->ssl_ktls)
+		iolog_trigger(IOLOG_DEBUG, "using kernel TLS for fd %d (send: %s, recv: %s)", iosock->fd, ((iosock->ssl_ktls & IOSSL_KTLS_SEND) ? "yes" : "no"), ((iosock->ssl_ktls & IOSSL_KTLS_RECV) ? "yes" : "no"));
+	#endif
+}
+
 // Client
 void iossl_connect(struct _IOSocket *iosock) {
 	struct IOSSLDescriptor *sslnode = malloc(sizeof(*sslnode));
-	int err;
+	struct IOSSLProfile *profile = iosock->ssl_profile;
+	gnutls_session_t session;
 	
-	err = gnutls_certificate_allocate_credentials(&sslnode->ssl.client.credentials);
-	if(err < 0) {
+	iosock->ssl_profile = NULL;
+	if(!profile && !(profile = iossl_get_profile(NULL)))
 		goto ssl_connect_err;
-	}
+	sslnode->ssl.client.profile = profile;
 	
-	gnutls_init(&sslnode->ssl.client.session, GNUTLS_CLIENT);
+	gnutls_init(&sslnode->ssl.client.session, GNUTLS_CLIENT | GNUTLS_NONBLOCK);
+	session = sslnode->ssl.client.session;
 	
-	gnutls_priority_set_direct(sslnode->ssl.client.session, "SECURE128:+SECURE192:-VERS-TLS-ALL:+VERS-TLS1.2", NULL);
-	gnutls_credentials_set(sslnode->ssl.client.session, GNUTLS_CRD_CERTIFICATE, sslnode->ssl.client.credentials);
+	gnutls_priority_set(session, profile->priority);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, profile->credentials);
+	
+	if(iosock->ssl_peer) {
+		struct IOSSLSession *cached;
+		char key[512];
+		if(!iossl_is_address(iosock->ssl_peer))
+			gnutls_server_name_set(session, GNUTLS_NAME_DNS, iosock->ssl_peer, strlen(iosock->ssl_peer));
+		if(profile->verify)
+			gnutls_session_set_verify_cert(session, iosock->ssl_peer, 0);
+		
+		iossl_session_key(iosock, profile, key, sizeof(key));
+		IOSSL_LOCK();
+		if((cached = iossl_session_find(key)))
+			gnutls_session_set_data(session, cached->data.data, cached->data.size);
+		IOSSL_UNLOCK();
+	}
 	
-	gnutls_transport_set_int(sslnode->ssl.client.session, iosock->fd);
-	gnutls_handshake_set_timeout(sslnode->ssl.client.session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+	gnutls_transport_set_int(session, iosock->fd);
+	gnutls_handshake_set_timeout(session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 	
 	iosock->sslnode = sslnode;
 	iosock->socket_flags |= IOSOCKETFLAG_SSL_HANDSHAKE;
@@ -73,9 +587,7 @@ ssl_connect_err:
 	iosocket_events_callback(iosock, 0, 0);
 }
 
-void iossl_client_handshake(struct _IOSocket *iosock) {
-	// Perform an SSL handshake.
-	int ret = gnutls_handshake(iosock->sslnode->ssl.client.session);
+static int iossl_handshake_finish(struct _IOSocket *iosock, int ret) {
 	iosock->socket_flags &= ~IOSOCKETFLAG_SSL_WANTWRITE;
 	
 	if(ret < 0) {
@@ -86,26 +598,184 @@ void iossl_client_handshake(struct _IOSocket *iosock) {
 			} else {
 				iolog_trigger(IOLOG_DEBUG, "gnutls_handshake for fd %d wants to read...", iosock->fd);
 			}
+			return 1;
 		} else {
 			iolog_trigger(IOLOG_ERROR, "gnutls_handshake for fd %d failed with %s", iosock->fd, gnutls_strerror(ret));
+			if(iosock->ssl_peer) {
+				char key[512];
+				iossl_session_key(iosock, iosock->sslnode->ssl.client.profile, key, sizeof(key));
+				iossl_session_forget(key);
+			}
 			iosocket_events_callback(iosock, 0, 0);
 		}
 	} else {
 		char *desc;
 		desc = gnutls_session_get_desc(iosock->sslnode->ssl.client.session);
-		iolog_trigger(IOLOG_DEBUG, "SSL handshake for fd %d successful: %s", iosock->fd, desc);
+		iolog_trigger(IOLOG_DEBUG, "SSL handshake for fd %d successful%s: %s", iosock->fd, (gnutls_session_is_resumed(iosock->sslnode->ssl.client.session) ? " (resumed)" : ""), desc);
 		gnutls_free(desc);
+		if(iosock->ssl_peer)
+			iossl_session_store(iosock);
+		iossl_ktls_check(iosock);
 		iosock->socket_flags |= IOSOCKETFLAG_SSL_ESTABLISHED;
 		iosocket_events_callback(iosock, 0, 0); //perform IOEVENT_CONNECTED event
 	}
+	return 0;
+}
+
+void iossl_client_handshake(struct _IOSocket *iosock) {
+	// Perform an SSL handshake.
+	iossl_handshake_finish(iosock, gnutls_handshake(iosock->sslnode->ssl.client.session));
+}
+
+static void iossl_server_handshake_step(struct IOSSLHandshakeJob *job) {
+	job->ret = gnutls_handshake(job->sslnode->ssl.client.session);
+}
+
+static int iossl_server_handshake_finish(struct _IOSocket *iosock, struct IOSSLHandshakeJob *job) {
+	return iossl_handshake_finish(iosock, job->ret);
+}
+
+
+/* server session cache (TLS 1.2 session ids)
+ * one LRU per listener, shared with its accepted sockets. the refcount is only changed by the listener's loop,
+ * the entries are locked (handshakes might run on worker threads)
+ */
+struct IOSSLServerSession {
+	gnutls_datum_t key, data; /* stored behind the entry */
+	struct timeval expire;
+	struct IOSSLServerSession *prev, *next;
+};
+
+struct IOSSLServerCache {
+	unsigned int refcount; /* listener & accepted sockets */
+	unsigned int size, timeout, count;
+	struct IOSSLServerSession *first, *last;
+};
+
+static gnutls_datum_t iossl_ticket_key; /* ticket master key of all listeners (the actual keys are rotated by GnuTLS) */
+
+static struct IOSSLServerCache *iossl_server_cache_create(unsigned int size, unsigned int timeout) {
+	struct IOSSLServerCache *cache = calloc(1, sizeof(*cache));
+	if(!cache) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSSLServerCache in %s:%d", __FILE__, __LINE__);
+		return NULL;
+	}
+	cache->refcount = 1;
+	cache->size = size;
+	cache->timeout = timeout;
+	return cache;
 }
 
+static void iossl_server_cache_unlink(struct IOSSLServerCache *cache, struct IOSSLServerSession *entry) {
+	if(entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->first = entry->next;
+	if(entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->last = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void iossl_server_cache_free(struct IOSSLServerCache *cache, struct IOSSLServerSession *entry) {
+	iossl_server_cache_unlink(cache, entry);
+	cache->count--;
+	free(entry);
+}
+
+static void iossl_server_cache_release(struct IOSSLServerCache *cache) {
+	if(--cache->refcount)
+		return;
+	while(cache->first)
+		iossl_server_cache_free(cache, cache->first);
+	free(cache);
+}
+
+static struct IOSSLServerSession *iossl_server_cache_find(struct IOSSLServerCache *cache, gnutls_datum_t key) {
+	struct IOSSLServerSession *entry;
+	for(entry = cache->first; entry; entry = entry->next) {
+		if(entry->key.size != key.size || memcmp(entry->key.data, key.data, key.size))
+			continue;
+		if(!timeval_is_bigger(entry->expire, iotimer_now)) {
+			iossl_server_cache_free(cache, entry);
+			return NULL;
+		}
+		if(entry != cache->first) {
+			iossl_server_cache_unlink(cache, entry);
+			entry->next = cache->first;
+			cache->first->prev = entry;
+			cache->first = entry;
+		}
+		return entry;
+	}
+	return NULL;
+}
+
+static int iossl_server_cache_store(void *ptr, gnutls_datum_t key, gnutls_datum_t data) {
+	struct IOSSLServerCache *cache = ptr;
+	struct IOSSLServerSession *entry = calloc(1, sizeof(*entry) + key.size + data.size);
+	if(!entry) {
+		if(!iossl_step_error("could not allocate memory for IOSSLServerSession"))
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSSLServerSession in %s:%d", __FILE__, __LINE__);
+		return -1;
+	}
+	entry->key.data = (unsigned char *) (entry + 1);
+	entry->key.size = key.size;
+	memcpy(entry->key.data, key.data, key.size);
+	entry->data.data = entry->key.data + key.size;
+	entry->data.size = data.size;
+	memcpy(entry->data.data, data.data, data.size);
+	entry->expire = iotimer_now;
+	entry->expire.tv_sec += cache->timeout;
+	
+	struct IOSSLServerSession *old;
+	IOSSL_LOCK();
+	if((old = iossl_server_cache_find(cache, key)))
+		iossl_server_cache_free(cache, old);
+	if(cache->count >= cache->size)
+		iossl_server_cache_free(cache, cache->last);
+	entry->next = cache->first;
+	if(cache->first)
+		cache->first->prev = entry;
+	else
+		cache->last = entry;
+	cache->first = entry;
+	cache->count++;
+	IOSSL_UNLOCK();
+	return 0;
+}
+
+static gnutls_datum_t iossl_server_cache_retrieve(void *ptr, gnutls_datum_t key) {
+	struct IOSSLServerSession *entry;
+	gnutls_datum_t data = { NULL, 0 };
+	IOSSL_LOCK();
+	if((entry = iossl_server_cache_find(ptr, key)) && (data.data = gnutls_malloc(entry->data.size))) {
+		memcpy(data.data, entry->data.data, entry->data.size);
+		data.size = entry->data.size;
+	}
+	IOSSL_UNLOCK();
+	return data;
+}
+
+static int iossl_server_cache_remove(void *ptr, gnutls_datum_t key) {
+	struct IOSSLServerSession *entry;
+	int ret = -1;
+	IOSSL_LOCK();
+	if((entry = iossl_server_cache_find(ptr, key))) {
+		iossl_server_cache_free(ptr, entry);
+		ret = 0;
+	}
+	IOSSL_UNLOCK();
+	return ret;
+}
 
 // Server
-void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile) {
+void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile, int cache_size, int cache_timeout, int tickets) {
 	struct IOSSLDescriptor *sslnode = malloc(sizeof(*sslnode));
 	
-	gnutls_priority_init(&sslnode->ssl.server.priority, "SECURE128:+SECURE192:-VERS-TLS-ALL:+VERS-TLS1.2", NULL);
+	gnutls_priority_init(&sslnode->ssl.server.priority, iossl_priority, NULL);
 	
 	gnutls_certificate_allocate_credentials(&sslnode->ssl.server.credentials);
 	int ret = gnutls_certificate_set_x509_key_file(sslnode->ssl.server.credentials, certfile, keyfile, GNUTLS_X509_FMT_PEM);
@@ -116,6 +786,18 @@ void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *ke
 	
 	gnutls_certificate_set_dh_params(sslnode->ssl.server.credentials, dh_params);
 	
+	sslnode->ssl.server.cache = (cache_size ? iossl_server_cache_create(cache_size, cache_timeout) : NULL);
+	sslnode->ssl.server.timeout = cache_timeout;
+	sslnode->ssl.server.tickets = 0;
+	if(tickets) {
+		IOSSL_LOCK();
+		if(!iossl_ticket_key.data && (ret = gnutls_session_ticket_key_generate(&iossl_ticket_key)) < 0)
+			iolog_trigger(IOLOG_ERROR, "SSL: could not generate session ticket key: %s", gnutls_strerror(ret));
+		IOSSL_UNLOCK();
+		if(iossl_ticket_key.data)
+			sslnode->ssl.server.tickets = 1;
+	}
+	
 	iosock->sslnode = sslnode;
 	iosock->socket_flags |= IOSOCKETFLAG_SSL_ESTABLISHED;
 	return;
@@ -128,7 +810,7 @@ ssl_listen_err:
 void iossl_client_accepted(struct _IOSocket *iosock, struct _IOSocket *new_iosock) {
 	struct IOSSLDescriptor *sslnode = malloc(sizeof(*sslnode));
 	
-	gnutls_init(&sslnode->ssl.client.session, GNUTLS_SERVER);
+	gnutls_init(&sslnode->ssl.client.session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
 	gnutls_priority_set(sslnode->ssl.client.session, iosock->sslnode->ssl.server.priority);
 	gnutls_credentials_set(sslnode->ssl.client.session, GNUTLS_CRD_CERTIFICATE, iosock->sslnode->ssl.server.credentials);
 	gnutls_dh_set_prime_bits(sslnode->ssl.client.session, dh_params_bits);
@@ -138,6 +820,18 @@ void iossl_client_accepted(struct _IOSocket *iosock, struct _IOSocket *new_iosoc
 	 */
 	gnutls_certificate_server_set_request(sslnode->ssl.client.session, GNUTLS_CERT_IGNORE);
 	
+	/* session resumption */
+	gnutls_db_set_cache_expiration(sslnode->ssl.client.session, iosock->sslnode->ssl.server.timeout);
+	if((sslnode->ssl.client.cache = iosock->sslnode->ssl.server.cache)) {
+		sslnode->ssl.client.cache->refcount++;
+		gnutls_db_set_ptr(sslnode->ssl.client.session, sslnode->ssl.client.cache);
+		gnutls_db_set_store_function(sslnode->ssl.client.session, iossl_server_cache_store);
+		gnutls_db_set_retrieve_function(sslnode->ssl.client.session, iossl_server_cache_retrieve);
+		gnutls_db_set_remove_function(sslnode->ssl.client.session, iossl_server_cache_remove);
+	}
+	if(iosock->sslnode->ssl.server.tickets)
+		gnutls_session_ticket_enable_server(sslnode->ssl.client.session, &iossl_ticket_key);
+	
 	gnutls_transport_set_int(sslnode->ssl.client.session, new_iosock->fd);
 	
 	new_iosock->sslnode = sslnode;
@@ -151,20 +845,21 @@ ssl_accept_err:
 	*/
 }
 
-void iossl_server_handshake(struct _IOSocket *iosock) {
-	return iossl_client_handshake(iosock);
-}
-
 void iossl_disconnect(struct _IOSocket *iosock) {
 	if(!iosock->sslnode) return;
+	iossl_handshake_detach(iosock);
 	
 	if((iosock->socket_flags & IOSOCKETFLAG_LISTENING)) {
 		gnutls_certificate_free_credentials(iosock->sslnode->ssl.server.credentials);
 		gnutls_priority_deinit(iosock->sslnode->ssl.server.priority);
+		if(iosock->sslnode->ssl.server.cache)
+			iossl_server_cache_release(iosock->sslnode->ssl.server.cache);
 	} else {
 		gnutls_bye(iosock->sslnode->ssl.client.session, GNUTLS_SHUT_RDWR);
 		if(!(iosock->socket_flags & IOSOCKETFLAG_INCOMING))
-			gnutls_certificate_free_credentials(iosock->sslnode->ssl.client.credentials);
+			iossl_release_profile(iosock->sslnode->ssl.client.profile);
+		else if(iosock->sslnode->ssl.client.cache)
+			iossl_server_cache_release(iosock->sslnode->ssl.client.cache);
 		gnutls_deinit(iosock->sslnode->ssl.client.session);
 	}
 	
@@ -267,15 +962,91 @@ static void iossl_error() {
 	}
 }
 
+// called for every new session (including TLS 1.3 tickets received after the handshake)
+static int iossl_session_new(SSL *ssl, SSL_SESSION *session) {
+	struct _IOSocket *iosock = SSL_get_app_data(ssl);
+	struct IOSSLSession *entry;
+	char key[512];
+	if(!iosock || !iosock->ssl_peer || !iosock->sslnode)
+		return 0;
+	iossl_session_key(iosock, iosock->sslnode->profile, key, sizeof(key));
+	IOSSL_LOCK();
+	if((entry = iossl_session_add(key, SSL_SESSION_get_timeout(session))))
+		entry->session = session;
+	IOSSL_UNLOCK();
+	return (entry ? 1 : 0); // 1: we keep the reference
+}
+
+static int iossl_profile_setup(struct IOSSLProfile *profile, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile) {
+	profile->context = SSL_CTX_new(SSLv23_client_method());
+	if(!profile->context) {
+		iossl_error();
+		iolog_trigger(IOLOG_ERROR, "SSL: could not create client SSL CTX for profile %s", profile->name);
+		return 0;
+	}
+	SSL_CTX_set_session_cache_mode(profile->context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(profile->context, iossl_session_new);
+	if(ciphers && !SSL_CTX_set_cipher_list(profile->context, ciphers)) {
+		iossl_error();
+		iolog_trigger(IOLOG_ERROR, "SSL: invalid cipher list for profile %s (%s)", profile->name, ciphers);
+		return 0;
+	}
+	if(cafile) {
+		if(!SSL_CTX_load_verify_locations(profile->context, cafile, NULL)) {
+			iossl_error();
+			iolog_trigger(IOLOG_ERROR, "SSL: could not load CA file for profile %s (%s)", profile->name, cafile);
+			return 0;
+		}
+		SSL_CTX_set_verify(profile->context, SSL_VERIFY_PEER, NULL);
+		profile->verify = 1;
+	}
+	if(certfile && keyfile) {
+		if(SSL_CTX_use_certificate_chain_file(profile->context, certfile) <= 0 || SSL_CTX_use_PrivateKey_file(profile->context, keyfile, SSL_FILETYPE_PEM) <= 0 || !SSL_CTX_check_private_key(profile->context)) {
+			iossl_error();
+			iolog_trigger(IOLOG_ERROR, "SSL: could not load client certificate/key for profile %s (%s %s)", profile->name, certfile, keyfile);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void iossl_profile_cleanup(struct IOSSLProfile *profile) {
+	if(profile->context)
+		SSL_CTX_free(profile->context);
+}
+
+static void iossl_ktls_enable(SSL *ssl) {
+	#ifdef SSL_OP_ENABLE_KTLS
+	if(iossl_ktls)
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+	#endif
+}
+
+static void iossl_ktls_check(struct _IOSocket *iosock) {
+	#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	SSL *ssl = iosock->sslnode->sslHandle;
+	if(!iossl_ktls)
+		return;
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		iosock->ssl_ktls |= IOSSL_KTLS_SEND;
+	if(BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl))
+		iosock->ssl_ktls |= IOSSL_KTLS_RECV;
+	if(iosock->ssl_ktls)
+		iolog_trigger(IOLOG_DEBUG, "using kernel TLS for fd %d (send: %s, recv: %s)", iosock->fd, ((iosock->ssl_ktls & IOSSL_KTLS_SEND) ? "yes" : "no"), ((iosock->ssl_ktls & IOSSL_KTLS_RECV) ? "yes" : "no"));
+	#endif
+}
+
 // Client
 void iossl_connect(struct _IOSocket *iosock) {
 	struct IOSSLDescriptor *sslnode = malloc(sizeof(*sslnode));
-	sslnode->sslContext = SSL_CTX_new(SSLv23_client_method());
-	if(!sslnode->sslContext) {
-		iossl_error();
-		iolog_trigger(IOLOG_ERROR, "SSL: could not create client SSL CTX");
+	struct IOSSLProfile *profile = iosock->ssl_profile;
+	
+	iosock->ssl_profile = NULL;
+	sslnode->sslHandle = NULL;
+	sslnode->profile = profile;
+	if(!profile && !(sslnode->profile = profile = iossl_get_profile(NULL)))
 		goto ssl_connect_err;
-	}
+	sslnode->sslContext = profile->context;
 	sslnode->sslHandle = SSL_new(sslnode->sslContext);
 	if(!sslnode->sslHandle) {
 		iossl_error();
@@ -287,12 +1058,37 @@ void iossl_connect(struct _IOSocket *iosock) {
 		iolog_trigger(IOLOG_ERROR, "SSL: could not set client fd in SSL Handle");
 		goto ssl_connect_err;
 	}
+	SSL_set_app_data(sslnode->sslHandle, iosock);
+	iossl_ktls_enable(sslnode->sslHandle);
+	if(iosock->ssl_peer) {
+		struct IOSSLSession *cached;
+		char key[512];
+		int address = iossl_is_address(iosock->ssl_peer);
+		if(!address)
+			SSL_set_tlsext_host_name(sslnode->sslHandle, iosock->ssl_peer);
+		if(profile->verify) {
+			if(address)
+				X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(sslnode->sslHandle), iosock->ssl_peer);
+			else
+				SSL_set1_host(sslnode->sslHandle, iosock->ssl_peer);
+		}
+		
+		iossl_session_key(iosock, profile, key, sizeof(key));
+		IOSSL_LOCK();
+		if((cached = iossl_session_find(key)))
+			SSL_set_session(sslnode->sslHandle, cached->session);
+		IOSSL_UNLOCK();
+	}
 	SSL_set_connect_state(sslnode->sslHandle);
 	iosock->sslnode = sslnode;
 	iosock->socket_flags |= IOSOCKETFLAG_SSL_HANDSHAKE;
 	iossl_client_handshake(iosock);
 	return;
 ssl_connect_err:
+	if(sslnode->sslHandle)
+		SSL_free(sslnode->sslHandle);
+	if(profile)
+		iossl_release_profile(profile);
 	free(sslnode);
 	iosocket_events_callback(iosock, 0, 0);
 }
@@ -303,7 +1099,8 @@ void iossl_client_handshake(struct _IOSocket *iosock) {
 	iosock->socket_flags &= ~IOSOCKETFLAG_SSL_WANTWRITE;
 	switch(SSL_get_error(iosock->sslnode->sslHandle, ret)) {
 		case SSL_ERROR_NONE:
-			iolog_trigger(IOLOG_DEBUG, "SSL handshake for fd %d successful", iosock->fd);
+			iolog_trigger(IOLOG_DEBUG, "SSL handshake for fd %d successful%s", iosock->fd, (SSL_session_reused(iosock->sslnode->sslHandle) ? " (resumed)" : ""));
+			iossl_ktls_check(iosock);
 			iosock->socket_flags |= IOSOCKETFLAG_SSL_ESTABLISHED;
 			iosocket_events_callback(iosock, 0, 0); //perform IOEVENT_CONNECTED event
 			break;
@@ -316,14 +1113,113 @@ void iossl_client_handshake(struct _IOSocket *iosock) {
 			break;
 		default:
 			iolog_trigger(IOLOG_ERROR, "SSL_do_handshake for fd %d failed with ", iosock->fd);
+			iossl_error();
+			if(iosock->ssl_peer) {
+				char key[512];
+				iossl_session_key(iosock, iosock->sslnode->profile, key, sizeof(key));
+				iossl_session_forget(key);
+			}
 			iosocket_events_callback(iosock, 0, 0);
 			break;
 	}
 }
 
 
+/* session ticket keys of all listeners: new tickets use the current key, the previous one is still accepted (and renewed) */
+struct IOSSLTicketKey {
+	unsigned char name[16];
+	unsigned char aes_key[32];
+	unsigned char hmac_key[32];
+	struct timeval expire;
+	int valid;
+};
+
+static struct IOSSLTicketKey iossl_ticket_keys[2]; /* current, previous (protected by iossl_sync) */
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#define IOSSL_TICKET_HMAC_CTX EVP_MAC_CTX
+#define IOSSL_SET_TICKET_CALLBACK SSL_CTX_set_tlsext_ticket_key_evp_cb
+#else
+#include <openssl/hmac.h>
+#define IOSSL_TICKET_HMAC_CTX HMAC_CTX
+#define IOSSL_SET_TICKET_CALLBACK SSL_CTX_set_tlsext_ticket_key_cb
+#endif
+
+/* call with iossl_sync locked */
+static int iossl_ticket_key_rotate() {
+	struct IOSSLTicketKey *key = &iossl_ticket_keys[0];
+	if(key->valid && timeval_is_bigger(key->expire, iotimer_now))
+		return 1;
+	// the previous key is only kept if it expired less than one lifetime ago
+	iossl_ticket_keys[1] = *key;
+	iossl_ticket_keys[1].expire.tv_sec += IOSSL_TICKET_KEY_LIFETIME;
+	if(!timeval_is_bigger(iossl_ticket_keys[1].expire, iotimer_now))
+		iossl_ticket_keys[1].valid = 0;
+	if(RAND_bytes(key->name, sizeof(key->name)) <= 0 || RAND_bytes(key->aes_key, sizeof(key->aes_key)) <= 0 || RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) <= 0) {
+		// (the library errors are picked up by the handshake step)
+		if(!iossl_step_error("SSL: could not generate session ticket key")) {
+			iossl_error();
+			iolog_trigger(IOLOG_ERROR, "SSL: could not generate session ticket key");
+		}
+		key->valid = 0;
+		return 0;
+	}
+	key->expire = iotimer_now;
+	key->expire.tv_sec += IOSSL_TICKET_KEY_LIFETIME;
+	key->valid = 1;
+	return 1;
+}
+
+static int iossl_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher, IOSSL_TICKET_HMAC_CTX *hmac, int enc) {
+	struct IOSSLTicketKey key;
+	int i, ret = 1;
+	IOSSL_LOCK();
+	if(!iossl_ticket_key_rotate() && enc) {
+		IOSSL_UNLOCK();
+		return 0; // no ticket
+	}
+	if(enc)
+		key = iossl_ticket_keys[0];
+	else {
+		for(i = 0; i < 2; i++) {
+			if(iossl_ticket_keys[i].valid && !memcmp(iossl_ticket_keys[i].name, key_name, sizeof(key.name)))
+				break;
+		}
+		if(i == 2) {
+			IOSSL_UNLOCK();
+			return 0; // unknown key: full handshake
+		}
+		key = iossl_ticket_keys[i];
+		if(i || SSL_version(ssl) >= TLS1_3_VERSION)
+			ret = 2; // issue a new ticket (old key / TLS 1.3 clients use every ticket once)
+	}
+	IOSSL_UNLOCK();
+	
+	if(enc) {
+		memcpy(key_name, key.name, sizeof(key.name));
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return -1;
+		if(!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv))
+			return -1;
+	} else if(!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv))
+		return -1;
+	#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if(!EVP_MAC_CTX_set_params(hmac, params))
+		return -1;
+	#else
+	if(!HMAC_Init_ex(hmac, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL))
+		return -1;
+	#endif
+	return ret;
+}
+
 // Server
-void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile) {
+void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile, int cache_size, int cache_timeout, int tickets) {
 	struct IOSSLDescriptor *sslnode = malloc(sizeof(*sslnode));
 	sslnode->sslContext = SSL_CTX_new(SSLv23_server_method());
 	if(!sslnode->sslContext) {
@@ -349,6 +1245,19 @@ void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *ke
 		iolog_trigger(IOLOG_ERROR, "SSL: server certificate (%s) and keyfile (%s) doesn't match!", certfile, keyfile);
 		goto ssl_listen_err;
 	}
+	/* session resumption */
+	SSL_CTX_set_session_id_context(sslnode->sslContext, (const unsigned char *) "IOHandler", 9);
+	SSL_CTX_set_timeout(sslnode->sslContext, cache_timeout);
+	if(cache_size) {
+		SSL_CTX_set_session_cache_mode(sslnode->sslContext, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(sslnode->sslContext, cache_size);
+	} else
+		SSL_CTX_set_session_cache_mode(sslnode->sslContext, SSL_SESS_CACHE_OFF);
+	if(tickets)
+		IOSSL_SET_TICKET_CALLBACK(sslnode->sslContext, iossl_ticket_key_callback);
+	else
+		SSL_CTX_set_options(sslnode->sslContext, SSL_OP_NO_TICKET);
+	sslnode->profile = NULL;
 	iosock->sslnode = sslnode;
 	iosock->socket_flags |= IOSOCKETFLAG_SSL_ESTABLISHED;
 	return;
@@ -371,6 +1280,8 @@ void iossl_client_accepted(struct _IOSocket *iosock, struct _IOSocket *new_iosoc
 		iolog_trigger(IOLOG_ERROR, "SSL: could not set client fd in SSL Handle");
 		goto ssl_accept_err;
 	}
+	iossl_ktls_enable(sslnode->sslHandle);
+	sslnode->profile = NULL;
 	new_iosock->sslnode = sslnode;
 	new_iosock->socket_flags |= IOSOCKETFLAG_SSL_HANDSHAKE;
 	return;
@@ -380,35 +1291,57 @@ ssl_accept_err:
 	iosocket_events_callback(new_iosock, 0, 0);
 }
 
-void iossl_server_handshake(struct _IOSocket *iosock) {
-	// Perform an SSL handshake.
-	int ret = SSL_accept(iosock->sslnode->sslHandle);
+static void iossl_server_handshake_step(struct IOSSLHandshakeJob *job) {
+	unsigned long e;
+	int i = 0;
+	// Perform an SSL handshake. (the error queue is thread local: collect it right here)
+	ERR_clear_error();
+	job->ret = SSL_accept(job->sslnode->sslHandle);
+	job->err = SSL_get_error(job->sslnode->sslHandle, job->ret);
+	while((e = ERR_get_error())) {
+		if(i < IOSSL_JOB_ERRORS)
+			job->errors[i++] = e;
+	}
+}
+
+static int iossl_server_handshake_finish(struct _IOSocket *iosock, struct IOSSLHandshakeJob *job) {
+	char error[256];
+	int i;
+	for(i = 0; i < IOSSL_JOB_ERRORS && job->errors[i]; i++) {
+		ERR_error_string_n(job->errors[i], error, sizeof(error));
+		iolog_trigger(IOLOG_ERROR, "SSLv23 ERROR %lu: %s", job->errors[i], error);
+	}
 	iosock->socket_flags &= ~IOSOCKETFLAG_SSL_WANTWRITE;
-	switch(SSL_get_error(iosock->sslnode->sslHandle, ret)) {
+	switch(job->err) {
 		case SSL_ERROR_NONE:
-			iolog_trigger(IOLOG_DEBUG, "SSL handshake for fd %d successful", iosock->fd);
+			iolog_trigger(IOLOG_DEBUG, "SSL handshake for fd %d successful%s", iosock->fd, (SSL_session_reused(iosock->sslnode->sslHandle) ? " (resumed)" : ""));
+			iossl_ktls_check(iosock);
 			iosock->socket_flags |= IOSOCKETFLAG_SSL_ESTABLISHED;
 			iosocket_events_callback(iosock, 0, 0); //perform IOEVENT_CONNECTED event
 			break;
 		case SSL_ERROR_WANT_READ:
 			iolog_trigger(IOLOG_DEBUG, "SSL_do_handshake for fd %d returned SSL_ERROR_WANT_READ", iosock->fd);
-			break;
+			return 1;
 		case SSL_ERROR_WANT_WRITE:
 			iosock->socket_flags |= IOSOCKETFLAG_SSL_WANTWRITE;
 			iolog_trigger(IOLOG_DEBUG, "SSL_do_handshake for fd %d returned SSL_ERROR_WANT_WRITE", iosock->fd);
-			break;
+			return 1;
 		default:
-			iolog_trigger(IOLOG_ERROR, "SSL_do_handshake for fd %d failed with ", iosock->fd);
+			iolog_trigger(IOLOG_ERROR, "SSL_do_handshake for fd %d failed with %d (%s)", iosock->fd, job->err, (job->errors[0] ? ERR_reason_error_string(job->errors[0]) : "no library error"));
 			iosocket_events_callback(iosock, 0, 0);
 			break;
 	}
+	return 0;
 }
 
 void iossl_disconnect(struct _IOSocket *iosock) {
 	if(!iosock->sslnode) return;
+	iossl_handshake_detach(iosock);
 	SSL_shutdown(iosock->sslnode->sslHandle);
 	SSL_free(iosock->sslnode->sslHandle);
-	if(!(iosock->socket_flags & IOSOCKETFLAG_INCOMING))
+	if(iosock->sslnode->profile)
+		iossl_release_profile(iosock->sslnode->profile);
+	else if(!(iosock->socket_flags & IOSOCKETFLAG_INCOMING))
 		SSL_CTX_free(iosock->sslnode->sslContext);
 	free(iosock->sslnode);
 	iosock->sslnode = NULL;
@@ -426,7 +1359,7 @@ int iossl_read(struct _IOSocket *iosock, char *buffer, int len) {
 		case SSL_ERROR_ZERO_RETURN:
 			break;
 		case SSL_ERROR_WANT_READ:
-			iosock->socket_flags |= IOSOCKETFLAG_SSL_READHS;
+			// no application data yet (e.g. only TLS 1.3 session tickets): not a rehandshake
 			iolog_trigger(IOLOG_DEBUG, "SSL_read for fd %d returned SSL_ERROR_WANT_READ", iosock->fd);
 			errno = EAGAIN;
 			ret = -1;
@@ -482,8 +1415,14 @@ int iossl_write(struct _IOSocket *iosock, char *buffer, int len) {
 // NULL-backend
 
 void iossl_init() {};
+void iossl_start() {};
+void iossl_detach(struct IOHandlerLoop *loop) {};
+void iossl_stop() {};
+int iossl_add_profile(const char *name, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile) { return 0; };
+struct IOSSLProfile *iossl_get_profile(const char *name) { return NULL; };
+void iossl_release_profile(struct IOSSLProfile *profile) {};
 void iossl_connect(struct _IOSocket *iosock) {};
-void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile) {};
+void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile, int cache_size, int cache_timeout, int tickets) {};
 void iossl_client_handshake(struct _IOSocket *iosock) {};
 void iossl_client_accepted(struct _IOSocket *iosock, struct _IOSocket *client_iofd) {};
 void iossl_server_handshake(struct _IOSocket *iosock) {};
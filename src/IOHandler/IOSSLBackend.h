@@ -18,6 +18,10 @@
 #define _IOSSLBackend_h
 
 struct _IOSocket;
+struct IOSSLProfile;
+struct IOSSLServerCache;
+struct IOSSLHandshakeJob;
+struct IOHandlerLoop;
 
 #if defined(HAVE_GNUTLS_GNUTLS_H)
 #include <gnutls/gnutls.h>
@@ -25,11 +29,15 @@ struct IOSSLDescriptor {
 	union {
 		struct {
 			gnutls_session_t session;
-			gnutls_certificate_client_credentials credentials;
+			struct IOSSLProfile *profile; /* outgoing connections only */
+			struct IOSSLServerCache *cache; /* incoming connections only */
 		} client;
 		struct {
 			gnutls_priority_t priority;
 			gnutls_certificate_credentials_t credentials;
+			struct IOSSLServerCache *cache;
+			unsigned int timeout;
+			unsigned int tickets : 1;
 		} server;
 	} ssl;
 };
@@ -42,6 +50,7 @@ struct IOSSLDescriptor {
 struct IOSSLDescriptor {
 	SSL *sslHandle;
 	SSL_CTX *sslContext;
+	struct IOSSLProfile *profile; /* outgoing connections only (owns sslContext) */
 };
 #else
 struct IOSSLDescriptor {
@@ -49,9 +58,19 @@ struct IOSSLDescriptor {
 };
 #endif
 
+/* kernel TLS (_IOSocket.ssl_ktls): records are en-/decrypted by the kernel, so the socket can be used with plain send / recv */
+#define IOSSL_KTLS_SEND 0x01
+#define IOSSL_KTLS_RECV 0x02 /* control records (alerts, tickets, key updates) fail with EIO and have to be read with iossl_read */
+
 void iossl_init();
+void iossl_start(); /* per thread state: the handshake workers are joined when the last one stops */
+void iossl_detach(struct IOHandlerLoop *loop); /* loop teardown: finishes the offloaded handshakes of loop inline */
+void iossl_stop();
+int iossl_add_profile(const char *name, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile);
+struct IOSSLProfile *iossl_get_profile(const char *name); /* takes a reference (NULL: default profile) */
+void iossl_release_profile(struct IOSSLProfile *profile);
 void iossl_connect(struct _IOSocket *iosock);
-void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile);
+void iossl_listen(struct _IOSocket *iosock, const char *certfile, const char *keyfile, int cache_size, int cache_timeout, int tickets);
 void iossl_client_handshake(struct _IOSocket *iosock);
 void iossl_client_accepted(struct _IOSocket *iosock, struct _IOSocket *new_iosock);
 void iossl_server_handshake(struct _IOSocket *iosock);
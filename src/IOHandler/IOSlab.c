@@ -0,0 +1,128 @@
+/* IOSlab.c - IOMultiplexer v2
+ * Copyright (C) 2014  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+#define _IOHandler_internals
+#include "IOInternal.h"
+#include "IOHandler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* every object is preceded by a header pointing to its block (padded to keep the object aligned) */
+union IOSlabHeader {
+	struct IOSlabBlock *block;
+	long double align_ld;
+	long long align_ll;
+	void *align_ptr;
+};
+
+struct IOSlabBlock {
+	struct IOSlab *slab;
+	struct IOSlabBlock *prev, *next; /* partial block list */
+	void *free_objects;
+	unsigned int used;
+};
+
+#define IOSLAB_ALIGN(size) (((size) + sizeof(union IOSlabHeader) - 1) / sizeof(union IOSlabHeader) * sizeof(union IOSlabHeader))
+#define IOSLAB_STRIDE(slab) (sizeof(union IOSlabHeader) + IOSLAB_ALIGN((slab)->objsize))
+
+static void ioslab_link_block(struct IOSlab *slab, struct IOSlabBlock *block) {
+	block->prev = NULL;
+	block->next = slab->partial;
+	if(slab->partial)
+		slab->partial->prev = block;
+	slab->partial = block;
+}
+
+static void ioslab_unlink_block(struct IOSlab *slab, struct IOSlabBlock *block) {
+	if(block->prev)
+		block->prev->next = block->next;
+	else
+		slab->partial = block->next;
+	if(block->next)
+		block->next->prev = block->prev;
+}
+
+static struct IOSlabBlock *ioslab_create_block(struct IOSlab *slab) {
+	size_t stride = IOSLAB_STRIDE(slab);
+	struct IOSlabBlock *block = malloc(IOSLAB_ALIGN(sizeof(*block)) + stride * IOSLAB_BLOCK_OBJECTS);
+	if(!block)
+		return NULL;
+	block->slab = slab;
+	block->used = 0;
+	block->free_objects = NULL;
+	
+	char *objects = (char *) block + IOSLAB_ALIGN(sizeof(*block));
+	int i;
+	for(i = IOSLAB_BLOCK_OBJECTS - 1; i >= 0; i--) {
+		union IOSlabHeader *header = (union IOSlabHeader *) (objects + stride * i);
+		header->block = block;
+		*((void **) (header + 1)) = block->free_objects;
+		block->free_objects = header + 1;
+	}
+	ioslab_link_block(slab, block);
+	slab->empty_blocks++;
+	return block;
+}
+
+void *ioslab_alloc(struct IOSlab *slab) {
+	struct IOSlabBlock *block = slab->partial;
+	if(!block && !(block = ioslab_create_block(slab)))
+		return NULL;
+	
+	void *object = block->free_objects;
+	block->free_objects = *((void **) object);
+	if(block->used++ == 0)
+		slab->empty_blocks--;
+	if(!block->free_objects)
+		ioslab_unlink_block(slab, block); // block is full now
+	
+	memset(object, 0, slab->objsize);
+	return object;
+}
+
+void ioslab_free(void *object) {
+	if(!object)
+		return;
+	struct IOSlabBlock *block = ((union IOSlabHeader *) object - 1)->block;
+	struct IOSlab *slab = block->slab;
+	
+	if(!block->free_objects)
+		ioslab_link_block(slab, block);
+	*((void **) object) = block->free_objects;
+	block->free_objects = object;
+	
+	if(--block->used == 0) {
+		// keep one empty block for the next accept wave, release the others
+		if(slab->empty_blocks) {
+			ioslab_unlink_block(slab, block);
+			free(block);
+		} else
+			slab->empty_blocks++;
+	}
+}
+
+void ioslab_release(struct IOSlab *slab) {
+	struct IOSlabBlock *block, *next_block;
+	for(block = slab->partial; block; block = next_block) {
+		next_block = block->next;
+		if(block->used)
+			continue;
+		ioslab_unlink_block(slab, block);
+		free(block);
+	}
+	slab->empty_blocks = 0;
+}
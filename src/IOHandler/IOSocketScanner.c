@@ -0,0 +1,148 @@
+/* IOSocketScanner.c - IOMultiplexer v2
+ * Copyright (C) 2014  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+#define _IOHandler_internals
+#include "IOInternal.h"
+#include "IOHandler.h"
+#include "IOSockets.h"
+
+#include <string.h>
+
+/* vectorized delimiter scanner (SSE2 & AVX2 on x86_64, selected at runtime) */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define IOSOCKET_SCAN_SSE2
+#define IOSOCKET_SCAN_AVX2
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define IOSOCKET_SCAN_SSE2
+#include <emmintrin.h>
+#include <intrin.h>
+#endif
+
+typedef size_t iosocket_scan_function(const unsigned char *delimiters, const char *buffer, size_t len);
+static iosocket_scan_function iosocket_scan_resolve;
+/* selected in iosocket_scan_init (shared by all loop threads: atomic access) */
+static iosocket_scan_function *iosocket_scan_func = iosocket_scan_resolve;
+
+size_t iosocket_scan_delimiters(const unsigned char *delimiters, const char *buffer, size_t len) {
+	return __atomic_load_n(&iosocket_scan_func, __ATOMIC_RELAXED)(delimiters, buffer, len);
+}
+
+static size_t iosocket_scan_generic(const unsigned char *delimiters, const char *buffer, size_t len) {
+	unsigned char table[256];
+	size_t i;
+	int j;
+	memset(table, 0, sizeof(table));
+	for(j = 0; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++)
+		table[delimiters[j]] = 1;
+	for(i = 0; i < len; i++) {
+		if(table[(unsigned char) buffer[i]])
+			break;
+	}
+	return i;
+}
+
+#ifdef IOSOCKET_SCAN_SSE2
+static int iosocket_scan_lowest_bit(unsigned int mask) {
+	#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+	#else
+	return __builtin_ctz(mask);
+	#endif
+}
+
+static size_t iosocket_scan_sse2(const unsigned char *delimiters, const char *buffer, size_t len) {
+	__m128i delim[IOSOCKET_PARSE_DELIMITERS_COUNT];
+	size_t i = 0;
+	int j;
+	for(j = 0; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++)
+		delim[j] = _mm_set1_epi8((char) delimiters[j]);
+	for(; i + 16 <= len; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i *) (buffer + i));
+		__m128i match = _mm_cmpeq_epi8(data, delim[0]);
+		for(j = 1; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++)
+			match = _mm_or_si128(match, _mm_cmpeq_epi8(data, delim[j]));
+		unsigned int mask = _mm_movemask_epi8(match);
+		if(mask)
+			return i + iosocket_scan_lowest_bit(mask);
+	}
+	return i + iosocket_scan_generic(delimiters, buffer + i, len - i);
+}
+#endif
+
+#ifdef IOSOCKET_SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t iosocket_scan_avx2(const unsigned char *delimiters, const char *buffer, size_t len) {
+	__m256i delim[IOSOCKET_PARSE_DELIMITERS_COUNT];
+	size_t i = 0;
+	int j;
+	for(j = 0; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++)
+		delim[j] = _mm256_set1_epi8((char) delimiters[j]);
+	for(; i + 32 <= len; i += 32) {
+		__m256i data = _mm256_loadu_si256((const __m256i *) (buffer + i));
+		__m256i match = _mm256_cmpeq_epi8(data, delim[0]);
+		for(j = 1; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++)
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi8(data, delim[j]));
+		unsigned int mask = _mm256_movemask_epi8(match);
+		if(mask)
+			return i + iosocket_scan_lowest_bit(mask);
+	}
+	return i + iosocket_scan_sse2(delimiters, buffer + i, len - i);
+}
+#endif
+
+static iosocket_scan_function *iosocket_scan_select() {
+	// pick the best scanner for this cpu (all threads select the same function)
+	#if defined(IOSOCKET_SCAN_AVX2)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return iosocket_scan_avx2;
+	return iosocket_scan_sse2;
+	#elif defined(IOSOCKET_SCAN_SSE2)
+	return iosocket_scan_sse2;
+	#else
+	return iosocket_scan_generic;
+	#endif
+}
+
+void iosocket_scan_init() {
+	__atomic_store_n(&iosocket_scan_func, iosocket_scan_select(), __ATOMIC_RELAXED);
+}
+
+static size_t iosocket_scan_resolve(const unsigned char *delimiters, const char *buffer, size_t len) {
+	// used before iohandler_init (eg. by the parse benchmark)
+	iosocket_scan_init();
+	return iosocket_scan_delimiters(delimiters, buffer, len);
+}
+
+const char *iosocket_scan_name() {
+	iosocket_scan_function *scan_func = __atomic_load_n(&iosocket_scan_func, __ATOMIC_RELAXED);
+	if(scan_func == iosocket_scan_resolve) {
+		iosocket_scan_init();
+		scan_func = __atomic_load_n(&iosocket_scan_func, __ATOMIC_RELAXED);
+	}
+	#ifdef IOSOCKET_SCAN_AVX2
+	if(scan_func == iosocket_scan_avx2)
+		return "avx2";
+	#endif
+	#ifdef IOSOCKET_SCAN_SSE2
+	if(scan_func == iosocket_scan_sse2)
+		return "sse2";
+	#endif
+	return "generic";
+}
@@ -21,6 +21,8 @@
 #include "IOLog.h"
 #include "IODNSLookup.h"
 #include "IOSSLBackend.h"
+#include "IOTimer.h"
+#include "IOGarbageCollector.h"
 
 #ifdef WIN32
 #ifdef _WIN32_WINNT
@@ -37,6 +39,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 #include "compat/inet.h"
 #include <stdio.h>
@@ -50,20 +53,48 @@
 #define EWOULDBLOCK WSAEWOULDBLOCK
 #endif
 
-struct _IOSocket *iosocket_first = NULL;
-struct _IOSocket *iosocket_last = NULL;
+IOTHREAD_LOCAL struct _IOSocket **iosocket_active = NULL;
+IOTHREAD_LOCAL int iosocket_active_count = 0;
+static IOTHREAD_LOCAL int iosocket_active_size = 0;
 
-struct IOEngine *engine = NULL;
+/* fd -> active _IOSocket */
+static IOTHREAD_LOCAL struct _IOSocket **iosocket_fd_table = NULL;
+static IOTHREAD_LOCAL int iosocket_fd_table_size = 0;
+
+IOTHREAD_LOCAL struct IOEngine *engine = NULL;
+int iosocket_edge_triggered = 0;
+static int iosocket_sigpipe_ignored = 0;
+
+/* sockets with changed interest masks (flushed by the engines right before waiting) */
+static IOTHREAD_LOCAL struct _IOSocket *iosocket_dirty_first = NULL;
+
+/* per loop object caches (sockets never move to another loop) */
+static IOTHREAD_LOCAL struct IOSlab iosocket_slab = IOSLAB_INIT(struct _IOSocket);
+static IOTHREAD_LOCAL struct IOSlab iosocket_descriptor_slab = IOSLAB_INIT(struct IOSocket);
+static IOTHREAD_LOCAL struct IOSlab iosocket_chunk_slab = IOSLAB_INIT(struct IOSocketWriteChunk); // headers of external chunks
 
 static void iosocket_increase_buffer(struct IOSocketBuffer *iobuf, size_t required);
 static int iosocket_parse_address(const char *hostname, struct IODNSAddress *addr, int records);
 static int iosocket_lookup_hostname(struct _IOSocket *iosock, const char *hostname, int records, int bindaddr);
-static int iosocket_lookup_apply(struct _IOSocket *iosock, int noip6);
+static int iosocket_lookup_apply(struct _IOSocket *iosock);
 static void socket_lookup_clear(struct _IOSocket *iosock);
-static void iosocket_connect_finish(struct _IOSocket *iosock);
+static void iosocket_connect_start(struct _IOSocket *iosock);
+static int iosocket_connect_schedule(struct _IOSocket *iosock);
+static int iosocket_connect_pending(struct _IOSocket *iosock);
+static int iosocket_connect_finish(struct _IOSocket *iosock);
+static void iosocket_connect_next(struct _IOSocket *iosock);
+static void iosocket_connect_failed(struct _IOSocket *iosock, int errid);
+static void iosocket_connect_race_clear(struct _IOSocket *iosock);
+static void iosocket_connect_attempt_callback(struct _IOSocket *attempt, int readable, int writeable);
+static int iosocket_set_timer(struct _IOSocket *iosock, unsigned int msec);
+static void iosocket_timer_update(struct _IOSocket *iosock);
 static void iosocket_listen_finish(struct _IOSocket *iosock);
 static int iosocket_try_write(struct _IOSocket *iosock);
+static void iosocket_writeq_clear(struct _IOSocket *iosock);
+static int iosocket_edge_writeable(struct _IOSocket *iosock);
 static void iosocket_trigger_event(struct IOSocketEvent *event);
+static void iosocket_lookup_failed(struct _IOSocket *iosock, char *errbuf);
+static void iosocket_close_finish(struct _IOSocket *iosock);
 
 #ifdef WIN32
 static int close(int fd) {
@@ -75,10 +106,14 @@ static void iosockets_init_engine() {
 	//try other engines
 	if(!engine && engine_kevent.init && engine_kevent.init())
 		engine = &engine_kevent;
+	if(!engine && !iosocket_edge_triggered && engine_uring.init && engine_uring.init()) // edge triggered mode requires epoll
+		engine = &engine_uring;
 	if(!engine && engine_epoll.init && engine_epoll.init())
 		engine = &engine_epoll;
 	if(!engine && engine_win32.init && engine_win32.init())
 		engine = &engine_win32;
+	if(!engine && engine_poll.init && engine_poll.init())
+		engine = &engine_poll;
 	
 	if (!engine) {
 		if(engine_select.init())
@@ -91,6 +126,13 @@ static void iosockets_init_engine() {
 	iolog_trigger(IOLOG_DEBUG, "using %s IOSockets engine", engine->name);
 }
 
+void iohandler_set_edge_triggered(int enabled) {
+	if(enabled)
+		iosocket_edge_triggered = 1;
+	else
+		iosocket_edge_triggered = 0;
+}
+
 void _init_sockets() {
 	#ifdef WIN32
 	WSADATA wsaData;
@@ -103,70 +145,191 @@ void _init_sockets() {
 	#endif
 	
 	iosockets_init_engine();
-	iossl_init();
 }
 
 
+void _stop_sockets() {
+	// close the sockets left behind by a stopped loop (no further events are triggered)
+	while(iosocket_active_count) {
+		struct _IOSocket *iosock = iosocket_active[iosocket_active_count - 1];
+		if((iosock->socket_flags & IOSOCKETFLAG_PARENT_SOCKET) && iosock->parent)
+			iosock = iosock->parent; // connection attempts are closed by their connecting socket
+		if((iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC) && iosock->parent) {
+			struct IOSocket *iosocket = iosock->parent;
+			iosocket->iosocket = NULL;
+			ioslab_free(iosocket);
+		}
+		// (connecting sockets don't own an fd & dns engine sockets are owned by the dns engine)
+		int close_fd = ((iosock->socket_flags & (IOSOCKETFLAG_ACTIVE | IOSOCKETFLAG_PARENT_DNSENGINE)) == IOSOCKETFLAG_ACTIVE);
+		iosocket_deactivate(iosock);
+		if(close_fd)
+			close(iosock->fd);
+		_free_socket(iosock);
+	}
+	iogc_flush(); // (connection attempts & descriptors are freed into the slabs)
+	
+	if(engine) {
+		if(engine->cleanup)
+			engine->cleanup();
+		engine = NULL;
+	}
+	if(iosocket_fd_table)
+		free(iosocket_fd_table);
+	iosocket_fd_table = NULL;
+	iosocket_fd_table_size = 0;
+	if(iosocket_active)
+		free(iosocket_active);
+	iosocket_active = NULL;
+	iosocket_active_size = 0;
+	ioslab_release(&iosocket_slab);
+	ioslab_release(&iosocket_descriptor_slab);
+	ioslab_release(&iosocket_chunk_slab);
+}
+
+
+static struct IOSocket *iosocket_create_descriptor() {
+	struct IOSocket *iosocket = ioslab_alloc(&iosocket_descriptor_slab);
+	if(!iosocket)
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocket in %s:%d", __FILE__, __LINE__);
+	return iosocket;
+}
+
+static IOGC_FREE(iosocket_free_descriptor) {
+	ioslab_free(object);
+}
+
 struct _IOSocket *_create_socket() {
-	struct _IOSocket *iosock = calloc(1, sizeof(*iosock));
+	struct _IOSocket *iosock = ioslab_alloc(&iosocket_slab);
 	if(!iosock) {
 		iolog_trigger(IOLOG_ERROR, "could not allocate memory for _IOSocket in %s:%d", __FILE__, __LINE__);
 		return NULL;
 	}
-	if(iosocket_last)
-		iosocket_last->next = iosock;
-	else
-		iosocket_first = iosock;
-	iosock->prev = iosocket_last;
-	iosocket_last = iosock;
 	return iosock;
 }
 
 void _free_socket(struct _IOSocket *iosock) {
 	iosocket_deactivate(iosock);
-	if(iosock->prev)
-		iosock->prev->next = iosock->next;
-	else
-		iosocket_first = iosock->next;
-	if(iosock->next)
-		iosock->next->prev = iosock->prev;
-	else
-		iosocket_last = iosock->prev;
 	
-	if(iosock->bind.addr.addresslen)
-		free(iosock->bind.addr.address);
-	if(iosock->dest.addr.addresslen)
-		free(iosock->dest.addr.address);
+	if(iosock->race)
+		iosocket_connect_race_clear(iosock);
 	if(iosock->bind.addrlookup || iosock->dest.addrlookup)
 		socket_lookup_clear(iosock);
 	if(iosock->readbuf.buffer)
 		free(iosock->readbuf.buffer);
-	if(iosock->writebuf.buffer)
-		free(iosock->writebuf.buffer);
+	iosocket_writeq_clear(iosock);
 	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
 		iossl_disconnect(iosock);
+	if(iosock->ssl_peer)
+		free(iosock->ssl_peer);
+	if(iosock->ssl_profile)
+		iossl_release_profile(iosock->ssl_profile);
+	if(iosock->timer)
+		_destroy_timer(iosock->timer);
 	
-	free(iosock);
+	ioslab_free(iosock);
 }
 
-void iosocket_activate(struct _IOSocket *iosock) {
+static int iosocket_table_add(struct _IOSocket *iosock) {
+	if(iosock->fd < 0)
+		return 0;
+	if(iosock->fd >= iosocket_fd_table_size) {
+		int new_size = (iosocket_fd_table_size ? iosocket_fd_table_size : IOHANDLER_MAX_SOCKETS);
+		while(new_size <= iosock->fd)
+			new_size *= 2;
+		struct _IOSocket **new_table = realloc(iosocket_fd_table, new_size * sizeof(*new_table));
+		if(!new_table) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for fd table in %s:%d", __FILE__, __LINE__);
+			return 0;
+		}
+		memset(new_table + iosocket_fd_table_size, 0, (new_size - iosocket_fd_table_size) * sizeof(*new_table));
+		iosocket_fd_table = new_table;
+		iosocket_fd_table_size = new_size;
+	}
+	if(iosocket_active_count == iosocket_active_size) {
+		int new_size = (iosocket_active_size ? iosocket_active_size * 2 : 64);
+		struct _IOSocket **new_active = realloc(iosocket_active, new_size * sizeof(*new_active));
+		if(!new_active) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for active socket list in %s:%d", __FILE__, __LINE__);
+			return 0;
+		}
+		iosocket_active = new_active;
+		iosocket_active_size = new_size;
+	}
+	iosocket_fd_table[iosock->fd] = iosock;
+	iosock->active_index = iosocket_active_count;
+	iosocket_active[iosocket_active_count++] = iosock;
+	return 1;
+}
+
+static void iosocket_table_remove(struct _IOSocket *iosock) {
+	if(iosock->fd >= 0 && iosock->fd < iosocket_fd_table_size && iosocket_fd_table[iosock->fd] == iosock)
+		iosocket_fd_table[iosock->fd] = NULL;
+	// move the last active socket into the gap
+	struct _IOSocket *last = iosocket_active[--iosocket_active_count];
+	iosocket_active[iosock->active_index] = last;
+	last->active_index = iosock->active_index;
+}
+
+struct _IOSocket *iosocket_get_by_fd(int fd) {
+	if(fd < 0 || fd >= iosocket_fd_table_size)
+		return NULL;
+	return iosocket_fd_table[fd];
+}
+
+int iosocket_activate(struct _IOSocket *iosock) {
 	if((iosock->socket_flags & IOSOCKETFLAG_ACTIVE))
-		return;
+		return 1;
+	if(!iosocket_table_add(iosock))
+		return 0;
 	iosock->socket_flags |= IOSOCKETFLAG_ACTIVE;
-	engine->add(iosock);
+	if(!engine->add(iosock)) {
+		iosock->socket_flags &= ~IOSOCKETFLAG_ACTIVE;
+		iosocket_table_remove(iosock);
+		return 0;
+	}
+	return 1;
 }
 
 void iosocket_deactivate(struct _IOSocket *iosock) {
 	if(!(iosock->socket_flags & IOSOCKETFLAG_ACTIVE))
 		return;
 	iosock->socket_flags &= ~IOSOCKETFLAG_ACTIVE;
+	if((iosock->socket_flags & IOSOCKETFLAG_UPDATE_PENDING)) {
+		struct _IOSocket **dirty;
+		for(dirty = &iosocket_dirty_first; *dirty; dirty = &(*dirty)->dirty_next) {
+			if(*dirty == iosock) {
+				*dirty = iosock->dirty_next;
+				break;
+			}
+		}
+		iosock->socket_flags &= ~IOSOCKETFLAG_UPDATE_PENDING;
+	}
 	engine->remove(iosock);
+	iosocket_table_remove(iosock);
 }
 
 void iosocket_update(struct _IOSocket *iosock) {
 	if(!(iosock->socket_flags & IOSOCKETFLAG_ACTIVE))
 		return;
-	engine->update(iosock);
+	if((iosock->socket_flags & IOSOCKETFLAG_UPDATE_PENDING))
+		return;
+	iosock->socket_flags |= IOSOCKETFLAG_UPDATE_PENDING;
+	iosock->dirty_next = iosocket_dirty_first;
+	iosocket_dirty_first = iosock;
+}
+
+void iosocket_flush_updates() {
+	struct _IOSocket *iosock, *next_iosock;
+	iosock = iosocket_dirty_first;
+	iosocket_dirty_first = NULL;
+	for(; iosock; iosock = next_iosock) {
+		next_iosock = iosock->dirty_next;
+		iosock->socket_flags &= ~IOSOCKETFLAG_UPDATE_PENDING;
+		if(iosocket_edge_writeable(iosock))
+			iosocket_try_write(iosock);
+		else
+			engine->update(iosock);
+	}
 }
 
 static void iosocket_increase_buffer(struct IOSocketBuffer *iobuf, size_t required) {
@@ -186,29 +349,21 @@ static int iosocket_parse_address(const char *hostname, struct IODNSAddress *add
 	int ret;
 	if((records & IOSOCKET_ADDR_IPV4)) {
 		struct sockaddr_in ip4addr;
+		memset(&ip4addr, 0, sizeof(ip4addr));
+		ip4addr.sin_family = AF_INET;
 		ret = inet_pton(AF_INET, hostname, &(ip4addr.sin_addr));
 		if(ret == 1) {
-			addr->addresslen = sizeof(ip4addr);
-			addr->address = malloc(addr->addresslen);
-			if(!addr->address) {
-				iolog_trigger(IOLOG_ERROR, "could not allocate memory for sockaddr in %s:%d", __FILE__, __LINE__);
-				return -1;
-			}
-			memcpy(addr->address, &ip4addr, sizeof(ip4addr));
+			iodns_set_address(addr, &ip4addr, sizeof(ip4addr));
 			return 1;
 		}
 	}
 	if((records & IOSOCKET_ADDR_IPV6)) {
 		struct sockaddr_in6 ip6addr;
+		memset(&ip6addr, 0, sizeof(ip6addr));
+		ip6addr.sin6_family = AF_INET6;
 		ret = inet_pton(AF_INET6, hostname, &(ip6addr.sin6_addr));
 		if(ret == 1) {
-			addr->addresslen = sizeof(ip6addr);
-			addr->address = malloc(addr->addresslen);
-			if(!addr->address) {
-				iolog_trigger(IOLOG_ERROR, "could not allocate memory for sockaddr in %s:%d", __FILE__, __LINE__);
-				return -1;
-			}
-			memcpy(addr->address, &ip6addr, sizeof(ip6addr));
+			iodns_set_address(addr, &ip6addr, sizeof(ip6addr));
 			return 1;
 		}
 	}
@@ -258,8 +413,13 @@ static int iosocket_lookup_hostname(struct _IOSocket *iosock, const char *hostna
 void iosocket_lookup_callback(struct IOSocketDNSLookup *lookup, struct IODNSEvent *event) {
 	lookup->query = NULL;
 	struct _IOSocket *iosock = lookup->iosocket;
-	if(iosock == NULL)
+	if(iosock == NULL) {
+		// socket has been closed while the lookup was pending
+		if(event->type == IODNSEVENT_SUCCESS && event->result)
+			iodns_free_result(event->result);
+		free(lookup);
 		return;
+	}
 	
 	if(event->type == IODNSEVENT_SUCCESS)
 		lookup->result = event->result;
@@ -279,19 +439,17 @@ void iosocket_lookup_callback(struct IOSocketDNSLookup *lookup, struct IODNSEven
 		dns_finished = 1;
 	
 	if(dns_finished) {
-		int ret;
-		ret = iosocket_lookup_apply(iosock, 0);
-		if(ret) { //if ret=0 an error occured in iosocket_lookup_apply and we should stop here.
-			if((iosock->socket_flags & IOSOCKETFLAG_LISTENING)) {
+		if((iosock->socket_flags & IOSOCKETFLAG_LISTENING)) {
+			if(iosocket_lookup_apply(iosock)) { //if ret=0 an error occured in iosocket_lookup_apply and we should stop here.
 				socket_lookup_clear(iosock);
 				iosocket_listen_finish(iosock);
-			} else
-				iosocket_connect_finish(iosock);
-		}
+			}
+		} else if(!iosocket_connect_schedule(iosock))
+			iosocket_connect_start(iosock);
 	}
 }
 
-static int iosocket_lookup_apply(struct _IOSocket *iosock, int noip6) {
+static int iosocket_lookup_apply(struct _IOSocket *iosock) {
 	char errbuf[512];
 	struct IOSocketDNSLookup *bind_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_BINDDNS) ? iosock->bind.addrlookup : NULL);
 	struct IOSocketDNSLookup *dest_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_DESTDNS) ? iosock->dest.addrlookup : NULL);
@@ -353,14 +511,12 @@ static int iosocket_lookup_apply(struct _IOSocket *iosock, int noip6) {
 	}
 	
 	int usetype = 0;
-	if(useip6 && !noip6) {
+	if(useip6) {
 		usetype = IODNS_RECORD_AAAA;
 		iosock->socket_flags |= IOSOCKETFLAG_IPV6SOCKET;
-		if(useip4)
-			iosock->socket_flags |= IOSOCKETFLAG_RECONNECT_IPV4;
 	} else if(useip4) {
 		usetype = IODNS_RECORD_A;
-		iosock->socket_flags &= ~(IOSOCKETFLAG_IPV6SOCKET | IOSOCKETFLAG_RECONNECT_IPV4);
+		iosock->socket_flags &= ~IOSOCKETFLAG_IPV6SOCKET;
 	} else {
 		iosock->socket_flags |= IOSOCKETFLAG_DNSERROR;
 		sprintf(errbuf, "could not lookup adresses of the same IP family for bind and destination host. (bind: %d ip4, %d ip6 | dest: %d ip4, %d ip6)", bind_numip4, bind_numip6, dest_numip4, dest_numip6);
@@ -368,16 +524,7 @@ static int iosocket_lookup_apply(struct _IOSocket *iosock, int noip6) {
 	}
 	
 	#define IOSOCKET_APPLY_COPYADDR(type) \
-	iosock->type.addr.addresslen = result->result.addr.addresslen; \
-	iosock->type.addr.address = malloc(result->result.addr.addresslen); \
-	if(!iosock->type.addr.address) { \
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for sockaddr in %s:%d", __FILE__, __LINE__); \
-		iosock->type.addr.addresslen = 0; \
-		iosock->socket_flags |= IOSOCKETFLAG_DNSERROR; \
-		sprintf(errbuf, "could not allocate memory for dns information"); \
-		goto iosocket_lookup_apply_end; \
-	} \
-	memcpy(iosock->type.addr.address, result->result.addr.address, result->result.addr.addresslen);
+	iodns_set_address(&iosock->type.addr, result->result.addr.address, result->result.addr.addresslen);
 	
 	
 	if(bind_lookup) {
@@ -417,28 +564,32 @@ static int iosocket_lookup_apply(struct _IOSocket *iosock, int noip6) {
 	iosocket_lookup_apply_end:
 	
 	if((iosock->socket_flags & IOSOCKETFLAG_DNSERROR)) {
-		// TODO: trigger error
-		iolog_trigger(IOLOG_ERROR, "error while trying to apply dns lookup information: %s", errbuf);
-		
-		if((iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC)) {
-			//trigger event
-			struct IOSocket *iosocket = iosock->parent;
-			
-			struct IOSocketEvent callback_event;
-			callback_event.type = IOSOCKETEVENT_DNSFAILED;
-			callback_event.socket = iosocket;
-			callback_event.data.recv_str = errbuf;
-			iosocket_trigger_event(&callback_event);
-			
-			iosocket_close(iosocket);
-		} else {
-			// TODO: IODNS Callback
-		}
+		iosocket_lookup_failed(iosock, errbuf);
 		return 0;
 	} else
 		return 1;
 }
 
+static void iosocket_lookup_failed(struct _IOSocket *iosock, char *errbuf) {
+	iolog_trigger(IOLOG_ERROR, "error while trying to apply dns lookup information: %s", errbuf);
+	
+	if((iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC)) {
+		//trigger event
+		struct IOSocket *iosocket = iosock->parent;
+		
+		struct IOSocketEvent callback_event;
+		callback_event.type = IOSOCKETEVENT_DNSFAILED;
+		callback_event.socket = iosocket;
+		callback_event.data.recv_str = errbuf;
+		iosocket_trigger_event(&callback_event);
+		
+		if(iosocket->iosocket == iosock)
+			iosocket_close(iosocket);
+	} else {
+		// TODO: IODNS Callback
+	}
+}
+
 static void socket_lookup_clear(struct _IOSocket *iosock) {
 	struct IOSocketDNSLookup *bind_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_BINDDNS) ? iosock->bind.addrlookup : NULL);
 	struct IOSocketDNSLookup *dest_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_DESTDNS) ? iosock->dest.addrlookup : NULL);
@@ -454,9 +605,18 @@ static void socket_lookup_clear(struct _IOSocket *iosock) {
 		free(dest_lookup);
 		iosock->dest.addrlookup = NULL;
 	}
+	// pending lookups are freed by iosocket_lookup_callback
+	if((iosock->socket_flags & IOSOCKETFLAG_PENDING_BINDDNS) && iosock->bind.addrlookup) {
+		iosock->bind.addrlookup->iosocket = NULL;
+		iosock->bind.addrlookup = NULL;
+	}
+	if((iosock->socket_flags & IOSOCKETFLAG_PENDING_DESTDNS) && iosock->dest.addrlookup) {
+		iosock->dest.addrlookup->iosocket = NULL;
+		iosock->dest.addrlookup = NULL;
+	}
 }
 
-static void iosocket_prepare_fd(int sockfd) {
+static void iosocket_prepare_fd(int sockfd, int nonblocking) {
 	// prevent SIGPIPE
 	#ifndef WIN32
 	#if defined(SO_NOSIGPIPE)
@@ -465,10 +625,16 @@ static void iosocket_prepare_fd(int sockfd) {
 		setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
 	}
 	#else
-	signal(SIGPIPE, SIG_IGN);
+	if(!iosocket_sigpipe_ignored) {
+		signal(SIGPIPE, SIG_IGN);
+		iosocket_sigpipe_ignored = 1;
+	}
 	#endif
 	#endif
 	
+	if(nonblocking)
+		return; // already created with O_NONBLOCK & FD_CLOEXEC (accept4)
+	
 	// make sockfd unblocking
 	#if defined(F_GETFL)
 	{
@@ -493,23 +659,19 @@ static void iosocket_update_parent(struct _IOSocket *iosock) {
 		if(!(iosock->socket_flags & IOSOCKETFLAG_LISTENING))
 			iosocket->remoteaddr = &iosock->dest.addr;
 		iosocket->localaddr = &iosock->bind.addr;
-		if(iosock->bind.addr.addresslen && (iosock->socket_flags & IOSOCKETFLAG_DYNAMIC_BIND)) {
-			free(iosock->bind.addr.address);
+		if(iosock->bind.addr.addresslen && (iosock->socket_flags & IOSOCKETFLAG_DYNAMIC_BIND))
 			iosock->bind.addr.addresslen = 0;
-		}
 		if(!iosock->bind.addr.addresslen) {
+			socklen_t addrlen = sizeof(iosock->bind.addr.storage);
 			iosock->socket_flags |= IOSOCKETFLAG_DYNAMIC_BIND;
-			if(iosocket->ipv6)
-				iosock->bind.addr.addresslen = sizeof(struct sockaddr_in6);
-			else
-				iosock->bind.addr.addresslen = sizeof(struct sockaddr_in);
-			iosock->bind.addr.address = malloc(iosock->bind.addr.addresslen);
-			getsockname(iosock->fd, (struct sockaddr *)iosock->bind.addr.address, (socklen_t *)&iosock->bind.addr.addresslen);
+			iosock->bind.addr.address = (struct sockaddr *) &iosock->bind.addr.storage;
+			if(getsockname(iosock->fd, iosock->bind.addr.address, &addrlen) == 0)
+				iosock->bind.addr.addresslen = addrlen;
 		}
 	}
 } 
 
-static void iosocket_connect_finish(struct _IOSocket *iosock) {
+static int iosocket_connect_finish(struct _IOSocket *iosock) {
 	int sockfd;
 	if((iosock->socket_flags & IOSOCKETFLAG_IPV6SOCKET))
 		sockfd = socket(AF_INET6, SOCK_STREAM, 0);
@@ -517,9 +679,7 @@ static void iosocket_connect_finish(struct _IOSocket *iosock) {
 		sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if(sockfd == -1) {
 		iolog_trigger(IOLOG_ERROR, "could not create socket in %s:%d", __FILE__, __LINE__);
-		// TODO: trigger error
-		
-		return;
+		return 0;
 	}
 	
 	// set port and bind address
@@ -549,15 +709,270 @@ static void iosocket_connect_finish(struct _IOSocket *iosock) {
 		}
 	}
 	
-	iosocket_prepare_fd(sockfd);
+	iosocket_prepare_fd(sockfd, 0);
 	
 	int ret = connect(sockfd, iosock->dest.addr.address, iosock->dest.addr.addresslen); //returns EINPROGRESS here (nonblocking)
 	iolog_trigger(IOLOG_DEBUG, "connecting socket (connect: %d)", ret);
+	if(ret < 0) {
+		#ifdef WIN32
+		int errcode = WSAGetLastError();
+		if(errcode != WSAEWOULDBLOCK) {
+		#else
+		int errcode = errno;
+		if(errcode != EINPROGRESS) {
+		#endif
+			close(sockfd);
+			errno = errcode;
+			return 0; // immediate failure (eg. no route to host)
+		}
+	}
 	
 	iosock->fd = sockfd;
 	iosock->socket_flags |= IOSOCKETFLAG_CONNECTING;
 	
-	iosocket_activate(iosock);
+	if(!iosocket_activate(iosock)) {
+		close(sockfd);
+		iosock->fd = 0;
+		errno = ENOMEM;
+		return 0;
+	}
+	return 1;
+}
+
+static struct IODNSResult *iosocket_next_result(struct IODNSResult *result, int type) {
+	for(; result; result = result->next) {
+		if((result->type & type))
+			return result;
+	}
+	return NULL;
+}
+
+static int iosocket_address_type(struct IODNSAddress *addr) {
+	return ((addr->address->sa_family == AF_INET6) ? IODNS_RECORD_AAAA : IODNS_RECORD_A);
+}
+
+static int iosocket_connect_schedule(struct _IOSocket *iosock) {
+	// start connecting from the socket timer, so no event is triggered before iosocket_connect returns
+	iosock->socket_flags |= IOSOCKETFLAG_CONNECTING;
+	return iosocket_set_timer(iosock, 0);
+}
+
+static int iosocket_connect_pending(struct _IOSocket *iosock) {
+	// scheduled by iosocket_connect_schedule but not started yet (no race and no fd)
+	if((iosock->socket_flags & (IOSOCKETFLAG_CONNECTING | IOSOCKETFLAG_DEAD | IOSOCKETFLAG_PENDING_BINDDNS | IOSOCKETFLAG_PENDING_DESTDNS)) != IOSOCKETFLAG_CONNECTING)
+		return 0;
+	return (!iosock->race && !iosock->fd);
+}
+
+static void iosocket_connect_start(struct _IOSocket *iosock) {
+	char errbuf[512];
+	struct IOSocketDNSLookup *bind_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_BINDDNS) ? iosock->bind.addrlookup : NULL);
+	struct IOSocketDNSLookup *dest_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_DESTDNS) ? iosock->dest.addrlookup : NULL);
+	struct IODNSResult *result, *next_ip6, *next_ip4;
+	int usetypes = 0, count = 0;
+	
+	// address families we can bind to
+	if(bind_lookup) {
+		for(result = bind_lookup->result; result; result = result->next)
+			usetypes |= (result->type & (IODNS_RECORD_A | IODNS_RECORD_AAAA));
+		if(!usetypes) {
+			sprintf(errbuf, "could not lookup bind address (%s)", bind_lookup->hostname);
+			iosocket_lookup_failed(iosock, errbuf);
+			return;
+		}
+	} else if(iosock->bind.addr.addresslen)
+		usetypes = iosocket_address_type(&iosock->bind.addr);
+	else
+		usetypes = (IODNS_RECORD_A | IODNS_RECORD_AAAA);
+	
+	if(dest_lookup) {
+		if(!dest_lookup->result) {
+			sprintf(errbuf, "could not lookup destination address (%s)", dest_lookup->hostname);
+			iosocket_lookup_failed(iosock, errbuf);
+			return;
+		}
+		for(result = dest_lookup->result; result; result = result->next) {
+			if((result->type & usetypes))
+				count++;
+		}
+	} else if((iosocket_address_type(&iosock->dest.addr) & usetypes))
+		count = 1;
+	if(!count) {
+		sprintf(errbuf, "could not lookup adresses of the same IP family for bind and destination host.");
+		iosocket_lookup_failed(iosock, errbuf);
+		return;
+	}
+	
+	struct IOSocketConnectRace *race = calloc(1, sizeof(*race) + count * (sizeof(*race->candidates) + sizeof(*race->attempts)));
+	if(!race) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocketConnectRace in %s:%d", __FILE__, __LINE__);
+		sprintf(errbuf, "Internal Error");
+		iosocket_lookup_failed(iosock, errbuf);
+		return;
+	}
+	race->candidates = (struct IODNSAddress **) (race + 1);
+	race->attempts = (struct _IOSocket **) (race->candidates + count);
+	
+	// RFC 8305: alternate between the address families (starting with IPv6), keep the resolver's order within a family
+	if(dest_lookup) {
+		next_ip6 = iosocket_next_result(dest_lookup->result, (usetypes & IODNS_RECORD_AAAA));
+		next_ip4 = iosocket_next_result(dest_lookup->result, (usetypes & IODNS_RECORD_A));
+		while(next_ip6 || next_ip4) {
+			if(next_ip6) {
+				race->candidates[race->candidate_count++] = &next_ip6->result.addr;
+				next_ip6 = iosocket_next_result(next_ip6->next, IODNS_RECORD_AAAA);
+			}
+			if(next_ip4) {
+				race->candidates[race->candidate_count++] = &next_ip4->result.addr;
+				next_ip4 = iosocket_next_result(next_ip4->next, IODNS_RECORD_A);
+			}
+		}
+	} else
+		race->candidates[race->candidate_count++] = &iosock->dest.addr;
+	
+	iosock->race = race;
+	iosock->socket_flags |= IOSOCKETFLAG_CONNECTING;
+	iosocket_connect_next(iosock);
+}
+
+static int iosocket_connect_attempt(struct _IOSocket *iosock, struct IODNSAddress *dest) {
+	struct IOSocketDNSLookup *bind_lookup = ((iosock->socket_flags & IOSOCKETFLAG_DNSDONE_BINDDNS) ? iosock->bind.addrlookup : NULL);
+	struct _IOSocket *attempt = _create_socket();
+	if(!attempt) {
+		iosock->race->last_error = ENOMEM;
+		return 0;
+	}
+	attempt->parent = iosock;
+	attempt->socket_flags |= IOSOCKETFLAG_PARENT_SOCKET;
+	attempt->port = iosock->port;
+	iodns_set_address(&attempt->dest.addr, dest->address, dest->addresslen);
+	
+	int usetype = iosocket_address_type(dest);
+	if(usetype == IODNS_RECORD_AAAA)
+		attempt->socket_flags |= IOSOCKETFLAG_IPV6SOCKET;
+	if(bind_lookup) {
+		struct IODNSResult *result;
+		int usenum = 0;
+		for(result = bind_lookup->result; result; result = result->next) {
+			if((result->type & usetype))
+				usenum++;
+		}
+		usenum = rand() % usenum;
+		for(result = iosocket_next_result(bind_lookup->result, usetype); usenum; usenum--)
+			result = iosocket_next_result(result->next, usetype);
+		iodns_set_address(&attempt->bind.addr, result->result.addr.address, result->result.addr.addresslen);
+	} else if(iosock->bind.addr.addresslen)
+		iodns_set_address(&attempt->bind.addr, iosock->bind.addr.address, iosock->bind.addr.addresslen);
+	
+	if(!iosocket_connect_finish(attempt)) {
+		iosock->race->last_error = errno;
+		iolog_trigger(IOLOG_DEBUG, "connection attempt failed: %d - %s", errno, strerror(errno));
+		_free_socket(attempt);
+		return 0;
+	}
+	iosock->race->attempts[iosock->race->attempt_count++] = attempt;
+	return 1;
+}
+
+static IOGC_FREE(iosocket_free_attempt) {
+	_free_socket(object);
+}
+
+static void iosocket_connect_attempt_close(struct _IOSocket *iosock, struct _IOSocket *attempt) {
+	struct IOSocketConnectRace *race = iosock->race;
+	int i;
+	for(i = 0; i < race->attempt_count; i++) {
+		if(race->attempts[i] == attempt) {
+			race->attempts[i] = race->attempts[--race->attempt_count];
+			break;
+		}
+	}
+	// the engine might still have pending events for this attempt (freed after the current loop iteration)
+	iosocket_deactivate(attempt);
+	if(attempt->fd)
+		close(attempt->fd); // fd is 0 if it has been taken over by iosock
+	attempt->fd = 0;
+	attempt->socket_flags |= IOSOCKETFLAG_DEAD;
+	attempt->parent = NULL;
+	iogc_add_callback(attempt, iosocket_free_attempt);
+}
+
+static void iosocket_connect_race_clear(struct _IOSocket *iosock) {
+	struct IOSocketConnectRace *race = iosock->race;
+	while(race->attempt_count)
+		iosocket_connect_attempt_close(iosock, race->attempts[0]);
+	free(race);
+	iosock->race = NULL;
+}
+
+static void iosocket_connect_next(struct _IOSocket *iosock) {
+	struct IOSocketConnectRace *race = iosock->race;
+	while(race->next_candidate < race->candidate_count) {
+		if(iosocket_connect_attempt(iosock, race->candidates[race->next_candidate++])) {
+			race->last_attempt = iotimer_now;
+			iosocket_timer_update(iosock);
+			return;
+		}
+	}
+	if(race->attempt_count)
+		return; // no more addresses left, wait for the pending attempts
+	
+	// all attempts failed
+	int errid = race->last_error;
+	iosocket_connect_race_clear(iosock);
+	iosocket_connect_failed(iosock, errid);
+}
+
+static void iosocket_connect_failed(struct _IOSocket *iosock, int errid) {
+	iosock->socket_flags |= IOSOCKETFLAG_DEAD;
+	if((iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC)) {
+		struct IOSocket *iosocket = iosock->parent;
+		struct IOSocketEvent callback_event;
+		callback_event.type = IOSOCKETEVENT_NOTCONNECTED;
+		callback_event.socket = iosocket;
+		callback_event.data.errid = errid;
+		iosocket_trigger_event(&callback_event);
+		if(iosocket->iosocket == iosock)
+			iosocket_close(iosocket);
+	}
+}
+
+static void iosocket_connect_attempt_callback(struct _IOSocket *attempt, int readable, int writeable) {
+	struct _IOSocket *iosock = attempt->parent;
+	if((attempt->socket_flags & IOSOCKETFLAG_DEAD))
+		return; // cancelled
+	
+	int sockerr = 0;
+	socklen_t sockerrlen = sizeof(sockerr);
+	if(getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, (char *) &sockerr, &sockerrlen) < 0)
+		sockerr = errno;
+	if(sockerr) {
+		iolog_trigger(IOLOG_DEBUG, "connection attempt (fd: %d) failed: %d - %s", attempt->fd, sockerr, strerror(sockerr));
+		iosock->race->last_error = sockerr;
+		iosocket_connect_attempt_close(iosock, attempt);
+		iosocket_connect_next(iosock); // start the next attempt right away
+		return;
+	}
+	if(!writeable)
+		return; // still connecting
+	
+	// first attempt connected: take over its fd and cancel the others
+	iosocket_deactivate(attempt);
+	iosock->fd = attempt->fd;
+	attempt->fd = 0;
+	iodns_set_address(&iosock->dest.addr, attempt->dest.addr.address, attempt->dest.addr.addresslen);
+	if(attempt->bind.addr.addresslen)
+		iodns_set_address(&iosock->bind.addr, attempt->bind.addr.address, attempt->bind.addr.addresslen);
+	iosock->socket_flags &= ~IOSOCKETFLAG_IPV6SOCKET;
+	iosock->socket_flags |= (attempt->socket_flags & IOSOCKETFLAG_IPV6SOCKET);
+	
+	iosocket_connect_race_clear(iosock);
+	if(!iosocket_activate(iosock)) {
+		iosocket_connect_failed(iosock, ENOMEM);
+		return;
+	}
+	iosocket_timer_update(iosock);
+	iosocket_events_callback(iosock, readable, 1);
 }
 
 static void iosocket_listen_finish(struct _IOSocket *iosock) {
@@ -573,6 +988,13 @@ static void iosocket_listen_finish(struct _IOSocket *iosock) {
 		return;
 	}
 	
+	#ifdef SO_REUSEPORT
+	if((iosock->socket_flags & IOSOCKETFLAG_REUSEPORT)) {
+		int opt = 1;
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt));
+	}
+	#endif
+	
 	// set port and bind address
 	if((iosock->socket_flags & IOSOCKETFLAG_IPV6SOCKET)) {
 		struct sockaddr_in6 *ip6bind = (void*) iosock->bind.addr.address;
@@ -594,26 +1016,42 @@ static void iosocket_listen_finish(struct _IOSocket *iosock) {
 		bind(sockfd, (struct sockaddr*)ip4bind, sizeof(*ip4bind));
 	}
 	
-	iosocket_prepare_fd(sockfd);
+	iosocket_prepare_fd(sockfd, 0);
 	
-	listen(sockfd, 1);
+	listen(sockfd, (iosock->backlog ? iosock->backlog : SOMAXCONN));
 	iosock->fd = sockfd;
 	iosocket_update_parent(iosock);
 	
-	iosocket_activate(iosock);
+	if(!iosocket_activate(iosock))
+		iosock->socket_flags |= IOSOCKETFLAG_DEAD; // can't be watched, the fd is closed with the socket
 }
 
 struct _IOSocket *iosocket_accept_client(struct _IOSocket *iosock) {
-	struct IOSocket *new_iosocket = calloc(1, sizeof(*new_iosocket));
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd;
+	
+	//accept client
+	if(engine->accept && (iosocket_engine_io(iosock) & IOSOCKET_ENGINE_ACCEPT))
+		fd = engine->accept(iosock, (struct sockaddr *)&addr, &addrlen); // accepted by the engine (non-blocking)
+	else
+	#ifdef HAVE_ACCEPT4
+	fd = accept4(iosock->fd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	#else
+	fd = accept(iosock->fd, (struct sockaddr *)&addr, &addrlen);
+	#endif
+	if(fd == -1)
+		return NULL;
+	
+	struct IOSocket *new_iosocket = iosocket_create_descriptor();
 	if(!new_iosocket) {
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocket in %s:%d", __FILE__, __LINE__);
-		close(accept(iosock->fd, NULL, 0)); // simply drop connection
+		close(fd); // simply drop connection
 		return NULL;
 	}
 	struct _IOSocket *new_iosock = _create_socket();
 	if(!new_iosock) {
-		free(new_iosocket);
-		close(accept(iosock->fd, NULL, 0)); // simply drop connection
+		ioslab_free(new_iosocket);
+		close(fd); // simply drop connection
 		return NULL;
 	}
 	new_iosocket->iosocket = new_iosock;
@@ -621,52 +1059,35 @@ struct _IOSocket *iosocket_accept_client(struct _IOSocket *iosock) {
 	new_iosocket->data = iosock;
 	new_iosock->parent = new_iosocket;
 	new_iosock->socket_flags |= IOSOCKETFLAG_PARENT_PUBLIC | IOSOCKETFLAG_INCOMING | (iosock->socket_flags & IOSOCKETFLAG_IPV6SOCKET);
+	new_iosock->fd = fd;
+	new_iosock->activity = iotimer_now;
 	
-	struct sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
-	
-	//accept client
-	new_iosock->fd = accept(iosock->fd, (struct sockaddr *)&addr, &addrlen);
-	
-	//copy remote address
-	new_iosock->dest.addr.address = malloc(addrlen);
-	if(!new_iosock->dest.addr.address) {
-		close(new_iosock->fd);
-		free(new_iosock);
-		free(new_iosock);
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for sockaddr in %s:%d", __FILE__, __LINE__);
-		return NULL;
-	}
-	memcpy(new_iosock->dest.addr.address, &addr, addrlen);
-	new_iosock->dest.addr.addresslen = addrlen;
-	
-	//copy local address
-	new_iosock->bind.addr.address = malloc(iosock->bind.addr.addresslen);
-	if(!new_iosock->bind.addr.address) {
-		close(new_iosock->fd);
-		free(new_iosock);
-		free(new_iosock);
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for sockaddr in %s:%d", __FILE__, __LINE__);
-		return NULL;
-	}
-	memcpy(new_iosock->bind.addr.address, iosock->bind.addr.address, iosock->bind.addr.addresslen);
-	new_iosock->bind.addr.addresslen = iosock->bind.addr.addresslen;
+	//copy remote & local address
+	iodns_set_address(&new_iosock->dest.addr, &addr, addrlen);
+	if(iosock->bind.addr.addresslen)
+		iodns_set_address(&new_iosock->bind.addr, iosock->bind.addr.address, iosock->bind.addr.addresslen);
 	
 	//prepare new socket fd
-	iosocket_prepare_fd(new_iosock->fd);
+	#ifdef HAVE_ACCEPT4
+	iosocket_prepare_fd(new_iosock->fd, 1);
+	#else
+	iosocket_prepare_fd(new_iosock->fd, 0);
+	#endif
 	
 	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET)) {
 		new_iosocket->ssl = 1;
 		new_iosock->socket_flags |= IOSOCKETFLAG_SSLSOCKET;
 		
 		iossl_client_accepted(iosock, new_iosock);
-	} else {
-		//initialize readbuf
-		iosocket_increase_buffer(&iosock->readbuf, 1024);
 	}
+	// the readbuf is allocated on the first read
 	
 	iosocket_update_parent(new_iosock);
-	iosocket_activate(new_iosock);
+	if(!iosocket_activate(new_iosock)) {
+		iosocket_close_finish(new_iosock); // simply drop connection
+		ioslab_free(new_iosocket);
+		return NULL;
+	}
 	return new_iosock;
 }
 
@@ -677,15 +1098,13 @@ struct IOSocket *iosocket_connect(const char *hostname, unsigned int port, int s
 }
 
 struct IOSocket *iosocket_connect_flags(const char *hostname, unsigned int port, int ssl, const char *bindhost, iosocket_callback *callback, int flags) {
-	struct IOSocket *iodescriptor = calloc(1, sizeof(*iodescriptor));
-	if(!iodescriptor) {
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocket in %s:%d", __FILE__, __LINE__);
+	struct IOSocket *iodescriptor = iosocket_create_descriptor();
+	if(!iodescriptor)
 		return NULL;
-	}
 	
 	struct _IOSocket *iosock = _create_socket();
 	if(!iosock) {
-		free(iodescriptor);
+		ioslab_free(iodescriptor);
 		return NULL;
 	}
 	
@@ -695,42 +1114,34 @@ struct IOSocket *iosocket_connect_flags(const char *hostname, unsigned int port,
 	iosock->parent = iodescriptor;
 	iosock->socket_flags |= IOSOCKETFLAG_PARENT_PUBLIC;
 	iosock->port = port;
+	iosock->activity = iotimer_now; // connect timeout starts here (includes dns lookups)
 	if(ssl) {
 		iodescriptor->ssl = 1;
 		iosock->socket_flags |= IOSOCKETFLAG_SSLSOCKET;
+		
+		iosock->ssl_peer = strdup(hostname);
 	}
 	
-	if(bindhost) {
-		switch(iosocket_parse_address(bindhost, &iosock->bind.addr, flags)) {
-		case -1:
-			free(iosock);
+	// mark all lookups pending before starting them (lookups might finish synchronously and start the connect)
+	if(bindhost && !iosocket_parse_address(bindhost, &iosock->bind.addr, flags))
+		iosock->socket_flags |= IOSOCKETFLAG_PENDING_BINDDNS;
+	if(!iosocket_parse_address(hostname, &iosock->dest.addr, flags))
+		iosock->socket_flags |= IOSOCKETFLAG_PENDING_DESTDNS;
+	
+	if((iosock->socket_flags & (IOSOCKETFLAG_PENDING_BINDDNS | IOSOCKETFLAG_PENDING_DESTDNS)) == 0) {
+		/* valid addresses */
+		if(!iosocket_connect_schedule(iosock)) {
+			_free_socket(iosock);
+			ioslab_free(iodescriptor);
 			return NULL;
-		case 0:
-			/* start dns lookup */
-			iosock->socket_flags |= IOSOCKETFLAG_PENDING_BINDDNS;
-			iosocket_lookup_hostname(iosock, bindhost, flags, 1);
-			break;
-		case 1:
-			/* valid address */
-			break;
 		}
+		return iodescriptor;
 	}
-	switch(iosocket_parse_address(hostname, &iosock->dest.addr, flags)) {
-	case -1:
-		free(iosock);
-		return NULL;
-	case 0:
-		/* start dns lookup */
-		iosock->socket_flags |= IOSOCKETFLAG_PENDING_DESTDNS;
+	/* start dns lookups */
+	if((iosock->socket_flags & IOSOCKETFLAG_PENDING_BINDDNS))
+		iosocket_lookup_hostname(iosock, bindhost, flags, 1);
+	if((iosock->socket_flags & IOSOCKETFLAG_PENDING_DESTDNS) && iodescriptor->iosocket == iosock)
 		iosocket_lookup_hostname(iosock, hostname, flags, 0);
-		break;
-	case 1:
-		/* valid address */
-		break;
-	}
-	if((iosock->socket_flags & (IOSOCKETFLAG_PENDING_BINDDNS | IOSOCKETFLAG_PENDING_DESTDNS)) == 0) {
-		iosocket_connect_finish(iosock);
-	}
 	return iodescriptor;
 }
 
@@ -739,15 +1150,13 @@ struct IOSocket *iosocket_listen(const char *hostname, unsigned int port, iosock
 }
 
 struct IOSocket *iosocket_listen_flags(const char *hostname, unsigned int port, iosocket_callback *callback, int flags) {
-	struct IOSocket *iodescriptor = calloc(1, sizeof(*iodescriptor));
-	if(!iodescriptor) {
-		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocket in %s:%d", __FILE__, __LINE__);
+	struct IOSocket *iodescriptor = iosocket_create_descriptor();
+	if(!iodescriptor)
 		return NULL;
-	}
 	
 	struct _IOSocket *iosock = _create_socket();
 	if(!iosock) {
-		free(iodescriptor);
+		ioslab_free(iodescriptor);
 		return NULL;
 	}
 	
@@ -757,23 +1166,23 @@ struct IOSocket *iosocket_listen_flags(const char *hostname, unsigned int port,
 	iodescriptor->callback = callback;
 	iosock->parent = iodescriptor;
 	iosock->socket_flags |= IOSOCKETFLAG_PARENT_PUBLIC | IOSOCKETFLAG_LISTENING;
+	if((flags & IOSOCKET_REUSEPORT))
+		iosock->socket_flags |= IOSOCKETFLAG_REUSEPORT;
 	iosock->port = port;
+	iosock->backlog = (flags >> 16) & IOSOCKET_BACKLOG_MAX;
 	
 	switch(iosocket_parse_address(hostname, &iosock->bind.addr, flags)) {
-	case -1:
-		free(iosock);
-		return NULL;
 	case 0:
-		/* start dns lookup */
+		/* start dns lookup (the socket is set up by the lookup callback) */
 		iosock->socket_flags |= IOSOCKETFLAG_PENDING_BINDDNS;
 		iosocket_lookup_hostname(iosock, hostname, flags, 1);
 		break;
 	case 1:
 		/* valid address */
-		break;
-	}
-	if((iosock->socket_flags & IOSOCKETFLAG_PENDING_BINDDNS) == 0) {
+		if(iosock->bind.addr.address->sa_family == AF_INET6)
+			iosock->socket_flags |= IOSOCKETFLAG_IPV6SOCKET;
 		iosocket_listen_finish(iosock);
+		break;
 	}
 	return iodescriptor;
 }
@@ -783,14 +1192,59 @@ struct IOSocket *iosocket_listen_ssl(const char *hostname, unsigned int port, co
 }
 
 struct IOSocket *iosocket_listen_ssl_flags(const char *hostname, unsigned int port, const char *certfile, const char *keyfile, iosocket_callback *callback, int flags) {
+	return iosocket_listen_ssl_sessions(hostname, port, certfile, keyfile, callback, flags, IOSSL_SERVER_CACHE_SIZE, IOSSL_SERVER_CACHE_TIMEOUT, 1);
+}
+
+struct IOSocket *iosocket_listen_ssl_sessions(const char *hostname, unsigned int port, const char *certfile, const char *keyfile, iosocket_callback *callback, int flags, int cache_size, int cache_timeout, int tickets) {
 	struct IOSocket *iosocket = iosocket_listen_flags(hostname, port, callback, flags);
 	struct _IOSocket *iosock = iosocket->iosocket;
+	if(cache_size < 0)
+		cache_size = 0;
+	if(cache_timeout <= 0)
+		cache_timeout = IOSSL_SERVER_CACHE_TIMEOUT;
 	iosock->socket_flags |= IOSOCKETFLAG_SSLSOCKET;
-	iossl_listen(iosock, certfile, keyfile);
+	iossl_listen(iosock, certfile, keyfile, cache_size, cache_timeout, tickets);
 	return iosocket;
 }
 
 void iosocket_close(struct IOSocket *iosocket) {
+	iosocket_close_linger(iosocket, IOSOCKET_LINGER_TIMEOUT, 0);
+}
+
+static void iosocket_close_finish(struct _IOSocket *iosock) {
+	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
+		iossl_disconnect(iosock);
+	if(iosock->fd)
+		close(iosock->fd);
+	_free_socket(iosock);
+}
+
+static int iosocket_linger_shutdown(struct _IOSocket *iosock) {
+	// write queue is empty: close right away or send FIN and wait for the peer to close its side
+	if(!(iosock->socket_flags & IOSOCKETFLAG_LINGER_SHUTDOWN) || (iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
+		return 1;
+	#ifdef WIN32
+	if(shutdown(iosock->fd, SD_SEND) < 0)
+	#else
+	if(shutdown(iosock->fd, SHUT_WR) < 0)
+	#endif
+		return 1;
+	return 0;
+}
+
+static int iosocket_set_timer(struct _IOSocket *iosock, unsigned int msec) {
+	if(!iosock->timer) {
+		iosock->timer = _create_timer(NULL);
+		if(!iosock->timer)
+			return 0;
+		iosock->timer->parent = iosock;
+		iosock->timer->flags |= IOTIMERFLAG_PARENT_SOCKET;
+	}
+	_start_timer(iosock->timer, msec);
+	return 1;
+}
+
+void iosocket_close_linger(struct IOSocket *iosocket, int linger_msec, int flags) {
 	struct _IOSocket *iosock = iosocket->iosocket;
 	if(iosock == NULL) {
 		iolog_trigger(IOLOG_WARNING, "called iosocket_close for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
@@ -798,31 +1252,216 @@ void iosocket_close(struct IOSocket *iosocket) {
 	}
 	
 	iosock->socket_flags |= IOSOCKETFLAG_SHUTDOWN;
+	iosocket->iosocket = NULL;
+	iosocket->status = IOSOCKET_CLOSED;
+	iogc_add_callback(iosocket, iosocket_free_descriptor);
+	
+	//the public descriptor is gone now - the socket is flushed (if needed) and closed in the background
+	iosock->socket_flags &= ~(IOSOCKETFLAG_PARENT_PUBLIC | IOSOCKETFLAG_OVERRIDE_WANT_RW | IOSOCKETFLAG_OVERRIDE_WANT_R | IOSOCKETFLAG_OVERRIDE_WANT_W);
+	iosock->parent = NULL;
+	if(flags & IOSOCKET_CLOSE_SHUTDOWN)
+		iosock->socket_flags |= IOSOCKETFLAG_LINGER_SHUTDOWN;
+	
+	if(linger_msec <= 0 || !(iosock->socket_flags & IOSOCKETFLAG_ACTIVE) || (iosock->socket_flags & (IOSOCKETFLAG_LISTENING | IOSOCKETFLAG_CONNECTING | IOSOCKETFLAG_DEAD | IOSOCKETFLAG_SSL_HANDSHAKE | IOSOCKETFLAG_SSL_READHS | IOSOCKETFLAG_SSL_WRITEHS))) {
+		iosocket_close_finish(iosock);
+		return;
+	}
+	if(iosocket_try_write(iosock) < 0 || (!iosock->writeq.first && iosocket_linger_shutdown(iosock))) {
+		iosocket_close_finish(iosock);
+		return;
+	}
 	
-	if(iosock->writebuf.bufpos) {
-		//try to send everything before closing
-#if defined(F_GETFL)
-		{
-			int flags;
-			flags = fcntl(iosock->fd, F_GETFL);
-			fcntl(iosock->fd, F_SETFL, flags & ~O_NONBLOCK);
-			flags = fcntl(iosock->fd, F_GETFD);
-			fcntl(iosock->fd, F_SETFD, flags|FD_CLOEXEC);
+	if(!iosocket_set_timer(iosock, linger_msec)) {
+		iosocket_close_finish(iosock);
+		return;
+	}
+	iosock->socket_flags |= IOSOCKETFLAG_LINGER;
+	iosocket_update(iosock);
+}
+
+static int iosocket_is_connecting(struct _IOSocket *iosock) {
+	// outgoing connection that has not been established yet (dns lookup, connect or ssl handshake)
+	if((iosock->socket_flags & (IOSOCKETFLAG_PENDING_BINDDNS | IOSOCKETFLAG_PENDING_DESTDNS | IOSOCKETFLAG_CONNECTING)))
+		return 1;
+	return ((iosock->socket_flags & (IOSOCKETFLAG_SSL_HANDSHAKE | IOSOCKETFLAG_INCOMING)) == IOSOCKETFLAG_SSL_HANDSHAKE);
+}
+
+static unsigned int iosocket_remaining(struct timeval *since, unsigned int msec) {
+	long elapsed = (iotimer_now.tv_sec - since->tv_sec) * 1000 + (iotimer_now.tv_usec - since->tv_usec) / 1000;
+	if(elapsed >= (long) msec)
+		return 0;
+	return msec - elapsed;
+}
+
+static void iosocket_timer_update(struct _IOSocket *iosock) {
+	// arm the socket timer for the earliest timeout. deadlines are checked when it fires, so
+	// moving iosock->activity (every read) doesn't need to touch the timer heap
+	unsigned int timeout = 0, remaining;
+	int armed = 0;
+	if(iosocket_connect_pending(iosock))
+		armed = 1; // start connecting right away
+	else if(iosocket_is_connecting(iosock)) {
+		if(iosock->connect_timeout) {
+			timeout = iosocket_remaining(&iosock->activity, iosock->connect_timeout);
+			armed = 1;
+		}
+		if(iosock->race && iosock->race->next_candidate < iosock->race->candidate_count) {
+			remaining = iosocket_remaining(&iosock->race->last_attempt, IOSOCKET_CONNECT_DELAY);
+			if(!armed || remaining < timeout)
+				timeout = remaining;
+			armed = 1;
+		}
+	} else if(iosock->idle_timeout && !(iosock->socket_flags & IOSOCKETFLAG_LISTENING)) {
+		timeout = iosocket_remaining(&iosock->activity, iosock->idle_timeout);
+		armed = 1;
+	}
+	if(armed)
+		iosocket_set_timer(iosock, timeout);
+	else if(iosock->timer)
+		_stop_timer(iosock->timer);
+}
+
+static void iosocket_timeout(struct _IOSocket *iosock) {
+	struct IOSocket *iosocket = iosock->parent;
+	struct IOSocketEvent callback_event;
+	callback_event.socket = iosocket;
+	callback_event.data.errid = ETIMEDOUT;
+	if(iosocket_is_connecting(iosock)) {
+		iolog_trigger(IOLOG_DEBUG, "connect timeout (%d msec) on socket (fd: %d)", iosock->connect_timeout, iosock->fd);
+		callback_event.type = IOSOCKETEVENT_NOTCONNECTED;
+	} else {
+		iolog_trigger(IOLOG_DEBUG, "idle timeout (%d msec) on socket (fd: %d)", iosock->idle_timeout, iosock->fd);
+		callback_event.type = IOSOCKETEVENT_CLOSED;
+	}
+	iosock->socket_flags |= IOSOCKETFLAG_DEAD;
+	iosocket_trigger_event(&callback_event);
+	if(iosocket->iosocket == iosock)
+		iosocket_close(iosocket);
+}
+
+void iosocket_timer_callback(struct _IOSocket *iosock) {
+	if((iosock->socket_flags & IOSOCKETFLAG_LINGER)) {
+		iolog_trigger(IOLOG_DEBUG, "linger timeout on closed socket (fd: %d), dropping %d bytes", iosock->fd, iosock->writeq.pending);
+		iosocket_close_finish(iosock);
+		return;
+	}
+	if(!(iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC))
+		return;
+	if(iosocket_connect_pending(iosock)) {
+		iosocket_connect_start(iosock);
+		return;
+	}
+	if(iosocket_is_connecting(iosock)) {
+		if(iosock->connect_timeout && !iosocket_remaining(&iosock->activity, iosock->connect_timeout)) {
+			iosocket_timeout(iosock);
+			return;
+		}
+		if(iosock->race && iosock->race->next_candidate < iosock->race->candidate_count && !iosocket_remaining(&iosock->race->last_attempt, IOSOCKET_CONNECT_DELAY)) {
+			// no attempt succeeded within IOSOCKET_CONNECT_DELAY: race the next address
+			iosocket_connect_next(iosock);
+			return;
+		}
+	} else if(iosock->idle_timeout && !iosocket_remaining(&iosock->activity, iosock->idle_timeout)) {
+		iosocket_timeout(iosock);
+		return;
+	}
+	iosocket_timer_update(iosock);
+}
+
+void iosocket_set_connect_timeout(struct IOSocket *iosocket, int msec) {
+	struct _IOSocket *iosock = iosocket->iosocket;
+	if(iosock == NULL) {
+		iolog_trigger(IOLOG_WARNING, "called iosocket_set_connect_timeout for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
+		return;
+	}
+	iosock->connect_timeout = (msec > 0 ? msec : 0);
+	iosocket_timer_update(iosock);
+}
+
+void iosocket_set_idle_timeout(struct IOSocket *iosocket, int msec) {
+	struct _IOSocket *iosock = iosocket->iosocket;
+	if(iosock == NULL) {
+		iolog_trigger(IOLOG_WARNING, "called iosocket_set_idle_timeout for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
+		return;
+	}
+	iosock->idle_timeout = (msec > 0 ? msec : 0);
+	iosocket_timer_update(iosock);
+}
+
+int iosocket_add_ssl_profile(const char *name, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile) {
+	if(!name)
+		return 0;
+	return iossl_add_profile(name, ciphers, cafile, certfile, keyfile);
+}
+
+int iosocket_set_ssl_profile(struct IOSocket *iosocket, const char *name) {
+	struct _IOSocket *iosock = iosocket->iosocket;
+	if(iosock == NULL) {
+		iolog_trigger(IOLOG_WARNING, "called iosocket_set_ssl_profile for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	if(!(iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET) || iosock->sslnode) {
+		iolog_trigger(IOLOG_WARNING, "called iosocket_set_ssl_profile for IOSocket without pending SSL handshake in %s:%d", __FILE__, __LINE__);
+		return 0;
+	}
+	struct IOSSLProfile *profile = iossl_get_profile(name);
+	if(!profile) {
+		iolog_trigger(IOLOG_ERROR, "unknown SSL profile: %s", name);
+		return 0;
+	}
+	if(iosock->ssl_profile)
+		iossl_release_profile(iosock->ssl_profile);
+	iosock->ssl_profile = profile;
+	return 1;
+}
+
+static int iosocket_recv(struct _IOSocket *iosock, char *buffer, int len) {
+	int bytes;
+	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET) && !(iosock->ssl_ktls & IOSSL_KTLS_RECV))
+		return iossl_read(iosock, buffer, len);
+	if(engine->recv && (iosocket_engine_io(iosock) & IOSOCKET_ENGINE_RECV))
+		return engine->recv(iosock, buffer, len);
+	bytes = recv(iosock->fd, buffer, len, 0);
+	#ifdef EIO
+	if(bytes < 0 && errno == EIO && (iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
+		bytes = iossl_read(iosock, buffer, len); // kernel TLS: the next record is no application data (let the ssl backend handle it)
+	#endif
+	return bytes;
+}
+
+static void iosocket_linger_callback(struct _IOSocket *iosock, int readable, int writeable) {
+	if(readable) {
+		// nobody is interested in incoming data anymore - discard it until the peer closes the connection
+		char buffer[1024];
+		int bytes;
+		do {
+			bytes = iosocket_recv(iosock, buffer, sizeof(buffer));
+			if(bytes == 0) {
+				iosocket_close_finish(iosock);
+				return;
+			} else if(bytes < 0) {
+				#ifdef WIN32
+				int errcode = WSAGetLastError();
+				#else
+				int errcode = errno;
+				#endif
+				if(errcode != EAGAIN && errcode != EWOULDBLOCK) {
+					iosocket_close_finish(iosock);
+					return;
+				}
+			}
+		} while(bytes > 0 && (iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED));
+	}
+	if(writeable && iosock->writeq.first) {
+		if(iosocket_try_write(iosock) < 0) {
+			iosocket_close_finish(iosock);
+			return;
+		}
+		if(!iosock->writeq.first && iosocket_linger_shutdown(iosock)) {
+			iosocket_close_finish(iosock);
+			return;
 		}
-#else
-		iosocket_deactivate(iosock);
-#endif
-		iosocket_try_write(iosock);
 	}
-	//close IOSocket
-	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
-		iossl_disconnect(iosock);
-	if(iosock->fd)
-		close(iosock->fd);
-	_free_socket(iosock);
-	iosocket->iosocket = NULL;
-	iosocket->status = IOSOCKET_CLOSED;
-	iogc_add(iosocket);
 }
 
 struct IODNSAddress *iosocket_get_remote_addr(struct IOSocket *iosocket) {
@@ -851,51 +1490,259 @@ struct IODNSAddress *iosocket_get_local_addr(struct IOSocket *iosocket) {
 	return &iosock->bind.addr;
 }
 
-static int iosocket_try_write(struct _IOSocket *iosock) {
-	if(!iosock->writebuf.bufpos && !(iosock->socket_flags & IOSOCKETFLAG_SSL_WRITEHS)) 
+static void iosocket_writeq_append(struct _IOSocket *iosock, struct IOSocketWriteChunk *chunk) {
+	chunk->next = NULL;
+	if(iosock->writeq.last)
+		iosock->writeq.last->next = chunk;
+	else
+		iosock->writeq.first = chunk;
+	iosock->writeq.last = chunk;
+	iosock->writeq.pending += chunk->len;
+}
+
+static char *iosocket_writeq_reserve(struct _IOSocket *iosock, size_t datalen) {
+	struct IOSocketWriteChunk *chunk = iosock->writeq.last;
+	if(chunk && chunk->size && chunk->size - chunk->len >= datalen) {
+		// append to the last chunk
+		char *data = chunk->data + chunk->len;
+		chunk->len += datalen;
+		iosock->writeq.pending += datalen;
+		return data;
+	}
+	size_t size = (datalen > IOSOCKET_WRITE_CHUNK_SIZE ? datalen : IOSOCKET_WRITE_CHUNK_SIZE);
+	chunk = malloc(sizeof(*chunk) + size);
+	if(!chunk) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocketWriteChunk in %s:%d", __FILE__, __LINE__);
+		return NULL;
+	}
+	chunk->data = (char *) (chunk + 1);
+	chunk->len = datalen;
+	chunk->pos = 0;
+	chunk->size = size;
+	chunk->free_callback = NULL;
+	chunk->free_data = NULL;
+	iosocket_writeq_append(iosock, chunk);
+	return chunk->data;
+}
+
+static int iosocket_writeq_add_external(struct _IOSocket *iosock, char *data, size_t datalen, void (*free_callback)(void *free_data), void *free_data) {
+	struct IOSocketWriteChunk *chunk = ioslab_alloc(&iosocket_chunk_slab);
+	if(!chunk) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocketWriteChunk in %s:%d", __FILE__, __LINE__);
 		return 0;
-	iolog_trigger(IOLOG_DEBUG, "write writebuf (%d bytes) to socket (fd: %d)", iosock->writebuf.bufpos, iosock->fd);
-	int res;
-	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
-		res = iossl_write(iosock, iosock->writebuf.buffer, iosock->writebuf.bufpos);
+	}
+	chunk->data = data;
+	chunk->len = datalen;
+	chunk->pos = 0;
+	chunk->size = 0;
+	chunk->free_callback = free_callback;
+	chunk->free_data = free_data;
+	iosocket_writeq_append(iosock, chunk);
+	return 1;
+}
+
+static void iosocket_writeq_free_chunk(struct IOSocketWriteChunk *chunk) {
+	if(chunk->free_callback)
+		chunk->free_callback(chunk->free_data);
+	if(chunk->size)
+		free(chunk);
 	else
-		res = send(iosock->fd, iosock->writebuf.buffer, iosock->writebuf.bufpos, 0);
-	if(res < 0) {
-		if (errno != EAGAIN && errno != EWOULDBLOCK)
-			iolog_trigger(IOLOG_ERROR, "could not write to socket (fd: %d): %d - %s", iosock->fd, errno, strerror(errno));
+		ioslab_free(chunk); // external chunk: just a header pointing into foreign data
+}
+
+static void iosocket_writeq_consume(struct _IOSocket *iosock, size_t bytes) {
+	struct IOSocketWriteChunk *chunk;
+	iosock->writeq.pending -= bytes;
+	while((chunk = iosock->writeq.first)) {
+		if(bytes < chunk->len - chunk->pos) {
+			chunk->pos += bytes;
+			break;
+		}
+		bytes -= chunk->len - chunk->pos;
+		iosock->writeq.first = chunk->next;
+		if(!chunk->next)
+			iosock->writeq.last = NULL;
+		iosocket_writeq_free_chunk(chunk);
+	}
+}
+
+void iosocket_writeq_release(struct IOSocketWriteQueue *writeq) {
+	struct IOSocketWriteChunk *chunk, *next_chunk;
+	for(chunk = writeq->first; chunk; chunk = next_chunk) {
+		next_chunk = chunk->next;
+		iosocket_writeq_free_chunk(chunk);
+	}
+	writeq->first = NULL;
+	writeq->last = NULL;
+	writeq->pending = 0;
+}
+
+static void iosocket_writeq_clear(struct _IOSocket *iosock) {
+	iosocket_writeq_release(&iosock->writeq);
+}
+
+static int iosocket_writeq_send(struct _IOSocket *iosock) {
+	struct IOSocketWriteChunk *chunk = iosock->writeq.first;
+	if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET) && !(iosock->ssl_ktls & IOSSL_KTLS_SEND)) {
+		if(!chunk)
+			return iossl_write(iosock, NULL, 0); // continue rehandshake
+		// the last chunk might have grown since an interrupted write: retry with the length of the first attempt
+		int len = (iosock->ssl_retry_len ? iosock->ssl_retry_len : chunk->len - chunk->pos);
+		int res = iossl_write(iosock, chunk->data + chunk->pos, len);
+		if(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			iosock->ssl_retry_len = len;
 		else
-			res = 0;
-	} else {
-		iosock->writebuf.bufpos -= res;
-		if((iosock->socket_flags & (IOSOCKETFLAG_ACTIVE | IOSOCKETFLAG_SHUTDOWN)) == IOSOCKETFLAG_ACTIVE)
-			engine->update(iosock);
+			iosock->ssl_retry_len = 0;
+		return res;
 	}
-	return res;
+	if(engine->send && (iosocket_engine_io(iosock) & IOSOCKET_ENGINE_SEND))
+		return engine->send(iosock); // the engine sends straight from the writeq
+	#ifdef WIN32
+	return send(iosock->fd, chunk->data + chunk->pos, chunk->len - chunk->pos, 0);
+	#else
+	struct iovec iov[IOSOCKET_WRITEV_MAX];
+	int count;
+	for(count = 0; chunk && count < IOSOCKET_WRITEV_MAX; chunk = chunk->next, count++) {
+		iov[count].iov_base = chunk->data + chunk->pos;
+		iov[count].iov_len = chunk->len - chunk->pos;
+	}
+	return writev(iosock->fd, iov, count);
+	#endif
+}
+
+static int iosocket_try_write(struct _IOSocket *iosock) {
+	if(!iosock->writeq.first && !(iosock->socket_flags & IOSOCKETFLAG_SSL_WRITEHS)) 
+		return 0;
+	iolog_trigger(IOLOG_DEBUG, "write writeq (%d bytes) to socket (fd: %d)", iosock->writeq.pending, iosock->fd);
+	int res, written = 0;
+	do {
+		res = iosocket_writeq_send(iosock);
+		if(res < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				iolog_trigger(IOLOG_ERROR, "could not write to socket (fd: %d): %d - %s", iosock->fd, errno, strerror(errno));
+				return res;
+			}
+			break;
+		} else if(res == 0)
+			break;
+		written += res;
+		iosocket_writeq_consume(iosock, res);
+	} while(iosock->writeq.first && (iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED)); // edge triggered sockets need to write until EAGAIN
+	if((iosock->socket_flags & (IOSOCKETFLAG_ACTIVE | IOSOCKETFLAG_EDGE_TRIGGERED)) == IOSOCKETFLAG_ACTIVE)
+		iosocket_update(iosock);
+	return written;
+}
+
+static int iosocket_edge_writeable(struct _IOSocket *iosock) {
+	// edge triggered sockets won't get another EPOLLOUT event while the socket stays writeable
+	if(!(iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED))
+		return 0;
+	if((iosock->socket_flags & (IOSOCKETFLAG_CONNECTING | IOSOCKETFLAG_SSL_HANDSHAKE | IOSOCKETFLAG_SHUTDOWN | IOSOCKETFLAG_DEAD)))
+		return 0;
+	return (iosock->writeq.first ? 1 : 0);
 }
 
 void iosocket_send(struct IOSocket *iosocket, const char *data, size_t datalen) {
+	struct IOSocketVector vector;
+	vector.data = data;
+	vector.datalen = datalen;
+	iosocket_sendv(iosocket, &vector, 1);
+}
+
+void iosocket_sendv(struct IOSocket *iosocket, const struct IOSocketVector *vector, int count) {
 	struct _IOSocket *iosock = iosocket->iosocket;
 	if(iosock == NULL) {
-		iolog_trigger(IOLOG_WARNING, "called iosocket_close for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
+		iolog_trigger(IOLOG_WARNING, "called iosocket_send for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
 		return;
 	}
 	if(iosock->socket_flags & IOSOCKETFLAG_SHUTDOWN) {
 		iolog_trigger(IOLOG_ERROR, "could not write to socket (socket is closing)");
 		return;
 	}
-	iolog_trigger(IOLOG_DEBUG, "add %d to writebuf (fd: %d): %s", datalen, iosock->fd, data);
-	if(iosock->writebuf.buflen < iosock->writebuf.bufpos + datalen) {
-		iolog_trigger(IOLOG_DEBUG, "increase writebuf (curr: %d) to %d (+%d bytes)", iosock->writebuf.buflen, iosock->writebuf.bufpos + datalen, (iosock->writebuf.bufpos + datalen - iosock->writebuf.buflen));
-		iosocket_increase_buffer(&iosock->writebuf, iosock->writebuf.bufpos + datalen);
-		if(iosock->writebuf.buflen < iosock->writebuf.bufpos + datalen) {
-			iolog_trigger(IOLOG_ERROR, "increase writebuf (curr: %d) to %d (+%d bytes) FAILED", iosock->writebuf.buflen, iosock->writebuf.bufpos + datalen, (iosock->writebuf.bufpos + datalen - iosock->writebuf.buflen));
-			return;
-		}
+	size_t datalen = 0;
+	int i;
+	for(i = 0; i < count; i++)
+		datalen += vector[i].datalen;
+	if(!datalen)
+		return;
+	iolog_trigger(IOLOG_DEBUG, "add %d bytes to writeq (fd: %d)", datalen, iosock->fd);
+	char *buffer = iosocket_writeq_reserve(iosock, datalen);
+	if(!buffer)
+		return;
+	for(i = 0; i < count; i++) {
+		memcpy(buffer, vector[i].data, vector[i].datalen);
+		buffer += vector[i].datalen;
 	}
-	memcpy(iosock->writebuf.buffer + iosock->writebuf.bufpos, data, datalen);
-	iosock->writebuf.bufpos += datalen;
-	if((iosock->socket_flags & IOSOCKETFLAG_ACTIVE))
-		engine->update(iosock);
+	iosocket_update(iosock);
+}
+
+void iosocket_send_owned(struct IOSocket *iosocket, void *data, size_t datalen, iosocket_data_free *free_callback) {
+	struct _IOSocket *iosock = iosocket->iosocket;
+	if(!free_callback)
+		free_callback = free;
+	if(iosock == NULL) {
+		iolog_trigger(IOLOG_WARNING, "called iosocket_send_owned for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
+		free_callback(data);
+		return;
+	}
+	if(iosock->socket_flags & IOSOCKETFLAG_SHUTDOWN) {
+		iolog_trigger(IOLOG_ERROR, "could not write to socket (socket is closing)");
+		free_callback(data);
+		return;
+	}
+	if(!datalen || !iosocket_writeq_add_external(iosock, data, datalen, free_callback, data)) {
+		free_callback(data);
+		return;
+	}
+	iolog_trigger(IOLOG_DEBUG, "add %d bytes (owned) to writeq (fd: %d)", datalen, iosock->fd);
+	iosocket_update(iosock);
+}
+
+struct IOSocketSharedBuffer *iosocket_shared_create(const char *data, size_t datalen) {
+	struct IOSocketSharedBuffer *buffer = malloc(sizeof(*buffer) + datalen);
+	if(!buffer) {
+		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOSocketSharedBuffer in %s:%d", __FILE__, __LINE__);
+		return NULL;
+	}
+	buffer->data = (char *) (buffer + 1);
+	buffer->datalen = datalen;
+	buffer->refcount = 1;
+	if(data)
+		memcpy(buffer->data, data, datalen);
+	return buffer;
+}
+
+struct IOSocketSharedBuffer *iosocket_shared_retain(struct IOSocketSharedBuffer *buffer) {
+	__atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+	return buffer;
+}
+
+void iosocket_shared_release(struct IOSocketSharedBuffer *buffer) {
+	if(__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(buffer);
+}
+
+static void iosocket_shared_chunk_free(void *free_data) {
+	iosocket_shared_release(free_data);
+}
+
+void iosocket_send_shared(struct IOSocket *iosocket, struct IOSocketSharedBuffer *buffer) {
+	struct _IOSocket *iosock = iosocket->iosocket;
+	if(iosock == NULL) {
+		iolog_trigger(IOLOG_WARNING, "called iosocket_send_shared for destroyed IOSocket in %s:%d", __FILE__, __LINE__);
+		return;
+	}
+	if(iosock->socket_flags & IOSOCKETFLAG_SHUTDOWN) {
+		iolog_trigger(IOLOG_ERROR, "could not write to socket (socket is closing)");
+		return;
+	}
+	if(!buffer->datalen)
+		return;
+	if(!iosocket_writeq_add_external(iosock, buffer->data, buffer->datalen, iosocket_shared_chunk_free, buffer))
+		return;
+	iosocket_shared_retain(buffer);
+	iolog_trigger(IOLOG_DEBUG, "add %d bytes (shared) to writeq (fd: %d)", buffer->datalen, iosock->fd);
+	iosocket_update(iosock);
 }
 
 void iosocket_write(struct IOSocket *iosocket, const char *line) {
@@ -918,6 +1765,8 @@ void iosocket_printf(struct IOSocket *iosocket, const char *text, ...) {
 
 
 int iosocket_wants_reads(struct _IOSocket *iosock) {
+	if(iosock->ssl_job)
+		return 0;
 	if((iosock->socket_flags & (IOSOCKETFLAG_SSL_READHS | IOSOCKETFLAG_SSL_WRITEHS)))
 		return ((iosock->socket_flags & IOSOCKETFLAG_SSL_WANTWRITE) ? 0 : 1);
 	if(!(iosock->socket_flags & IOSOCKETFLAG_OVERRIDE_WANT_RW))
@@ -926,11 +1775,25 @@ int iosocket_wants_reads(struct _IOSocket *iosock) {
 		return 1;
 	return 0;
 }
+
+int iosocket_engine_io(struct _IOSocket *iosock) {
+	// plain TCP sockets only: SSL, connecting, dns & wakeup sockets are polled for readiness
+	if((iosock->socket_flags & IOSOCKETFLAG_LISTENING))
+		return ((iosock->socket_flags & IOSOCKETFLAG_PARENT_PUBLIC) ? IOSOCKET_ENGINE_ACCEPT : 0);
+	if((iosock->socket_flags & (IOSOCKETFLAG_SSLSOCKET | IOSOCKETFLAG_CONNECTING)))
+		return 0;
+	if(!(iosock->socket_flags & (IOSOCKETFLAG_PARENT_PUBLIC | IOSOCKETFLAG_SHUTDOWN | IOSOCKETFLAG_LINGER)))
+		return 0; // (stays set until the socket is freed: the engine might still be sending)
+	return IOSOCKET_ENGINE_RECV | IOSOCKET_ENGINE_SEND;
+}
+
 int iosocket_wants_writes(struct _IOSocket *iosock) {
+	if(iosock->ssl_job)
+		return 0;
 	if((iosock->socket_flags & (IOSOCKETFLAG_SSL_READHS | IOSOCKETFLAG_SSL_WRITEHS)))
 		return ((iosock->socket_flags & IOSOCKETFLAG_SSL_WANTWRITE) ? 1 : 0);
 	if(!(iosock->socket_flags & IOSOCKETFLAG_OVERRIDE_WANT_RW)) {
-		if(iosock->writebuf.bufpos || (iosock->socket_flags & IOSOCKETFLAG_CONNECTING))
+		if(iosock->writeq.first || (iosock->socket_flags & IOSOCKETFLAG_CONNECTING))
 			return 1;
 		else
 			return 0;
@@ -953,6 +1816,7 @@ void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writea
 		struct IOSocketEvent callback_event;
 		callback_event.type = IOSOCKETEVENT_IGNORE;
 		callback_event.socket = iosocket;
+		int ssl_established = 0;
 		
 		if((iosock->socket_flags & IOSOCKETFLAG_SSL_HANDSHAKE)) {
 			if(readable || writeable) {
@@ -960,20 +1824,18 @@ void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writea
 					iossl_server_handshake(iosock);
 				else
 					iossl_client_handshake(iosock);
-				engine->update(iosock);
+				iosocket_update(iosock);
 			} else if((iosock->socket_flags & IOSOCKETFLAG_LISTENING)) {
 				//TODO: SSL init error
 			} else if((iosock->socket_flags & IOSOCKETFLAG_INCOMING)) {
 				if((iosock->socket_flags & IOSOCKETFLAG_SSL_ESTABLISHED)) {
 					//incoming SSL connection accepted
 					iosock->socket_flags &= ~IOSOCKETFLAG_SSL_HANDSHAKE;
+					ssl_established = 1;
 					callback_event.type = IOSOCKETEVENT_ACCEPT;
 					callback_event.data.accept_socket = iosock->parent;
 					struct _IOSocket *parent_socket = iosocket->data;
 					callback_event.socket = parent_socket->parent;
-					
-					//initialize readbuf
-					iosocket_increase_buffer(&iosock->readbuf, 1024);
 				} else {
 					//incoming SSL connection failed, simply drop
 					iosock->socket_flags |= IOSOCKETFLAG_DEAD;
@@ -984,11 +1846,11 @@ void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writea
 				if((iosock->socket_flags & IOSOCKETFLAG_SSL_ESTABLISHED)) {
 					iosocket->status = IOSOCKET_CONNECTED;
 					iosock->socket_flags &= ~IOSOCKETFLAG_SSL_HANDSHAKE;
+					ssl_established = 1;
 					callback_event.type = IOSOCKETEVENT_CONNECTED;
-					engine->update(iosock);
-					
-					//initialize readbuf
-					iosocket_increase_buffer(&iosock->readbuf, 1024);
+					iosocket_update(iosock);
+					iosock->activity = iotimer_now; // idle timeout starts now
+					iosocket_timer_update(iosock);
 				} else {
 					callback_event.type = IOSOCKETEVENT_NOTCONNECTED;
 					iosock->socket_flags |= IOSOCKETFLAG_DEAD;
@@ -996,53 +1858,67 @@ void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writea
 			}
 		} else if((iosock->socket_flags & IOSOCKETFLAG_LISTENING)) {
 			if(readable) {
-				//new client connected
-				struct _IOSocket *new_iosock = iosocket_accept_client(iosock);
-				if(!new_iosock)
-					return;
-				
-				if(!(new_iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET)) {
+				//new clients connected: accept until EAGAIN (limited to keep the loop responsive)
+				int accepted;
+				for(accepted = 0; accepted < IOSOCKET_ACCEPT_BATCH; accepted++) {
+					struct _IOSocket *new_iosock = iosocket_accept_client(iosock);
+					if(!new_iosock)
+						break;
+					if((new_iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
+						continue; // accept event is triggered after the ssl handshake
+					
 					callback_event.type = IOSOCKETEVENT_ACCEPT;
 					callback_event.data.accept_socket = new_iosock->parent;
+					iosocket_trigger_event(&callback_event);
+					callback_event.type = IOSOCKETEVENT_IGNORE;
+					if(iosocket->iosocket != iosock)
+						return; // listener has been closed by the callback
 				}
 			}
 			
 		} else if((iosock->socket_flags & IOSOCKETFLAG_CONNECTING)) {
-			if(readable) { //could not connect
-				if((iosock->socket_flags & (IOSOCKETFLAG_IPV6SOCKET | IOSOCKETFLAG_RECONNECT_IPV4)) == (IOSOCKETFLAG_IPV6SOCKET | IOSOCKETFLAG_RECONNECT_IPV4)) {
-					iolog_trigger(IOLOG_DEBUG, "connecting to IPv6 host (%s) failed. trying to connect using IPv4.", iosock->dest.addrlookup->hostname);
-					iosocket_deactivate(iosock);
-					if(iosocket_lookup_apply(iosock, 1)) { //if ret=0 an error occured in iosocket_lookup_apply and we should stop here.
-						iosocket_connect_finish(iosock);
-						socket_lookup_clear(iosock);
-					}
-				} else {
-					callback_event.type = IOSOCKETEVENT_NOTCONNECTED;
-					/*
-					socklen_t arglen = sizeof(callback_event.data.errid);
-					if (getsockopt(iosock->fd, SOL_SOCKET, SO_ERROR, &callback_event.data.errid, &arglen) < 0)
-						callback_event.data.errid = errno;
-					*/
-					iosock->socket_flags |= IOSOCKETFLAG_DEAD;
+			int pending_data = 0;
+			if(readable && writeable) {
+				// the peer might have sent data right after accepting the connection
+				int sockerr = 0;
+				socklen_t sockerrlen = sizeof(sockerr);
+				if(getsockopt(iosock->fd, SOL_SOCKET, SO_ERROR, (char *) &sockerr, &sockerrlen) == 0 && sockerr == 0) {
+					readable = 0;
+					pending_data = 1;
 				}
+			}
+			if(readable) { //could not connect
+				callback_event.type = IOSOCKETEVENT_NOTCONNECTED;
+				socklen_t arglen = sizeof(callback_event.data.errid);
+				if (getsockopt(iosock->fd, SOL_SOCKET, SO_ERROR, (char *) &callback_event.data.errid, &arglen) < 0)
+					callback_event.data.errid = errno;
+				iosock->socket_flags |= IOSOCKETFLAG_DEAD;
 			} else if(writeable) { //connection established
 				iosock->socket_flags &= ~IOSOCKETFLAG_CONNECTING;
 				socket_lookup_clear(iosock);
 				if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET)) {
 					iolog_trigger(IOLOG_DEBUG, "SSL client socket connected. Stating SSL handshake...");
 					iossl_connect(iosock);
-					engine->update(iosock);
+					iosocket_update(iosock);
 					return;
 				}
 				iosocket->status = IOSOCKET_CONNECTED;
 				
 				callback_event.type = IOSOCKETEVENT_CONNECTED;
-				engine->update(iosock);
+				iosocket_update(iosock);
+				iosock->activity = iotimer_now; // idle timeout starts now
+				iosocket_timer_update(iosock);
 				
 				iosocket_update_parent(iosock);
 				
-				//initialize readbuf
-				iosocket_increase_buffer(&iosock->readbuf, 1024);
+				if(pending_data && (iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED)) {
+					// there will be no further read event for the data that is already pending
+					iosocket_trigger_event(&callback_event);
+					if(iosocket->iosocket != iosock)
+						return; // socket has been closed by the callback
+					iosocket_events_callback(iosock, 1, 0);
+					return;
+				}
 			}
 		} else {
 			int ssl_rehandshake = 0;
@@ -1055,93 +1931,110 @@ void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writea
 			iosocketevents_callback_retry_read:
 			if((readable && ssl_rehandshake == 0) || ssl_rehandshake == 1) {
 				int bytes;
-				if(iosock->readbuf.buflen - iosock->readbuf.bufpos <= 128) {
+				size_t parsepos;
+				if(iosock->readbuf.readpos >= iosock->readbuf.bufpos) {
+					// everything consumed (or reset by the callback)
+					iosock->readbuf.bufpos = 0;
+					iosock->readbuf.readpos = 0;
+				}
+				if(iosock->readbuf.buflen - iosock->readbuf.bufpos <= 128 && iosock->readbuf.readpos) {
+					// reached the end of the buffer: move the unprocessed rest to the front
+					iolog_trigger(IOLOG_DEBUG, "compact readbuf (%d bytes consumed, %d bytes rest)", iosock->readbuf.readpos, iosock->readbuf.bufpos - iosock->readbuf.readpos);
+					memmove(iosock->readbuf.buffer, iosock->readbuf.buffer + iosock->readbuf.readpos, iosock->readbuf.bufpos - iosock->readbuf.readpos);
+					iosock->readbuf.bufpos -= iosock->readbuf.readpos;
+					iosock->readbuf.readpos = 0;
+				}
+				if(!iosock->readbuf.buflen) {
+					iosocket_increase_buffer(&iosock->readbuf, IOSOCKET_READBUF_SIZE);
+				} else if(iosock->readbuf.buflen - iosock->readbuf.bufpos <= 128) {
 					int addsize;
 					if(iosock->readbuf.buflen >= 2048)
 						addsize = 1024;
 					else
 						addsize = iosock->readbuf.buflen;
-					if(addsize == 0) {
-						iolog_trigger(IOLOG_WARNING, "readbuf length is 0 when trying to read from fd %d", iosock->fd);
-						addsize = 512;
-					}
 					iosocket_increase_buffer(&iosock->readbuf, iosock->readbuf.buflen + addsize);
 				}
-				if((iosock->socket_flags & IOSOCKETFLAG_SSLSOCKET))
-					bytes = iossl_read(iosock, iosock->readbuf.buffer + iosock->readbuf.bufpos, iosock->readbuf.buflen - iosock->readbuf.bufpos);
-				else 
-					bytes = recv(iosock->fd, iosock->readbuf.buffer + iosock->readbuf.bufpos, iosock->readbuf.buflen - iosock->readbuf.bufpos, 0);
+				parsepos = iosock->readbuf.bufpos; // data in front of bufpos has already been scanned for delimiters
+				bytes = iosocket_recv(iosock, iosock->readbuf.buffer + iosock->readbuf.bufpos, iosock->readbuf.buflen - iosock->readbuf.bufpos);
 				
 				if(bytes <= 0) {
 					int errcode;
-					#ifdef WIN32
-					errcode = WSAGetLastError();
-					#else
-					errcode = errno;
-					#endif
+					if(bytes == 0)
+						errcode = 0; // connection closed by peer
+					else {
+						#ifdef WIN32
+						errcode = WSAGetLastError();
+						#else
+						errcode = errno;
+						#endif
+					}
 					if((iosock->socket_flags & (IOSOCKETFLAG_SSLSOCKET | IOSOCKETFLAG_SSL_READHS)) == (IOSOCKETFLAG_SSLSOCKET | IOSOCKETFLAG_SSL_READHS)) {
 						ssl_rehandshake = 1;
-					} else if (errcode != EAGAIN && errcode != EWOULDBLOCK) {
+					} else if (bytes == 0 || (errcode != EAGAIN && errcode != EWOULDBLOCK)) {
 						iosock->socket_flags |= IOSOCKETFLAG_DEAD;
 						
 						callback_event.type = IOSOCKETEVENT_CLOSED;
 						callback_event.data.errid = errcode;
 					}
 				} else {
-					int i;
 					iolog_trigger(IOLOG_DEBUG, "received %d bytes (fd: %d). readbuf position: %d", bytes, iosock->fd, iosock->readbuf.bufpos);
 					iosock->readbuf.bufpos += bytes;
-					int retry_read = (iosock->readbuf.bufpos == iosock->readbuf.buflen);
+					iosock->activity = iotimer_now;
+					int retry_read = (iosock->readbuf.bufpos == iosock->readbuf.buflen || (iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED));
 					callback_event.type = IOSOCKETEVENT_RECV;
 					
 					if(iosocket->parse_delimiter) {
-						int j, used_bytes = 0;
-						for(i = 0; i < iosock->readbuf.bufpos; i++) {
-							int is_delimiter = 0;
-							for(j = 0; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++) {
-								if(iosock->readbuf.buffer[i] == iosocket->delimiters[j]) {
-									is_delimiter = 1;
-									break;
-								}
-							}
-							if(is_delimiter) {
-								iosock->readbuf.buffer[i] = 0;
-								callback_event.data.recv_str = iosock->readbuf.buffer + used_bytes;
-								iolog_trigger(IOLOG_DEBUG, "parsed line (%d bytes): %s", i - used_bytes, iosock->readbuf.buffer + used_bytes);
-								used_bytes = i+1;
-								if(iosock->readbuf.buffer[i-1] != 0 || iosocket->parse_empty)
-									iosocket_trigger_event(&callback_event);
-							}
+						struct IOSocketBuffer *readbuf = &iosock->readbuf;
+						size_t pos = parsepos;
+						while(pos < readbuf->bufpos) {
+							pos += iosocket_scan_delimiters(iosocket->delimiters, readbuf->buffer + pos, readbuf->bufpos - pos);
 							#ifdef IOSOCKET_PARSE_LINE_LIMIT
-							else if(i + 1 - used_bytes >= IOSOCKET_PARSE_LINE_LIMIT) {
-								iosock->readbuf.buffer[i] = 0;
-								callback_event.data.recv_str = iosock->readbuf.buffer + used_bytes;
-								iolog_trigger(IOLOG_DEBUG, "parsed and stripped line (%d bytes): %s", i - used_bytes, iosock->readbuf.buffer + used_bytes);
-								for(; i < iosock->readbuf.bufpos; i++) { //skip the rest of the line
-									is_delimiter = 0;
-									if(iosock->readbuf.buffer[i] == iosocket->delimiters[j])
-										break;
-								}
-								used_bytes = i+1;
+							if(pos - readbuf->readpos >= IOSOCKET_PARSE_LINE_LIMIT) {
+								size_t limit = readbuf->readpos + IOSOCKET_PARSE_LINE_LIMIT - 1;
+								readbuf->buffer[limit] = 0;
+								callback_event.data.recv_str = readbuf->buffer + readbuf->readpos;
+								iolog_trigger(IOLOG_DEBUG, "parsed and stripped line (%d bytes): %s", limit - readbuf->readpos, readbuf->buffer + readbuf->readpos);
+								readbuf->readpos = ++pos; //skip the rest of the line
 								iosocket_trigger_event(&callback_event);
+								if(iosocket->iosocket != iosock)
+									return; // socket has been closed by the callback
+								continue;
 							}
 							#endif
+							if(pos == readbuf->bufpos)
+								break; // no delimiter in the received data
+							readbuf->buffer[pos] = 0;
+							callback_event.data.recv_str = readbuf->buffer + readbuf->readpos;
+							iolog_trigger(IOLOG_DEBUG, "parsed line (%d bytes): %s", pos - readbuf->readpos, readbuf->buffer + readbuf->readpos);
+							if(pos > readbuf->readpos || iosocket->parse_empty) {
+								readbuf->readpos = ++pos;
+								iosocket_trigger_event(&callback_event);
+								if(iosocket->iosocket != iosock)
+									return; // socket has been closed by the callback
+							} else
+								readbuf->readpos = ++pos;
 						}
-						if(used_bytes) {
-							if(used_bytes == iosock->readbuf.bufpos) {
-								iosock->readbuf.bufpos = 0;
-								iolog_trigger(IOLOG_DEBUG, "readbuf fully processed (set buffer position to 0)");
-							} else {
-								iolog_trigger(IOLOG_DEBUG, "readbuf rest: %d bytes (used %d bytes)", iosock->readbuf.bufpos - used_bytes, used_bytes);
-								memmove(iosock->readbuf.buffer, iosock->readbuf.buffer + used_bytes, iosock->readbuf.bufpos - used_bytes);
-								iosock->readbuf.bufpos -= used_bytes;
-							}
-						}
+						if(readbuf->readpos >= readbuf->bufpos) {
+							readbuf->bufpos = 0;
+							readbuf->readpos = 0;
+							iolog_trigger(IOLOG_DEBUG, "readbuf fully processed (set buffer position to 0)");
+						} else
+							iolog_trigger(IOLOG_DEBUG, "readbuf rest: %d bytes", readbuf->bufpos - readbuf->readpos);
 						callback_event.type = IOSOCKETEVENT_IGNORE;
 					} else
 						callback_event.data.recv_buf = &iosock->readbuf;
-					if(retry_read)
+					if(retry_read) {
+						if((iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED)) {
+							// drain the socket until EAGAIN, but pass each chunk to the callback
+							if(callback_event.type != IOSOCKETEVENT_IGNORE) {
+								iosocket_trigger_event(&callback_event);
+								callback_event.type = IOSOCKETEVENT_IGNORE;
+							}
+							if(iosocket->iosocket != iosock)
+								return; // socket has been closed by the callback
+						}
 						goto iosocketevents_callback_retry_read;
+					}
 				}
 			}
 			if((writeable && ssl_rehandshake == 0) || ssl_rehandshake == 2) {
@@ -1159,16 +2052,30 @@ void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writea
 				}
 			}
 			if(ssl_rehandshake) {
-				engine->update(iosock);
+				iosocket_update(iosock);
 			}
 		}
-		if(callback_event.type != IOSOCKETEVENT_IGNORE)
+		if(callback_event.type != IOSOCKETEVENT_IGNORE) {
 			iosocket_trigger_event(&callback_event);
+			if(iosocket->iosocket != iosock)
+				return; // socket has been closed by the callback
+		}
+		if(ssl_established && (iosock->socket_flags & IOSOCKETFLAG_EDGE_TRIGGERED)) {
+			// data sent along with the last handshake flight won't cause another read event
+			iosocket_events_callback(iosock, 1, 0);
+			return;
+		}
 		if((iosock->socket_flags & IOSOCKETFLAG_DEAD))
 			iosocket_close(iosocket);
 		
+	} else if((iosock->socket_flags & IOSOCKETFLAG_PARENT_SOCKET)) {
+		iosocket_connect_attempt_callback(iosock, readable, writeable);
+	} else if((iosock->socket_flags & IOSOCKETFLAG_LINGER)) {
+		iosocket_linger_callback(iosock, readable, writeable);
 	} else if((iosock->socket_flags & IOSOCKETFLAG_PARENT_DNSENGINE)) {
 		iodns_socket_callback(iosock, readable, writeable);
+	} else if((iosock->socket_flags & IOSOCKETFLAG_PARENT_LOOP)) {
+		iohandler_wakeup_callback(iosock);
 	}
 }
 
@@ -23,6 +23,7 @@
 struct IOSocketBuffer {
 	char *buffer;
 	size_t bufpos, buflen;
+	size_t readpos; /* read cursor: buffer + readpos up to bufpos is unprocessed (consumed data is skipped, not moved) */
 };
 
 #ifndef _IOHandler_internals
@@ -33,29 +34,38 @@ struct _IOSocket;
 struct IOSocket;
 struct IOSocketBuffer;
 struct IOSSLDescriptor;
+struct _IOTimerDescriptor;
 struct _IODNSQuery;
 struct IODNSEvent;
 
 struct IOEngine {
 	const char *name;
 	int (*init)(void);
-	void (*add)(struct _IOSocket *iosock);
+	int (*add)(struct _IOSocket *iosock); /* returns 0 if the socket could not be registered */
 	void (*remove)(struct _IOSocket *iosock);
 	void (*update)(struct _IOSocket *iosock);
 	void (*loop)(struct timeval *timeout);
 	void (*cleanup)(void);
+	/* optional: completion based engines perform accept, recv & send on their own (see iosocket_engine_io) */
+	int (*accept)(struct _IOSocket *iosock, struct sockaddr *addr, socklen_t *addrlen); /* accepted fd or -1 (EAGAIN: none accepted yet) */
+	int (*recv)(struct _IOSocket *iosock, char *buffer, int len); /* received data, 0 on EOF or -1 (EAGAIN: none received yet) */
+	int (*send)(struct _IOSocket *iosock); /* bytes of the writeq sent by the last send request or -1 (EAGAIN: still sending) */
 };
 
 /* IO Engines */
 extern struct IOEngine engine_select; /* select system call (should always be useable) */
 extern struct IOEngine engine_kevent;
 extern struct IOEngine engine_epoll;
+extern struct IOEngine engine_uring; /* io_uring (linux >= 5.11) */
 extern struct IOEngine engine_win32;
+extern struct IOEngine engine_poll; /* poll system call (fallback without FD_SETSIZE limit) */
 
 
-/* _IOSocket linked list */
-extern struct _IOSocket *iosocket_first;
-extern struct _IOSocket *iosocket_last;
+extern int iosocket_edge_triggered;
+
+/* active _IOSockets (compact array, order changes when sockets are deactivated) */
+extern IOTHREAD_LOCAL struct _IOSocket **iosocket_active;
+extern IOTHREAD_LOCAL int iosocket_active_count;
 
 /* _IOSocket socket_flags */
 #define IOSOCKETFLAG_ACTIVE           0x00000001
@@ -65,7 +75,6 @@ extern struct _IOSocket *iosocket_last;
 #define IOSOCKETFLAG_CONNECTING       0x00000010
 #define IOSOCKETFLAG_SHUTDOWN         0x00000020 /* disconnect pending */
 #define IOSOCKETFLAG_DEAD             0x00000040 /* socket dead (disconnected) */
-#define IOSOCKETFLAG_RECONNECT_IPV4   0x00000080 /* possible fallback to ipv4 connect if ipv6 fails */
 
 /* DNS Flags */
 #define IOSOCKETFLAG_PENDING_BINDDNS  0x00000100
@@ -89,11 +98,32 @@ extern struct _IOSocket *iosocket_last;
 
 /* _IOSocket socket_flags */
 #define IOSOCKETFLAG_DYNAMIC_BIND     0x00400000
+#define IOSOCKETFLAG_EDGE_TRIGGERED   0x00800000 /* registered edge triggered (read & write until EAGAIN) */
+#define IOSOCKETFLAG_UPDATE_PENDING   0x01000000 /* queued in the dirty list (engine update deferred) */
+#define IOSOCKETFLAG_REUSEPORT        0x02000000 /* listen with SO_REUSEPORT (one listener per event loop) */
+#define IOSOCKETFLAG_LINGER           0x04000000 /* closed: flushing the write queue before the fd is closed */
+#define IOSOCKETFLAG_LINGER_SHUTDOWN  0x08000000 /* closed: send FIN after flushing and wait for the peer to close */
 
 /* Parent descriptors */
 #define IOSOCKETFLAG_PARENT_PUBLIC    0x10000000
 #define IOSOCKETFLAG_PARENT_DNSENGINE 0x20000000
-/* reserved flags for additional descriptor types? */
+#define IOSOCKETFLAG_PARENT_LOOP      0x40000000 /* loop wakeup descriptor (eventfd / pipe) */
+#define IOSOCKETFLAG_PARENT_SOCKET    0x80000000 /* connection attempt of a connecting _IOSocket (happy eyeballs) */
+
+/* write queue (chunks are sent with writev, external data is never copied) */
+struct IOSocketWriteChunk {
+	struct IOSocketWriteChunk *next;
+	char *data;
+	size_t len, pos; /* payload length / bytes already sent */
+	size_t size; /* capacity of copied data (0: external data) */
+	void (*free_callback)(void *free_data); /* external data: called after the data has been sent (or dropped) */
+	void *free_data;
+};
+
+struct IOSocketWriteQueue {
+	struct IOSocketWriteChunk *first, *last;
+	size_t pending; /* unsent bytes in queue */
+};
 
 struct IOSocketDNSLookup {
 	unsigned int bindlookup : 1;
@@ -103,6 +133,16 @@ struct IOSocketDNSLookup {
 	struct IODNSResult *result;
 };
 
+/* parallel connection attempts (RFC 8305): candidates alternate between IPv6 and IPv4 */
+struct IOSocketConnectRace {
+	struct IODNSAddress **candidates; /* destination addresses (point into the dns results) */
+	struct _IOSocket **attempts; /* attempts in progress */
+	int candidate_count, next_candidate;
+	int attempt_count;
+	int last_error; /* errno of the last failed attempt */
+	struct timeval last_attempt;
+};
+
 struct _IOSocket {
 	int fd;
 	
@@ -118,31 +158,58 @@ struct _IOSocket {
 	} dest;
 	
 	unsigned int port : 16;
+	unsigned int backlog : 16; /* listening sockets only (0 = SOMAXCONN) */
 	
 	struct IOSocketBuffer readbuf;
-	struct IOSocketBuffer writebuf;
+	struct IOSocketWriteQueue writeq;
 	
 	struct IOSSLDescriptor *sslnode;
+	char *ssl_peer; /* destination hostname of outgoing SSL sockets (SNI, verification & session cache) */
+	struct IOSSLProfile *ssl_profile; /* set by iosocket_set_ssl_profile until the handshake starts */
+	unsigned int ssl_ktls : 2; /* IOSSL_KTLS_SEND / IOSSL_KTLS_RECV (set after the handshake) */
+	struct IOSSLHandshakeJob *ssl_job; /* handshake step running on a worker thread (no events meanwhile) */
+	int ssl_retry_len; /* length of an interrupted SSL write (must be retried with the same arguments) */
 	
+	void *engine_data;
 	void *parent;
+	struct _IOTimerDescriptor *timer;
+	struct IOSocketConnectRace *race; /* pending connection attempts (if IOSOCKETFLAG_CONNECTING is set) */
+	unsigned int connect_timeout, idle_timeout; /* msec (0 = disabled) */
+	struct timeval activity; /* connect start / last received data (monotonic) */
 	
-	struct _IOSocket *next, *prev;
+	int active_index; /* position in iosocket_active (if IOSOCKETFLAG_ACTIVE is set) */
+	struct _IOSocket *dirty_next;
 };
 
 void _init_sockets();
+void _stop_sockets(); /* close all sockets & release the engine of the current thread */
 struct _IOSocket *_create_socket();
 void _free_socket(struct _IOSocket *iosock);
-void iosocket_activate(struct _IOSocket *iosock);
+int iosocket_activate(struct _IOSocket *iosock); /* returns 0 if the socket could not be watched */
 void iosocket_deactivate(struct _IOSocket *iosock);
 void iosocket_update(struct _IOSocket *iosock);
+struct _IOSocket *iosocket_get_by_fd(int fd); /* active sockets only */
+void iosocket_flush_updates();
 
 void iosocket_loop(int usec);
 void iosocket_lookup_callback(struct IOSocketDNSLookup *lookup, struct IODNSEvent *event);
 void iosocket_events_callback(struct _IOSocket *iosock, int readable, int writeable);
+void iosocket_timer_callback(struct _IOSocket *iosock);
 
 int iosocket_wants_reads(struct _IOSocket *iosock);
 int iosocket_wants_writes(struct _IOSocket *iosock);
 
+#define IOSOCKET_ENGINE_ACCEPT 0x01
+#define IOSOCKET_ENGINE_RECV   0x02
+#define IOSOCKET_ENGINE_SEND   0x04
+int iosocket_engine_io(struct _IOSocket *iosock); /* operations the engine may perform on its own */
+void iosocket_writeq_release(struct IOSocketWriteQueue *writeq); /* free a write queue taken over by the engine */
+
+/* IOSocketScanner.c */
+size_t iosocket_scan_delimiters(const unsigned char *delimiters, const char *buffer, size_t len); /* offset of the first delimiter (len if there is none) */
+const char *iosocket_scan_name(); /* selected scanner implementation */
+void iosocket_scan_init(); /* select the scanner (process wide initialization) */
+
 #endif
 
 struct IOSocketEvent;
@@ -150,6 +217,21 @@ struct IOSocketEvent;
 #define IOSOCKET_CALLBACK(NAME) void NAME(struct IOSocketEvent *event)
 typedef IOSOCKET_CALLBACK(iosocket_callback);
 
+#define IOSOCKET_DATA_FREE(NAME) void NAME(void *data)
+typedef IOSOCKET_DATA_FREE(iosocket_data_free);
+
+struct IOSocketVector {
+	const char *data;
+	size_t datalen;
+};
+
+/* refcounted buffer for sending the same data to many sockets (each write queue only holds a reference) */
+struct IOSocketSharedBuffer {
+	char *data; /* must not be modified after it has been passed to iosocket_send_shared */
+	size_t datalen;
+	unsigned int refcount;
+};
+
 enum IOSocketStatus { 
 	IOSOCKET_CLOSED, /* descriptor is dead (socket waiting for removal or timer) */
 	IOSOCKET_LISTENING, /* descriptor is waiting for connections (server socket) */
@@ -160,7 +242,7 @@ enum IOSocketStatus {
 
 enum IOSocketEventType {
 	IOSOCKETEVENT_IGNORE,
-	IOSOCKETEVENT_RECV, /* client socket received something (read_lines == 1  =>  recv_str valid;  read_lines == 0  =>  recv_buf valid) */
+	IOSOCKETEVENT_RECV, /* client socket received something (read_lines == 1  =>  recv_str valid;  read_lines == 0  =>  recv_buf valid: advance readpos or reset bufpos after processing) */
 	IOSOCKETEVENT_CONNECTED, /* client socket connected successful */
 	IOSOCKETEVENT_NOTCONNECTED, /* client socket could not connect (errid valid) */
 	IOSOCKETEVENT_CLOSED, /* client socket lost connection (errid valid) */
@@ -171,6 +253,11 @@ enum IOSocketEventType {
 #define IOSOCKET_ADDR_IPV4 0x01
 #define IOSOCKET_ADDR_IPV6 0x02 /* overrides IOSOCKET_ADDR_IPV4 */
 #define IOSOCKET_PROTO_UDP 0x04
+#define IOSOCKET_REUSEPORT 0x08 /* listen only: share the port with other event loops (SO_REUSEPORT) */
+#define IOSOCKET_BACKLOG_MAX 0x7fff
+#define IOSOCKET_BACKLOG(n) ((((n) > IOSOCKET_BACKLOG_MAX) ? IOSOCKET_BACKLOG_MAX : (((n) < 0) ? 0 : (n))) << 16) /* listen only: listen backlog (default: SOMAXCONN, larger values are clamped to IOSOCKET_BACKLOG_MAX) */
+
+#define IOSOCKET_CLOSE_SHUTDOWN 0x01 /* iosocket_close_linger: send FIN after flushing and wait for the peer to close */
 
 #if !defined IOSOCKET_CPP
 struct IOSocket {
@@ -208,10 +295,28 @@ struct IOSocket *iosocket_listen(const char *hostname, unsigned int port, iosock
 struct IOSocket *iosocket_listen_flags(const char *hostname, unsigned int port, iosocket_callback *callback, int flags);
 struct IOSocket *iosocket_listen_ssl(const char *hostname, unsigned int port, const char *certfile, const char *keyfile, iosocket_callback *callback);
 struct IOSocket *iosocket_listen_ssl_flags(const char *hostname, unsigned int port, const char *certfile, const char *keyfile, iosocket_callback *callback, int flags);
+struct IOSocket *iosocket_listen_ssl_sessions(const char *hostname, unsigned int port, const char *certfile, const char *keyfile, iosocket_callback *callback, int flags, int cache_size, int cache_timeout, int tickets); /* cache_size: max. cached sessions (0: no cache), cache_timeout: sec (0: IOSSL_SERVER_CACHE_TIMEOUT), tickets: issue session tickets */
 void iosocket_write(struct IOSocket *iosocket, const char *line);
 void iosocket_send(struct IOSocket *iosocket, const char *data, size_t datalen);
+void iosocket_sendv(struct IOSocket *iosocket, const struct IOSocketVector *vector, int count); /* gather write (copies all vectors into the write queue at once) */
+void iosocket_send_owned(struct IOSocket *iosocket, void *data, size_t datalen, iosocket_data_free *free_callback); /* takes ownership of data & sends it without copying. free_callback (NULL: free) is called after it has been sent */
+void iosocket_send_shared(struct IOSocket *iosocket, struct IOSocketSharedBuffer *buffer); /* queues a reference to buffer (no copy) */
+struct IOSocketSharedBuffer *iosocket_shared_create(const char *data, size_t datalen); /* single allocation, refcount 1. data is copied (NULL: left uninitialized for the caller to fill) */
+struct IOSocketSharedBuffer *iosocket_shared_retain(struct IOSocketSharedBuffer *buffer);
+void iosocket_shared_release(struct IOSocketSharedBuffer *buffer); /* thread safe, frees the buffer with the last reference */
 void iosocket_printf(struct IOSocket *iosocket, const char *text, ...);
-void iosocket_close(struct IOSocket *iosocket);
+void iosocket_close(struct IOSocket *iosocket); /* pending data is flushed in the background (for up to IOSOCKET_LINGER_TIMEOUT msec) */
+void iosocket_close_linger(struct IOSocket *iosocket, int linger_msec, int flags); /* linger_msec = 0: drop pending data & close immediately */
+void iosocket_set_connect_timeout(struct IOSocket *iosocket, int msec); /* IOSOCKETEVENT_NOTCONNECTED (ETIMEDOUT) if not connected msec after iosocket_connect (0: disabled) */
+void iosocket_set_idle_timeout(struct IOSocket *iosocket, int msec); /* IOSOCKETEVENT_CLOSED (ETIMEDOUT) if nothing has been received for msec (0: disabled) */
+
+/* client SSL profiles: contexts shared by all outgoing SSL sockets that use them.
+ * ciphers is backend specific (GnuTLS priority string / OpenSSL cipher list), NULL for the defaults.
+ * with a cafile the peer certificate & hostname are verified. "default" is used by sockets without a profile.
+ * re-adding a profile replaces it for new connections. returns 0 on error
+ */
+int iosocket_add_ssl_profile(const char *name, const char *ciphers, const char *cafile, const char *certfile, const char *keyfile);
+int iosocket_set_ssl_profile(struct IOSocket *iosocket, const char *name); /* call right after iosocket_connect. returns 0 for unknown profiles */
 
 struct IODNSAddress *iosocket_get_remote_addr(struct IOSocket *iosocket);
 struct IODNSAddress *iosocket_get_local_addr(struct IOSocket *iosocket);
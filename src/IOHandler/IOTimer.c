@@ -19,14 +19,35 @@
 #include "IOHandler.h"
 #include "IOTimer.h"
 #include "IOLog.h"
+#include "IOSockets.h"
 
 #include <sys/time.h>
 #include <stdlib.h>
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 
 static void _rearrange_timer(struct _IOTimerDescriptor *timer);
 static void _autoreload_timer(struct _IOTimerDescriptor *timer);
+static void _read_clock(struct timeval *now);
+static struct timeval _wall_to_monotonic(struct timeval *walltime);
+static struct timeval _monotonic_to_wall(struct timeval *timeout);
 
-struct _IOTimerDescriptor *iotimer_sorted_descriptors;
+/* use the coarse clock if it is at least as precise as the engines' millisecond timeouts */
+#define IOTIMER_COARSE_MAX_RESOLUTION 1000000 /* ns */
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+static clockid_t iotimer_clock_id = CLOCK_MONOTONIC;
+#endif
+IOTHREAD_LOCAL struct timeval iotimer_now;
+
+#define IOTIMER_HEAP_INITIAL_SIZE 64
+
+IOTHREAD_LOCAL struct _IOTimerDescriptor **iotimer_heap = NULL;
+IOTHREAD_LOCAL unsigned int iotimer_heap_count = 0;
+static IOTHREAD_LOCAL unsigned int iotimer_heap_size = 0;
+static IOTHREAD_LOCAL unsigned int iotimer_heap_sequence = 0;
 
 /* public functions */
 
@@ -36,7 +57,10 @@ struct IOTimerDescriptor *iotimer_create(struct timeval *timeout) {
 		iolog_trigger(IOLOG_ERROR, "could not allocate memory for IOTimerDescriptor in %s:%d", __FILE__, __LINE__);
 		return NULL;
 	}
-	struct _IOTimerDescriptor *timer = _create_timer(timeout);
+	struct timeval mtimeout;
+	if(timeout)
+		mtimeout = _wall_to_monotonic(timeout);
+	struct _IOTimerDescriptor *timer = _create_timer(timeout ? &mtimeout : NULL);
 	if(!timer) {
 		free(descriptor);
 		return NULL;
@@ -95,9 +119,7 @@ void iotimer_set_autoreload(struct IOTimerDescriptor *descriptor, struct timeval
 		timer->autoreload = *autoreload;
 		
 		if(timer->timeout.tv_sec == 0 && timer->timeout.tv_usec == 0) {
-			struct timeval now;
-			gettimeofday(&now, NULL);
-			timer->timeout = now;
+			timer->timeout = iotimer_now;
 			_autoreload_timer(timer);
 		}
 	} else {
@@ -134,7 +156,26 @@ void iotimer_set_timeout(struct IOTimerDescriptor *descriptor, struct timeval *t
 		iolog_trigger(IOLOG_WARNING, "called iotimer_set_timeout without timeout given in %s:%d", __FILE__, __LINE__);
 		return;
 	}
-	timer->timeout = *timeout;
+	timer->timeout = _wall_to_monotonic(timeout);
+	_rearrange_timer(timer);
+}
+
+void iotimer_set_relative_timeout(struct IOTimerDescriptor *descriptor, struct timeval *timeout) {
+	struct _IOTimerDescriptor *timer = descriptor->iotimer;
+	if(timer == NULL) {
+		iolog_trigger(IOLOG_WARNING, "called iotimer_set_relative_timeout for destroyed IOTimerDescriptor in %s:%d", __FILE__, __LINE__);
+		return;
+	}
+	if(!timeout) {
+		iolog_trigger(IOLOG_WARNING, "called iotimer_set_relative_timeout without timeout given in %s:%d", __FILE__, __LINE__);
+		return;
+	}
+	timer->timeout.tv_sec = iotimer_now.tv_sec + timeout->tv_sec;
+	timer->timeout.tv_usec = iotimer_now.tv_usec + timeout->tv_usec;
+	if(timer->timeout.tv_usec >= 1000000) {
+		timer->timeout.tv_sec += (timer->timeout.tv_usec / 1000000);
+		timer->timeout.tv_usec %= 1000000;
+	}
 	_rearrange_timer(timer);
 }
 
@@ -147,7 +188,7 @@ struct timeval iotimer_get_timeout(struct IOTimerDescriptor *descriptor) {
 		tout.tv_usec = 0;
 		return tout;
 	}
-	return timer->timeout;
+	return _monotonic_to_wall(&timer->timeout);
 }
 
 void iotimer_set_callback(struct IOTimerDescriptor *descriptor, iotimer_callback *callback) {
@@ -180,7 +221,84 @@ void iotimer_destroy(struct IOTimerDescriptor *descriptor) {
 
 /* internal functions */
 void _init_timers() {
-	//nothing in here
+	#if defined(CLOCK_MONOTONIC_COARSE)
+	struct timespec res;
+	if(clock_getres(CLOCK_MONOTONIC_COARSE, &res) == 0 && res.tv_sec == 0 && res.tv_nsec <= IOTIMER_COARSE_MAX_RESOLUTION)
+		iotimer_clock_id = CLOCK_MONOTONIC_COARSE;
+	#endif
+	iotimer_update_clock();
+}
+
+void _stop_timers() {
+	unsigned int i;
+	// timers still queued belong to their owners, only the heap of this thread is released
+	for(i = 0; i < iotimer_heap_count; i++)
+		iotimer_heap[i]->flags &= ~IOTIMERFLAG_IN_HEAP;
+	if(iotimer_heap)
+		free(iotimer_heap);
+	iotimer_heap = NULL;
+	iotimer_heap_count = 0;
+	iotimer_heap_size = 0;
+}
+
+static void _read_clock(struct timeval *now) {
+	#if defined(WIN32)
+	ULONGLONG msec = GetTickCount64();
+	now->tv_sec = msec / 1000;
+	now->tv_usec = (msec % 1000) * 1000;
+	#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	#if defined(CLOCK_MONOTONIC_COARSE)
+	clock_gettime(iotimer_clock_id, &ts);
+	#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	#endif
+	now->tv_sec = ts.tv_sec;
+	now->tv_usec = ts.tv_nsec / 1000;
+	#else
+	gettimeofday(now, NULL);
+	#endif
+}
+
+void iotimer_update_clock() {
+	_read_clock(&iotimer_now);
+}
+
+/* the public timer api takes wall clock timeouts (gettimeofday) */
+static struct timeval _wall_to_monotonic(struct timeval *walltime) {
+	struct timeval wallnow, now, timeout;
+	gettimeofday(&wallnow, NULL);
+	_read_clock(&now);
+	timeout.tv_sec = now.tv_sec + (walltime->tv_sec - wallnow.tv_sec);
+	timeout.tv_usec = now.tv_usec + (walltime->tv_usec - wallnow.tv_usec);
+	while(timeout.tv_usec < 0) {
+		timeout.tv_usec += 1000000;
+		timeout.tv_sec--;
+	}
+	while(timeout.tv_usec >= 1000000) {
+		timeout.tv_usec -= 1000000;
+		timeout.tv_sec++;
+	}
+	return timeout;
+}
+
+static struct timeval _monotonic_to_wall(struct timeval *timeout) {
+	struct timeval wallnow, now, walltime;
+	if(timeout->tv_sec == 0 && timeout->tv_usec == 0)
+		return *timeout; // not set
+	gettimeofday(&wallnow, NULL);
+	_read_clock(&now);
+	walltime.tv_sec = wallnow.tv_sec + (timeout->tv_sec - now.tv_sec);
+	walltime.tv_usec = wallnow.tv_usec + (timeout->tv_usec - now.tv_usec);
+	while(walltime.tv_usec < 0) {
+		walltime.tv_usec += 1000000;
+		walltime.tv_sec--;
+	}
+	while(walltime.tv_usec >= 1000000) {
+		walltime.tv_usec -= 1000000;
+		walltime.tv_sec++;
+	}
+	return walltime;
 }
 
 struct _IOTimerDescriptor *_create_timer(struct timeval *timeout) {
@@ -194,57 +312,114 @@ struct _IOTimerDescriptor *_create_timer(struct timeval *timeout) {
 	return timer;
 }
 
-static void _rearrange_timer(struct _IOTimerDescriptor *timer) {
-	if((timer->flags & IOTIMERFLAG_IN_LIST)) {
-		if(timer->prev == NULL)
-			iotimer_sorted_descriptors = timer->next;
-		else
-			timer->prev->next = timer->next;
-		if(timer->next != NULL)
-			timer->next->prev = timer->prev;
-		timer->flags &= ~IOTIMERFLAG_IN_LIST;
+static int _timer_expires_before(struct _IOTimerDescriptor *timer1, struct _IOTimerDescriptor *timer2) {
+	if(timeval_is_smaler(timer1->timeout, timer2->timeout))
+		return 1;
+	if(timeval_is_bigger(timer1->timeout, timer2->timeout))
+		return 0;
+	return ((int) (timer1->heap_sequence - timer2->heap_sequence) < 0);
+}
+
+static void _heap_set(unsigned int index, struct _IOTimerDescriptor *timer) {
+	iotimer_heap[index] = timer;
+	timer->heap_index = index;
+}
+
+static void _heap_sift_up(unsigned int index) {
+	struct _IOTimerDescriptor *timer = iotimer_heap[index];
+	while(index > 0) {
+		unsigned int parent = (index - 1) / 2;
+		if(!_timer_expires_before(timer, iotimer_heap[parent]))
+			break;
+		_heap_set(index, iotimer_heap[parent]);
+		index = parent;
 	}
-	if(!(timer->flags & IOTIMERFLAG_ACTIVE))
-		return;
-	struct _IOTimerDescriptor *ctimer;
-	for(ctimer = iotimer_sorted_descriptors; ctimer; ctimer = ctimer->next) {
-		if(timeval_is_bigger(ctimer->timeout, timer->timeout)) {
-			timer->next = ctimer;
-			timer->prev = ctimer->prev;
-			if(ctimer->prev)
-				ctimer->prev->next = timer;
-			else
-				iotimer_sorted_descriptors = timer;
-			ctimer->prev = timer;
+	_heap_set(index, timer);
+}
+
+static void _heap_sift_down(unsigned int index) {
+	struct _IOTimerDescriptor *timer = iotimer_heap[index];
+	while(1) {
+		unsigned int child = index * 2 + 1;
+		if(child >= iotimer_heap_count)
 			break;
-		}
-		else if(ctimer->next == NULL) {
-			ctimer->next = timer;
-			timer->prev = ctimer;
+		if(child + 1 < iotimer_heap_count && _timer_expires_before(iotimer_heap[child + 1], iotimer_heap[child]))
+			child++;
+		if(!_timer_expires_before(iotimer_heap[child], timer))
 			break;
+		_heap_set(index, iotimer_heap[child]);
+		index = child;
+	}
+	_heap_set(index, timer);
+}
+
+static void _heap_remove(struct _IOTimerDescriptor *timer) {
+	unsigned int index = timer->heap_index;
+	timer->flags &= ~IOTIMERFLAG_IN_HEAP;
+	iotimer_heap_count--;
+	if(index == iotimer_heap_count)
+		return;
+	// move the last timer into the gap and restore heap order
+	timer = iotimer_heap[iotimer_heap_count];
+	_heap_set(index, timer);
+	_heap_sift_up(index);
+	_heap_sift_down(timer->heap_index);
+}
+
+void _start_timer(struct _IOTimerDescriptor *timer, unsigned int msec) {
+	timer->timeout.tv_sec = iotimer_now.tv_sec + (msec / 1000);
+	timer->timeout.tv_usec = iotimer_now.tv_usec + (msec % 1000) * 1000;
+	if(timer->timeout.tv_usec >= 1000000) {
+		timer->timeout.tv_sec += (timer->timeout.tv_usec / 1000000);
+		timer->timeout.tv_usec %= 1000000;
+	}
+	timer->flags |= IOTIMERFLAG_ACTIVE;
+	_rearrange_timer(timer);
+}
+
+void _stop_timer(struct _IOTimerDescriptor *timer) {
+	timer->flags &= ~IOTIMERFLAG_ACTIVE;
+	_rearrange_timer(timer);
+}
+
+static void _rearrange_timer(struct _IOTimerDescriptor *timer) {
+	if(!(timer->flags & IOTIMERFLAG_ACTIVE)) {
+		if((timer->flags & IOTIMERFLAG_IN_HEAP))
+			_heap_remove(timer);
+		return;
+	}
+	timer->heap_sequence = iotimer_heap_sequence++;
+	if((timer->flags & IOTIMERFLAG_IN_HEAP)) {
+		// timeout changed: restore heap order
+		_heap_sift_up(timer->heap_index);
+		_heap_sift_down(timer->heap_index);
+		return;
+	}
+	if(iotimer_heap_count == iotimer_heap_size) {
+		unsigned int new_size = (iotimer_heap_size ? iotimer_heap_size * 2 : IOTIMER_HEAP_INITIAL_SIZE);
+		struct _IOTimerDescriptor **new_heap = realloc(iotimer_heap, new_size * sizeof(*new_heap));
+		if(!new_heap) {
+			iolog_trigger(IOLOG_ERROR, "could not allocate memory for timer heap in %s:%d", __FILE__, __LINE__);
+			return;
 		}
+		iotimer_heap = new_heap;
+		iotimer_heap_size = new_size;
 	}
-	if(ctimer == NULL)
-		iotimer_sorted_descriptors = timer;
-	timer->flags |= IOTIMERFLAG_IN_LIST;
+	_heap_set(iotimer_heap_count++, timer);
+	_heap_sift_up(timer->heap_index);
+	timer->flags |= IOTIMERFLAG_IN_HEAP;
 }
 
 void _destroy_timer(struct _IOTimerDescriptor *timer) {
-	if((timer->flags & IOTIMERFLAG_IN_LIST)) {
-		if(timer->prev == NULL)
-			iotimer_sorted_descriptors = timer->next;
-		else
-			timer->prev->next = timer->next;
-		if(timer->next != NULL)
-			timer->next->prev = timer->prev;
-	}
+	if((timer->flags & IOTIMERFLAG_IN_HEAP))
+		_heap_remove(timer);
 	free(timer);
 }
 
 static void _autoreload_timer(struct _IOTimerDescriptor *timer) {
 	timer->timeout.tv_usec += timer->autoreload.tv_usec;
 	timer->timeout.tv_sec += timer->autoreload.tv_sec;
-	if(timer->timeout.tv_usec > 1000000) {
+	if(timer->timeout.tv_usec >= 1000000) {
 		timer->timeout.tv_sec += (timer->timeout.tv_usec / 1000000);
 		timer->timeout.tv_usec %= 1000000;
 	}
@@ -252,19 +427,13 @@ static void _autoreload_timer(struct _IOTimerDescriptor *timer) {
 }
 
 void _trigger_timer() {
-	struct timeval now;
 	struct _IOTimerDescriptor *timer;
-	while(iotimer_sorted_descriptors) {
-		gettimeofday(&now, NULL);
-		
-		timer = iotimer_sorted_descriptors;
-		if(timeval_is_bigger(timer->timeout, now))
+	while(iotimer_heap_count) {
+		timer = iotimer_heap[0];
+		if(timeval_is_bigger(timer->timeout, iotimer_now))
 			break;
 		
-		iotimer_sorted_descriptors = timer->next;
-		if(timer->next != NULL)
-			timer->next->prev = timer->prev;
-		timer->flags &= ~IOTIMERFLAG_IN_LIST;
+		_heap_remove(timer);
 		
 		if((timer->flags & IOTIMERFLAG_PERIODIC))
 			_autoreload_timer(timer);
@@ -275,6 +444,8 @@ void _trigger_timer() {
 				descriptor->callback(descriptor);
 			if(!(timer->flags & IOTIMERFLAG_PERIODIC))
 				iotimer_destroy(descriptor);
+		} else if(timer->flags & IOTIMERFLAG_PARENT_SOCKET) {
+			iosocket_timer_callback(timer->parent); // the socket owns (and destroys) its timer
 		} else {
 			if(!(timer->flags & IOTIMERFLAG_PERIODIC))
 				_destroy_timer(timer);
@@ -24,27 +24,39 @@
 
 #define IOTIMERFLAG_PERIODIC       0x01
 #define IOTIMERFLAG_ACTIVE         0x02
-#define IOTIMERFLAG_IN_LIST        0x04
+#define IOTIMERFLAG_IN_HEAP        0x04
 #define IOTIMERFLAG_PARENT_PUBLIC  0x08
 #define IOTIMERFLAG_PARENT_SOCKET  0x10
 #define IOTIMERFLAG_PERSISTENT     0x20
 
 struct _IOTimerDescriptor;
 
-extern struct _IOTimerDescriptor *iotimer_sorted_descriptors;
+/* active timers: binary min heap ordered by timeout (iotimer_heap[0] expires first) */
+extern IOTHREAD_LOCAL struct _IOTimerDescriptor **iotimer_heap;
+extern IOTHREAD_LOCAL unsigned int iotimer_heap_count;
+
+#define iotimer_next_timer() (iotimer_heap_count ? iotimer_heap[0] : NULL)
+
+/* monotonic time of the current loop iteration (all internal timeouts are based on this clock) */
+extern IOTHREAD_LOCAL struct timeval iotimer_now;
+void iotimer_update_clock();
 
 struct _IOTimerDescriptor {
 	unsigned int flags : 8;
 	void *parent; 
 	
-	struct timeval timeout;
+	struct timeval timeout; /* monotonic */
 	struct timeval autoreload;
 	
-	struct _IOTimerDescriptor *prev, *next;
+	unsigned int heap_index;
+	unsigned int heap_sequence; /* insertion order for timers with equal timeouts */
 };
 
 void _init_timers();
+void _stop_timers();
 struct _IOTimerDescriptor *_create_timer(struct timeval *timeout);
+void _start_timer(struct _IOTimerDescriptor *timer, unsigned int msec); /* (re)arm internal timer to fire msec after iotimer_now */
+void _stop_timer(struct _IOTimerDescriptor *timer);
 void _destroy_timer(struct _IOTimerDescriptor *timer);
 void _trigger_timer();
 
@@ -69,6 +81,7 @@ int iotimer_state(struct IOTimerDescriptor *iotimer);
 void iotimer_set_autoreload(struct IOTimerDescriptor *iotimer, struct timeval *autoreload);
 struct timeval iotimer_get_autoreload(struct IOTimerDescriptor *iotimer);
 void iotimer_set_timeout(struct IOTimerDescriptor *iotimer, struct timeval *timeout);
+void iotimer_set_relative_timeout(struct IOTimerDescriptor *iotimer, struct timeval *timeout); /* timeout relative to iohandler_now() */
 struct timeval iotimer_get_timeout(struct IOTimerDescriptor *iotimer);
 void iotimer_set_callback(struct IOTimerDescriptor *iotimer, iotimer_callback *callback);
 void iotimer_set_persistent(struct IOTimerDescriptor *iotimer, int persistent);
@@ -0,0 +1,133 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOSockets.h"
+#include "../../IOHandler/IOTimer.h"
+#include "../../IOHandler/IOLog.h"
+
+#define TEST_PORT 12346
+#define TEST_CLIENTS 200
+#define TEST_LINES 500
+#define TEST_TIMEOUT 10
+
+static IOSOCKET_CALLBACK(server_callback);
+static IOSOCKET_CALLBACK(client_callback);
+static IOTIMER_CALLBACK(timeout_callback);
+static IOLOG_CALLBACK(io_log);
+
+static struct IOSocket *accepted[TEST_CLIENTS];
+static int acceptcount = 0;
+static int linecount = 0;
+static int result = 1;
+
+static void connect_client() {
+	struct IOSocket *client = iosocket_connect("127.0.0.1", TEST_PORT, 0, NULL, client_callback);
+	client->parse_delimiter = 1;
+	memset(client->delimiters, '\n', sizeof(client->delimiters));
+}
+
+int main(int argc, char *argv[]) {
+	// "et" as first argument runs the test in edge triggered mode
+	if(argc > 1 && !strcmp(argv[1], "et"))
+		iohandler_set_edge_triggered(1);
+	
+	iohandler_init();
+	iolog_register_callback(io_log);
+	
+	iosocket_listen("127.0.0.1", TEST_PORT, server_callback);
+	
+	struct timeval timeout;
+	gettimeofday(&timeout, NULL);
+	timeout.tv_sec += TEST_TIMEOUT;
+	struct IOTimerDescriptor *timer = iotimer_create(&timeout);
+	iotimer_set_callback(timer, timeout_callback);
+	iotimer_start(timer);
+	
+	connect_client();
+	
+	iohandler_run();
+	
+	return result;
+}
+
+static void send_lines() {
+	int i, j;
+	char line[64];
+	for(i = 0; i < TEST_LINES; i++) {
+		// one buffer per line, shared by all clients
+		int linelen = sprintf(line, "broadcast line %d\n", i);
+		struct IOSocketSharedBuffer *buffer = iosocket_shared_create(line, linelen);
+		for(j = 0; j < TEST_CLIENTS; j++)
+			iosocket_send_shared(accepted[j], buffer);
+		iosocket_shared_release(buffer);
+	}
+}
+
+static IOSOCKET_CALLBACK(server_callback) {
+	switch(event->type) {
+		case IOSOCKETEVENT_ACCEPT:
+			accepted[acceptcount] = event->data.accept_socket;
+			accepted[acceptcount]->callback = server_callback;
+			acceptcount++;
+			if(acceptcount < TEST_CLIENTS)
+				connect_client();
+			else
+				send_lines();
+			break;
+		default:
+			break;
+	}
+}
+
+static IOSOCKET_CALLBACK(client_callback) {
+	switch(event->type) {
+		case IOSOCKETEVENT_RECV:
+			if(strncmp(event->data.recv_str, "broadcast line ", 15)) {
+				printf("unexpected line: %s\n", event->data.recv_str);
+				iohandler_stop();
+				break;
+			}
+			linecount++;
+			if(linecount == TEST_CLIENTS * TEST_LINES) {
+				printf("%d clients received %d lines each\n", TEST_CLIENTS, TEST_LINES);
+				result = 0;
+				iohandler_stop();
+			}
+			break;
+		case IOSOCKETEVENT_NOTCONNECTED:
+		case IOSOCKETEVENT_CLOSED:
+			printf("client lost: %d lines received\n", linecount);
+			iohandler_stop();
+			break;
+		default:
+			break;
+	}
+}
+
+static IOTIMER_CALLBACK(timeout_callback) {
+	printf("timeout: %d clients accepted, %d lines received\n", acceptcount, linecount);
+	iohandler_stop();
+}
+
+static IOLOG_CALLBACK(io_log) {
+	//printf("%s", message);
+}
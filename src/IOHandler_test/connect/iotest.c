@@ -0,0 +1,150 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOSockets.h"
+#include "../../IOHandler/IOTimer.h"
+#include "../../IOHandler/IOLog.h"
+
+#define TEST_PORT 12347
+#define TEST_CLOSED_PORT 12348
+#define TEST_TIMEOUT 10
+
+static IOSOCKET_CALLBACK(server_callback);
+static IOSOCKET_CALLBACK(client_callback);
+static IOTIMER_CALLBACK(timeout_callback);
+static IOLOG_CALLBACK(io_log);
+
+struct connect_test {
+	const char *hostname;
+	const char *bindhost;
+	unsigned int port;
+	enum IOSocketEventType expected;
+	const char *description;
+};
+
+static struct connect_test tests[] = {
+	// localhost usually resolves to ::1 and 127.0.0.1: the IPv6 attempt is refused, the IPv4 attempt connects
+	{"localhost", NULL, TEST_PORT, IOSOCKETEVENT_CONNECTED, "fallback to the next address"},
+	{"127.0.0.1", NULL, TEST_CLOSED_PORT, IOSOCKETEVENT_NOTCONNECTED, "connection refused"},
+	{"127.0.0.1", "::1", TEST_PORT, IOSOCKETEVENT_DNSFAILED, "no address of the bind family"},
+	{NULL, NULL, TEST_PORT, IOSOCKETEVENT_CONNECTED, "race the addresses of a remote host"}, // hostname from argv[1]
+};
+#define TEST_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+static unsigned int current_test = 0;
+static int connect_returned;
+static int failed = 0;
+static struct timeval started;
+
+static void next_test() {
+	if(current_test < TEST_COUNT && !tests[current_test].hostname)
+		current_test++; // no remote host given
+	if(current_test == TEST_COUNT) {
+		iohandler_stop();
+		return;
+	}
+	struct connect_test *test = &tests[current_test];
+	gettimeofday(&started, NULL);
+	
+	// no event may be triggered before iosocket_connect returns (the socket might be closed by then)
+	connect_returned = 0;
+	iosocket_connect(test->hostname, test->port, 0, test->bindhost, client_callback);
+	connect_returned = 1;
+}
+
+int main(int argc, char *argv[]) {
+	iohandler_init();
+	iolog_register_callback(io_log);
+	
+	if(argc > 1) {
+		tests[TEST_COUNT - 1].hostname = argv[1];
+		tests[TEST_COUNT - 1].port = (argc > 2 ? atoi(argv[2]) : 80);
+	}
+	
+	iosocket_listen_flags("127.0.0.1", TEST_PORT, server_callback, IOSOCKET_ADDR_IPV4);
+	
+	struct timeval timeout;
+	gettimeofday(&timeout, NULL);
+	timeout.tv_sec += TEST_TIMEOUT;
+	struct IOTimerDescriptor *timer = iotimer_create(&timeout);
+	iotimer_set_callback(timer, timeout_callback);
+	iotimer_start(timer);
+	
+	next_test();
+	
+	iohandler_run();
+	
+	return failed;
+}
+
+static IOSOCKET_CALLBACK(server_callback) {
+	switch(event->type) {
+		case IOSOCKETEVENT_ACCEPT:
+			event->data.accept_socket->callback = server_callback;
+			break;
+		case IOSOCKETEVENT_CLOSED:
+			iosocket_close(event->socket);
+			break;
+		default:
+			break;
+	}
+}
+
+static IOSOCKET_CALLBACK(client_callback) {
+	struct connect_test *test = &tests[current_test];
+	struct timeval now;
+	const char *result;
+	switch(event->type) {
+		case IOSOCKETEVENT_CONNECTED:
+			result = (event->socket->remoteaddr->address->sa_family == AF_INET6 ? "connected via IPv6" : "connected via IPv4");
+			break;
+		case IOSOCKETEVENT_NOTCONNECTED:
+			result = "not connected";
+			break;
+		case IOSOCKETEVENT_DNSFAILED:
+			result = "dns failed";
+			break;
+		default:
+			return;
+	}
+	gettimeofday(&now, NULL);
+	long msec = (now.tv_sec - started.tv_sec) * 1000 + (now.tv_usec - started.tv_usec) / 1000;
+	
+	int ok = (connect_returned && event->type == test->expected);
+	printf("[test %d] %s (%s): %s after %ld ms%s\n", current_test + 1, test->description, test->hostname, result, msec, (ok ? "" : (connect_returned ? " - FAILED" : " - FAILED (before iosocket_connect returned)")));
+	if(!ok)
+		failed++;
+	
+	if(event->type == IOSOCKETEVENT_CONNECTED)
+		iosocket_close(event->socket);
+	current_test++;
+	next_test();
+}
+
+static IOTIMER_CALLBACK(timeout_callback) {
+	printf("[test %d] timeout\n", current_test + 1);
+	failed++;
+	iohandler_stop();
+}
+
+static IOLOG_CALLBACK(io_log) {
+	//printf("%s", message);
+}
@@ -0,0 +1,90 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _IOHandler_internals
+#include "../../IOHandler/IOInternal.h"
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOSockets.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SIZE (64 * 1024 * 1024) /* 64MB of irc style lines */
+#define BENCH_ROUNDS 5
+
+static unsigned char delimiters[IOSOCKET_PARSE_DELIMITERS_COUNT] = { '\r', '\n' };
+
+/* the line parser's old per byte loop */
+static size_t scan_loop(const unsigned char *delims, const char *buffer, size_t len) {
+	size_t i;
+	int j;
+	for(i = 0; i < len; i++) {
+		for(j = 0; j < IOSOCKET_PARSE_DELIMITERS_COUNT; j++) {
+			if(buffer[i] == delims[j])
+				return i;
+		}
+	}
+	return len;
+}
+
+static size_t count_lines(size_t (*scan)(const unsigned char *delims, const char *buffer, size_t len), const char *buffer, size_t len) {
+	size_t pos = 0, lines = 0;
+	while(pos < len) {
+		pos += scan(delimiters, buffer + pos, len - pos);
+		if(pos == len)
+			break;
+		lines++;
+		pos++;
+	}
+	return lines;
+}
+
+static void run_bench(const char *name, size_t (*scan)(const unsigned char *delims, const char *buffer, size_t len), const char *buffer, size_t len) {
+	size_t lines = 0;
+	int i;
+	clock_t start = clock();
+	for(i = 0; i < BENCH_ROUNDS; i++)
+		lines += count_lines(scan, buffer, len);
+	double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+	printf("%-12s %8.1f MB/s  %6.2f M lines/s  (%zu lines)\n", name, (double) len * BENCH_ROUNDS / secs / (1024 * 1024), lines / secs / 1000000, lines / BENCH_ROUNDS);
+}
+
+int main(int argc, char *argv[]) {
+	char *buffer = malloc(BENCH_SIZE);
+	size_t len = 0;
+	int i;
+
+	if(!buffer)
+		return 1;
+	srand(0);
+	while(len + 512 < BENCH_SIZE) {
+		int msglen = 10 + rand() % 300;
+		len += sprintf(buffer + len, ":nick%d!user@host.example.net PRIVMSG #channel :", rand() % 1000);
+		for(i = 0; i < msglen; i++)
+			buffer[len++] = 'a' + rand() % 26;
+		buffer[len++] = '\r';
+		buffer[len++] = '\n';
+	}
+
+	run_bench("loop", scan_loop, buffer, len);
+	run_bench(iosocket_scan_name(), iosocket_scan_delimiters, buffer, len);
+
+	free(buffer);
+	return 0;
+}
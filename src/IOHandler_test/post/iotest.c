@@ -0,0 +1,78 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOLog.h"
+
+#define TEST_TASKS 20
+#define TEST_INTERVAL 50000 /* 50ms */
+
+static IOHANDLER_TASK(task_done);
+static IOLOG_CALLBACK(io_log);
+
+static struct IOHandlerLoop *main_loop;
+static int taskcount = 0;
+
+static void *worker_main(void *arg) {
+	int i;
+	for(i = 0; i < TEST_TASKS; i++) {
+		usleep(TEST_INTERVAL);
+		
+		// hand the "result" back to the event loop
+		struct timeval *posted = malloc(sizeof(*posted));
+		gettimeofday(posted, NULL);
+		iohandler_post(main_loop, task_done, posted);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t worker;
+	
+	iohandler_init();
+	iolog_register_callback(io_log);
+	
+	main_loop = iohandler_current_loop();
+	pthread_create(&worker, NULL, worker_main, NULL);
+	
+	iohandler_run();
+	
+	pthread_join(worker, NULL);
+	return 0;
+}
+
+static IOHANDLER_TASK(task_done) {
+	struct timeval *posted = arg;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	
+	taskcount++;
+	printf("[task %02d] latency: %ld us\n", taskcount, (now.tv_sec - posted->tv_sec) * 1000000 + (now.tv_usec - posted->tv_usec));
+	free(posted);
+	
+	if(taskcount == TEST_TASKS)
+		iohandler_stop();
+}
+
+static IOLOG_CALLBACK(io_log) {
+	//printf("%s", message);
+}
@@ -0,0 +1,75 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOSockets.h"
+#include "../../IOHandler/IOLog.h"
+
+#define TEST_LOOPS 4
+
+static IOHANDLER_LOOP_INIT(loop_init);
+static IOSOCKET_CALLBACK(io_callback);
+static IOLOG_CALLBACK(io_log);
+
+int main(int argc, char *argv[]) {
+	int loops = TEST_LOOPS;
+	if(argc > 1)
+		loops = atoi(argv[1]);
+	
+	iolog_register_callback(io_log);
+	
+	iohandler_run_loops(loops, loop_init, NULL);
+	
+	return 0;
+}
+
+static IOHANDLER_LOOP_INIT(loop_init) {
+	// every loop listens on the same port, the kernel balances the connections
+	struct IOSocket *listener = iosocket_listen_flags("0.0.0.0", 12345, io_callback, IOSOCKET_ADDR_IPV4 | IOSOCKET_REUSEPORT);
+	listener->data = loop;
+	printf("[loop %d] listening\n", iohandler_loop_id(loop));
+}
+
+static IOSOCKET_CALLBACK(io_callback) {
+	switch(event->type) {
+		case IOSOCKETEVENT_ACCEPT:
+			printf("[loop %d] client accepted\n", iohandler_loop_id(iohandler_current_loop()));
+			struct IOSocket *client = event->data.accept_socket;
+			client->callback = io_callback;
+			
+			char *html = "<html><head><title>Test Page</title></head><body><h1>IOHandler Multi Loop Test</h1></body></html>";
+			iosocket_printf(client, "HTTP/1.1 200 OK\r\n");
+			iosocket_printf(client, "Server: Apache\r\n");
+			iosocket_printf(client, "Content-Length: %d\r\n", strlen(html));
+			iosocket_printf(client, "Content-Type: text/html\r\n");
+			iosocket_printf(client, "\r\n");
+			iosocket_printf(client, "%s", html);
+			break;
+		case IOSOCKETEVENT_RECV:
+			event->data.recv_buf->bufpos = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+static IOLOG_CALLBACK(io_log) {
+	//printf("%s", message);
+}
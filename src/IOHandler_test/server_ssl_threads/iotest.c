@@ -0,0 +1,141 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOSockets.h"
+#include "../../IOHandler/IOTimer.h"
+#include "../../IOHandler/IOLog.h"
+
+#define TEST_PORT 12349
+#define TEST_LOOPS 2
+#define TEST_THREADS 4
+#define TEST_CLIENTS 100 /* per loop */
+#define TEST_TIMEOUT 10
+
+static IOHANDLER_LOOP_INIT(loop_init);
+static IOSOCKET_CALLBACK(server_callback);
+static IOSOCKET_CALLBACK(client_callback);
+static IOTIMER_CALLBACK(timeout_callback);
+static IOLOG_CALLBACK(io_log);
+
+static const char *certfile = "../server_ssl/cert.pem";
+static const char *keyfile = "../server_ssl/key.pem";
+static int abort_early; /* stop the loops while handshakes are still running on the workers */
+static int greeted = 0; /* clients that received the greeting (all loops) */
+static int accepted = 0;
+static int failed = 0;
+
+int main(int argc, char *argv[]) {
+	int result = 0;
+	if(argc > 2) {
+		certfile = argv[1];
+		keyfile = argv[2];
+	}
+	
+	iolog_register_callback(io_log);
+	iohandler_set_ssl_threads(TEST_THREADS);
+	
+	// all handshakes complete on the workers
+	abort_early = 0;
+	iohandler_run_loops(TEST_LOOPS, loop_init, NULL);
+	printf("offloaded handshakes: %d of %d clients greeted, %d failed\n", greeted, TEST_LOOPS * TEST_CLIENTS, failed);
+	if(greeted != TEST_LOOPS * TEST_CLIENTS)
+		result = 1;
+	
+	// the loops stop with handshakes in flight: the workers must hand them back before the loops are freed
+	abort_early = 1;
+	greeted = accepted = failed = 0;
+	iohandler_run_loops(TEST_LOOPS, loop_init, NULL);
+	printf("stopped with handshakes in flight: %d accepted\n", accepted);
+	
+	return result;
+}
+
+static IOHANDLER_LOOP_INIT(loop_init) {
+	int i;
+	// every loop listens before it connects, so its clients are never refused
+	if(!iosocket_listen_ssl_flags("127.0.0.1", TEST_PORT, certfile, keyfile, server_callback, IOSOCKET_ADDR_IPV4 | IOSOCKET_REUSEPORT)) {
+		printf("[loop %d] could not listen on port %d\n", iohandler_loop_id(loop), TEST_PORT);
+		iohandler_stop_loops();
+		return;
+	}
+	if(iohandler_loop_id(loop) == 0) {
+		struct timeval timeout;
+		gettimeofday(&timeout, NULL);
+		timeout.tv_sec += TEST_TIMEOUT;
+		struct IOTimerDescriptor *timer = iotimer_create(&timeout);
+		iotimer_set_callback(timer, timeout_callback);
+		iotimer_start(timer);
+	}
+	for(i = 0; i < TEST_CLIENTS; i++) {
+		struct IOSocket *client = iosocket_connect("127.0.0.1", TEST_PORT, 1, NULL, client_callback);
+		client->parse_delimiter = 1;
+		memset(client->delimiters, '\n', sizeof(client->delimiters));
+	}
+}
+
+static IOSOCKET_CALLBACK(server_callback) {
+	switch(event->type) {
+		case IOSOCKETEVENT_ACCEPT:
+			event->data.accept_socket->callback = server_callback;
+			iosocket_printf(event->data.accept_socket, "hello\n");
+			if(__atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED) == 1 && abort_early)
+				iohandler_stop_loops();
+			break;
+		case IOSOCKETEVENT_RECV:
+			event->data.recv_buf->bufpos = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+static IOSOCKET_CALLBACK(client_callback) {
+	switch(event->type) {
+		case IOSOCKETEVENT_RECV:
+			if(strcmp(event->data.recv_str, "hello")) {
+				printf("unexpected line: %s\n", event->data.recv_str);
+				iohandler_stop_loops();
+				break;
+			}
+			if(__atomic_add_fetch(&greeted, 1, __ATOMIC_RELAXED) == TEST_LOOPS * TEST_CLIENTS)
+				iohandler_stop_loops();
+			break;
+		case IOSOCKETEVENT_NOTCONNECTED:
+		case IOSOCKETEVENT_CLOSED:
+			if(abort_early || __atomic_load_n(&greeted, __ATOMIC_RELAXED) == TEST_LOOPS * TEST_CLIENTS)
+				break; // closed by the stopping loops
+			if(!__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED))
+				printf("client lost after %d greetings\n", greeted);
+			break;
+		default:
+			break;
+	}
+}
+
+static IOTIMER_CALLBACK(timeout_callback) {
+	printf("timeout: %d clients accepted, %d greeted\n", accepted, greeted);
+	iohandler_stop_loops();
+}
+
+static IOLOG_CALLBACK(io_log) {
+	//printf("%s", message);
+}
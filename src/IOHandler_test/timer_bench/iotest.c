@@ -0,0 +1,109 @@
+/* main.c - IOMultiplexer
+ * Copyright (C) 2012  Philipp Kreil (pk910)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include "../../IOHandler/IOHandler.h"
+#include "../../IOHandler/IOTimer.h"
+#include "../../IOHandler/IOLog.h"
+
+#define BENCH_TIMERS 100000
+#define BENCH_DURATION 5 /* seconds */
+
+static IOTIMER_CALLBACK(bench_tick);
+static IOTIMER_CALLBACK(bench_done);
+static IOLOG_CALLBACK(io_log);
+
+static struct IOTimerDescriptor *timers[BENCH_TIMERS];
+static unsigned long ticks = 0, rearms = 0;
+static struct timeval start;
+static clock_t start_cpu;
+
+int main(int argc, char *argv[]) {
+	struct timeval timeout, interval;
+	int i;
+	
+	iohandler_init();
+	iolog_register_callback(io_log);
+	srand(0);
+	
+	gettimeofday(&start, NULL);
+	start_cpu = clock();
+	for(i = 0; i < BENCH_TIMERS; i++) {
+		// intervals between 10ms and 1s, first expiry spread over one interval
+		interval.tv_sec = 0;
+		interval.tv_usec = 10000 + (rand() % 990) * 1000;
+		if(interval.tv_usec >= 1000000) {
+			interval.tv_sec = 1;
+			interval.tv_usec -= 1000000;
+		}
+		timeout = start;
+		timeout.tv_usec += rand() % 1000000;
+		if(timeout.tv_usec >= 1000000) {
+			timeout.tv_sec++;
+			timeout.tv_usec -= 1000000;
+		}
+		timers[i] = iotimer_create(&timeout);
+		iotimer_set_autoreload(timers[i], &interval);
+		iotimer_set_callback(timers[i], bench_tick);
+		iotimer_start(timers[i]);
+	}
+	printf("created %d periodic timers in %.3f s cpu\n", BENCH_TIMERS, (double) (clock() - start_cpu) / CLOCKS_PER_SEC);
+	
+	timeout = start;
+	timeout.tv_sec += BENCH_DURATION;
+	struct IOTimerDescriptor *done = iotimer_create(&timeout);
+	iotimer_set_callback(done, bench_done);
+	iotimer_start(done);
+	
+	start_cpu = clock();
+	iohandler_run();
+	
+	for(i = 0; i < BENCH_TIMERS; i++)
+		iotimer_destroy(timers[i]);
+	return 0;
+}
+
+static IOTIMER_CALLBACK(bench_tick) {
+	ticks++;
+	
+	// every 16th tick pushes another timer back (like an idle timeout being refreshed)
+	if((ticks & 15) == 0) {
+		struct IOTimerDescriptor *timer = timers[rand() % BENCH_TIMERS];
+		struct timeval timeout = iotimer_get_timeout(timer);
+		timeout.tv_sec++;
+		iotimer_set_timeout(timer, &timeout);
+		rearms++;
+	}
+}
+
+static IOTIMER_CALLBACK(bench_done) {
+	struct timeval now;
+	double elapsed, cpu;
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+	cpu = (double) (clock() - start_cpu) / CLOCKS_PER_SEC;
+	
+	printf("%lu timer callbacks (%lu rearms) in %.3f s: %.0f callbacks/s, %.3f s cpu (%.2f us per callback)\n", ticks, rearms, elapsed, ticks / elapsed, cpu, (ticks ? cpu * 1000000 / ticks : 0));
+	iohandler_stop();
+}
+
+static IOLOG_CALLBACK(io_log) {
+	//printf("%s", message);
+}